@@ -0,0 +1,171 @@
+#include "Resolver.hxx"
+#include <errno.h>
+#include <string.h>
+
+namespace SockAddr {
+
+#if EV_MULTIPLICITY
+#define RESOLVER_EV_A m_loop
+#define RESOLVER_EV_A_ RESOLVER_EV_A ,
+#else
+#define RESOLVER_EV_A
+#define RESOLVER_EV_A_
+#endif
+
+bool Resolver::key::operator <(key const &b) const throw() {
+	if( this->host != b.host ) return this->host < b.host;
+	if( this->port != b.port ) return this->port < b.port;
+	if( this->family != b.family ) return this->family < b.family;
+	if( this->socktype != b.socktype ) return this->socktype < b.socktype;
+	return this->protocol < b.protocol;
+}
+
+Resolver::Resolver(EV_P_ double ttl, double negative_ttl, unsigned int threads) throw(Errno)
+: m_ttl(ttl), m_negative_ttl(negative_ttl), m_lookups(0), m_stop(false) {
+#if EV_MULTIPLICITY
+	m_loop = EV_A;
+#endif
+	pthread_mutex_init(&m_lock, NULL);
+	pthread_cond_init(&m_todo_cond, NULL);
+
+	ev_async_init(&m_done_watcher, done);
+	m_done_watcher.data = this;
+	ev_async_start(RESOLVER_EV_A_ &m_done_watcher);
+	ev_unref(RESOLVER_EV_A); // Waiting for lookups does not keep the loop running
+
+	for( unsigned int i = 0; i < threads || i == 0; i++ ) {
+		pthread_t t;
+		int err = pthread_create(&t, NULL, thread_main, this);
+		if( err != 0 ) {
+			this->stop();
+			throw Errno("Could not pthread_create()", err);
+		}
+		m_threads.push_back(t);
+	}
+}
+
+Resolver::~Resolver() throw() {
+	this->stop();
+}
+
+void Resolver::stop() throw() {
+	pthread_mutex_lock(&m_lock);
+	m_stop = true;
+	pthread_cond_broadcast(&m_todo_cond);
+	pthread_mutex_unlock(&m_lock);
+
+	for( typeof(m_threads.begin()) i = m_threads.begin(); i != m_threads.end(); i++ ) {
+		pthread_join(*i, NULL);
+	}
+	m_threads.clear();
+
+	for( ; m_lookups > 0; m_lookups-- ) ev_unref(RESOLVER_EV_A);
+	ev_ref(RESOLVER_EV_A);
+	ev_async_stop(RESOLVER_EV_A_ &m_done_watcher);
+	pthread_cond_destroy(&m_todo_cond);
+	pthread_mutex_destroy(&m_lock);
+}
+
+void Resolver::resolve(std::string const &host, std::string const &port,
+                       callback_t cb, void *data,
+                       int const family, int const socktype, int const protocol) {
+	if( is_numeric(host) ) {
+		std::vector<SockAddr> addrs;
+		int error = ::SockAddr::resolve(&addrs, host, port, family, socktype, protocol);
+		cb(addrs, error, data);
+		return;
+	}
+
+	key k;
+	k.host = host;
+	k.port = port;
+	k.family = family;
+	k.socktype = socktype;
+	k.protocol = protocol;
+
+	typeof(m_cache.begin()) c = m_cache.find(k);
+	if( c != m_cache.end() ) {
+		if( c->second.expires > ev_now(RESOLVER_EV_A) ) {
+			cb(c->second.addrs, c->second.error, data);
+			return;
+		}
+		m_cache.erase(c);
+	}
+
+	waiter w;
+	w.cb = cb;
+	w.data = data;
+	bool in_progress = m_waiting.count(k) > 0;
+	m_waiting.insert( std::make_pair(k, w) );
+	if( in_progress ) return;
+
+	ev_ref(RESOLVER_EV_A); // Until its result is in
+	m_lookups++;
+	pthread_mutex_lock(&m_lock);
+	m_todo.push_back(k);
+	pthread_cond_signal(&m_todo_cond);
+	pthread_mutex_unlock(&m_lock);
+}
+
+void *Resolver::thread_main(void *arg) {
+	Resolver *r = static_cast<Resolver*>(arg);
+
+	pthread_mutex_lock(&r->m_lock);
+	for(;;) {
+		while( !r->m_stop && r->m_todo.empty() ) {
+			pthread_cond_wait(&r->m_todo_cond, &r->m_lock);
+		}
+		if( r->m_stop ) break;
+
+		std::pair<key, result> job;
+		job.first = r->m_todo.front();
+		r->m_todo.pop_front();
+		pthread_mutex_unlock(&r->m_lock);
+
+		job.second.error = ::SockAddr::resolve(&job.second.addrs, job.first.host, job.first.port,
+		                                       job.first.family, job.first.socktype, job.first.protocol);
+
+		pthread_mutex_lock(&r->m_lock);
+		r->m_done.push_back(job);
+#if EV_MULTIPLICITY
+		ev_async_send(r->m_loop, &r->m_done_watcher);
+#else
+		ev_async_send(&r->m_done_watcher);
+#endif
+	}
+	pthread_mutex_unlock(&r->m_lock);
+
+	return NULL;
+}
+
+void Resolver::done(EV_P_ ev_async *w, int revents) {
+	Resolver *r = static_cast<Resolver*>(w->data);
+	std::deque< std::pair<key, result> > done;
+
+	pthread_mutex_lock(&r->m_lock);
+	done.swap(r->m_done);
+	pthread_mutex_unlock(&r->m_lock);
+
+	for( typeof(done.begin()) i = done.begin(); i != done.end(); i++ ) {
+		result &res = i->second;
+		res.expires = ev_now(EV_A) + ( res.error == 0 ? r->m_ttl : r->m_negative_ttl );
+		r->m_cache[i->first] = res;
+
+		/* Take the waiters out first: a callback may resolve this name
+		 * again, which is then answered from the cache.
+		 */
+		typeof(r->m_waiting.begin()) first = r->m_waiting.lower_bound(i->first),
+		                             last = r->m_waiting.upper_bound(i->first);
+		std::vector<waiter> waiters;
+		for( typeof(first) j = first; j != last; j++ ) waiters.push_back(j->second);
+		r->m_waiting.erase(first, last);
+		ev_unref(EV_A);
+		r->m_lookups--;
+
+		for( typeof(waiters.begin()) j = waiters.begin(); j != waiters.end(); j++ ) {
+			j->cb(res.addrs, res.error, j->data);
+		}
+	}
+}
+
+} // namespace
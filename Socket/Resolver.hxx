@@ -0,0 +1,103 @@
+#ifndef __RESOLVER_HXX__
+#define __RESOLVER_HXX__
+
+#include <ev.h>
+#include <pthread.h>
+#include <map>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "Errno.hxx"
+#include "SockAddr.hxx"
+
+namespace SockAddr {
+
+/**
+ * Asynchronous, caching name resolution
+ * getaddrinfo() blocks, so it is called on a few threads of our own; the
+ * results are delivered in the event loop through an ev_async. Results are
+ * cached for @ttl seconds, failures for @negative_ttl seconds, and concurrent
+ * lookups of the same name share one getaddrinfo(). So a storm of reconnects
+ * to the same peer costs one lookup in the cache each.
+ *
+ * Numeric addresses and cache hits don't need a thread: their callback is
+ * called from within resolve().
+ */
+class Resolver {
+public:
+	/**
+	 * Called in the event loop with the addresses, or with the getaddrinfo()
+	 * error (see gai_strerror()) and no addresses
+	 * It must not destroy the Resolver.
+	 */
+	typedef void (*callback_t)(std::vector<SockAddr> const &addrs, int error, void *data);
+
+	Resolver(EV_P_ double ttl = 60, double negative_ttl = 5, unsigned int threads = 2) throw(Errno);
+
+	/**
+	 * Waits for running lookups to finish; their callbacks are not called
+	 */
+	~Resolver() throw();
+
+	/**
+	 * Resolve @host and @port as SockAddr::resolve() does, and call @cb
+	 * with @data when done
+	 */
+	void resolve(std::string const &host, std::string const &port,
+	             callback_t cb, void *data,
+	             int const family = 0, int const socktype = 0, int const protocol = 0);
+
+	/**
+	 * Forget all cached results
+	 */
+	void flush() throw() { m_cache.clear(); }
+	size_t cache_size() const throw() { return m_cache.size(); }
+
+private:
+	struct key {
+		std::string host, port;
+		int family, socktype, protocol;
+
+		bool operator <(key const &b) const throw();
+	};
+	struct result {
+		std::vector<SockAddr> addrs;
+		int error;
+		ev_tstamp expires;
+	};
+	struct waiter {
+		callback_t cb;
+		void *data;
+	};
+
+#if EV_MULTIPLICITY
+	struct ev_loop *m_loop;
+#endif
+	double m_ttl, m_negative_ttl;
+
+	std::map<key, result> m_cache;
+	std::multimap<key, waiter> m_waiting; // Lookups in progress, by name
+	unsigned int m_lookups; // Names in m_waiting, each holding a loop reference
+
+	// Shared with the threads, under m_lock
+	pthread_mutex_t m_lock;
+	pthread_cond_t m_todo_cond;
+	std::deque<key> m_todo;
+	std::deque< std::pair<key, result> > m_done;
+	bool m_stop;
+
+	std::vector<pthread_t> m_threads;
+	ev_async m_done_watcher;
+
+	Resolver(Resolver const &);
+	Resolver & operator =(Resolver const &);
+
+	static void *thread_main(void *arg);
+	static void done(EV_P_ ev_async *w, int revents);
+	void stop() throw();
+};
+
+} // namespace
+
+#endif // __RESOLVER_HXX__
@@ -12,30 +12,108 @@
 
 namespace SockAddr {
 
-bool SockAddr::address_equal(SockAddr const &b) const throw() {
-	if( this->addr_family() != b.addr_family() ) return false;
-	switch( this->addr_family() ) {
+SockAddr::SockAddr(struct sockaddr_in const &addr) throw() {
+	memset(&m_addr, 0, sizeof(m_addr));
+	struct sockaddr_in *a = reinterpret_cast<struct sockaddr_in*>(&m_addr);
+#ifdef SOCKADDR_HAS_LEN_FIELD
+	a->sin_len = sizeof(*a);
+#endif
+	a->sin_family = AF_INET;
+	a->sin_port = addr.sin_port;
+	a->sin_addr.s_addr = addr.sin_addr.s_addr;
+}
+
+SockAddr::SockAddr(struct sockaddr_in6 const &addr) throw() {
+	memset(&m_addr, 0, sizeof(m_addr));
+	struct sockaddr_in6 *a = reinterpret_cast<struct sockaddr_in6*>(&m_addr);
+#ifdef SOCKADDR_HAS_LEN_FIELD
+	a->sin6_len = sizeof(*a);
+#endif
+	a->sin6_family = AF_INET6;
+	a->sin6_port = addr.sin6_port;
+	a->sin6_flowinfo = addr.sin6_flowinfo;
+	a->sin6_addr = addr.sin6_addr;
+	a->sin6_scope_id = addr.sin6_scope_id;
+}
+
+bool SockAddr::operator <(SockAddr const &b) const throw() {
+	if( m_addr.ss_family != b.m_addr.ss_family ) return m_addr.ss_family < b.m_addr.ss_family;
+	int c = 0;
+	switch( m_addr.ss_family ) {
 	case AF_INET:
-		return dynamic_cast<Inet4 const *>(this)->address_equal( dynamic_cast<Inet4 const &>(b) );
+		c = memcmp(&in4().sin_addr, &b.in4().sin_addr, sizeof(struct in_addr));
+		break;
 	case AF_INET6:
-		return dynamic_cast<Inet6 const *>(this)->address_equal( dynamic_cast<Inet6 const &>(b) );
+		c = memcmp(&in6().sin6_addr, &b.in6().sin6_addr, sizeof(struct in6_addr));
+		break;
+	}
+	if( c != 0 ) return c < 0;
+	return this->port_number() < b.port_number();
+}
+
+size_t SockAddr::hash() const throw() {
+	unsigned char const *p = NULL;
+	size_t len = 0;
+	switch( m_addr.ss_family ) {
+	case AF_INET:
+		p = reinterpret_cast<unsigned char const*>(&in4().sin_addr);
+		len = sizeof(struct in_addr);
+		break;
+	case AF_INET6:
+		p = reinterpret_cast<unsigned char const*>(&in6().sin6_addr);
+		len = sizeof(struct in6_addr);
+		break;
+	}
+	uint64_t h = 14695981039346656037ULL; // FNV-1a
+	h = ( h ^ m_addr.ss_family ) * 1099511628211ULL;
+	h = ( h ^ this->port_number() ) * 1099511628211ULL;
+	for( size_t i = 0; i < len; i++ ) h = ( h ^ p[i] ) * 1099511628211ULL;
+	return h;
+}
+
+char *SockAddr::format(char *buf, size_t len) const throw() {
+	char address[INET6_ADDRSTRLEN];
+	void const *a;
+	switch( m_addr.ss_family ) {
+	case AF_INET:  a = &in4().sin_addr; break;
+	case AF_INET6: a = &in6().sin6_addr; break;
+	default:
+		errno = EAFNOSUPPORT;
+		return NULL;
+	}
+	if( inet_ntop(m_addr.ss_family, a, address, sizeof(address)) == NULL ) return NULL;
+
+	int rv = snprintf(buf, len, "[%s]:%d", address, this->port_number());
+	if( rv < 0 ) return NULL;
+	if( (size_t)rv >= len ) {
+		errno = ENOSPC;
+		return NULL;
+	}
+	return buf;
+}
+
+std::string SockAddr::string() const throw(Errno) {
+	char buf[string_max];
+	if( this->format(buf, sizeof(buf)) == NULL ) {
+		throw Errno("Could not convert address to text", errno);
 	}
+	return std::string(buf);
 }
 
-std::auto_ptr<SockAddr> create(struct sockaddr_storage const *addr) throw(std::invalid_argument) {
+SockAddr create(struct sockaddr_storage const *addr) throw(std::invalid_argument) {
 	if( addr == NULL ) throw std::invalid_argument("Empty address");
 
 	switch( addr->ss_family ) {
 	case AF_INET:
-		return std::auto_ptr<SockAddr>( new Inet4( *reinterpret_cast<const struct sockaddr_in*>(addr) ) );
+		return SockAddr( *reinterpret_cast<const struct sockaddr_in*>(addr) );
 	case AF_INET6:
-		return std::auto_ptr<SockAddr>( new Inet6( *reinterpret_cast<const struct sockaddr_in6*>(addr) ) );
+		return SockAddr( *reinterpret_cast<const struct sockaddr_in6*>(addr) );
 	default:
 		throw(std::invalid_argument("Unknown address family"));
 	}
 }
 
-std::auto_ptr<SockAddr> translate(std::string const &host, unsigned short const port) throw(std::invalid_argument) {
+SockAddr translate(std::string const &host, unsigned short const port) throw(std::invalid_argument) {
 	bool looks_like_v4 = ( host.find('.') != std::string::npos );
 	bool looks_like_v6 = ( host.find(':') != std::string::npos );
 	if( ( !looks_like_v4 && !looks_like_v6 ) || ( looks_like_v4 && looks_like_v6 ) ) {
@@ -79,8 +157,9 @@ std::auto_ptr<SockAddr> translate(std::string const &host, unsigned short const
 	}
 }
 
-std::auto_ptr< boost::ptr_vector< SockAddr > > resolve(std::string const &host, std::string const &port, int const family, int const socktype, int const protocol, bool const v4_mapped) {
+int resolve(std::vector<SockAddr> *ret, std::string const &host, std::string const &port, int const family, int const socktype, int const protocol, bool const v4_mapped) {
 	struct addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
 	hints.ai_family = family;
 	hints.ai_socktype = socktype;
 	hints.ai_protocol = protocol;
@@ -88,14 +167,16 @@ std::auto_ptr< boost::ptr_vector< SockAddr > > resolve(std::string const &host,
 	if( v4_mapped ) hints.ai_flags = AI_V4MAPPED;
 
 	int hstart = 0, hend = host.length();
-	if( host[0] == '[' && host[ host.length()-1 ] == ']' ) {
-		hstart = 1;
-		hend -= 2;
+	if( is_numeric(host) ) {
+		if( host[0] == '[' ) {
+			hstart = 1;
+			hend -= 2;
+		}
 		hints.ai_flags |= AI_NUMERICHOST;
 	}
 
 	int pstart = 0, pend = port.length();
-	if( port[0] == '[' && port[ port.length()-1 ] == ']' ) {
+	if( port.length() >= 2 && port[0] == '[' && port[ port.length()-1 ] == ']' ) {
 		pstart = 1;
 		pend -= 2;
 		hints.ai_flags |= AI_NUMERICSERV;
@@ -103,42 +184,55 @@ std::auto_ptr< boost::ptr_vector< SockAddr > > resolve(std::string const &host,
 
 	struct addrinfo *res;
 	int rv = getaddrinfo(host.substr(hstart,hend).c_str(), port.substr(pstart,pend).c_str(), &hints, &res);
-	if( rv != 0 ) {
-		std::ostringstream e;
-		e << "Could not getaddrinfo(\"" << host << "\", \"" << port << "\"): ";
-		e << gai_strerror(rv);
-		throw std::runtime_error(e.str());
-	}
+	if( rv != 0 ) return rv;
 
 	struct addrinfo *p = res;
-	std::auto_ptr< boost::ptr_vector< SockAddr > > ret( new boost::ptr_vector< SockAddr> );
 	while( p != NULL ) {
-		std::auto_ptr<SockAddr> a( create( reinterpret_cast<sockaddr_storage*>(p->ai_addr) ) );
-		ret->push_back( a.release() );
+		ret->push_back( create( reinterpret_cast<sockaddr_storage*>(p->ai_addr) ) );
 
 		p = p->ai_next;
 	}
 
 	freeaddrinfo(res);
 
+	return 0;
+}
+
+std::vector<SockAddr> resolve(std::string const &host, std::string const &port, int const family, int const socktype, int const protocol, bool const v4_mapped) {
+	std::vector<SockAddr> ret;
+	int rv = resolve(&ret, host, port, family, socktype, protocol, v4_mapped);
+	if( rv != 0 ) {
+		std::ostringstream e;
+		e << "Could not getaddrinfo(\"" << host << "\", \"" << port << "\"): ";
+		e << gai_strerror(rv);
+		throw std::runtime_error(e.str());
+	}
 	return ret;
 }
 
-std::auto_ptr< boost::ptr_vector< SockAddr > > getifaddrs() {
-	std::auto_ptr< boost::ptr_vector< SockAddr > > ret( new boost::ptr_vector< SockAddr> );
+bool is_numeric(std::string const &host) throw() {
+	if( host.length() >= 2 && host[0] == '[' && host[ host.length()-1 ] == ']' ) return true;
+
+	union {
+		struct in_addr a4;
+		struct in6_addr a6;
+	} a;
+	return inet_pton(AF_INET, host.c_str(), &a) == 1
+	    || inet_pton(AF_INET6, host.c_str(), &a) == 1;
+}
+
+std::vector<SockAddr> getifaddrs() {
+	std::vector<SockAddr> ret;
 
 	struct ifaddrs *ifap;
-	int rv = ::getifaddrs(&ifap);
+	if( ::getifaddrs(&ifap) == -1 ) return ret;
 
-	while( ifap != NULL ) {
+	for( struct ifaddrs *i = ifap; i != NULL; i = i->ifa_next ) {
 		try {
-			std::auto_ptr<SockAddr> a( create( reinterpret_cast<sockaddr_storage*>(ifap->ifa_addr) ) );
-			ret->push_back( a.release() );
+			ret.push_back( create( reinterpret_cast<sockaddr_storage*>(i->ifa_addr) ) );
 		} catch( std::invalid_argument &e ) {
 			// Unknown address family, ignore
 		}
-	
-		ifap = ifap->ifa_next;
 	}
 
 	freeifaddrs(ifap);
@@ -146,74 +240,4 @@ std::auto_ptr< boost::ptr_vector< SockAddr > > getifaddrs() {
 	return ret;
 }
 
-Inet4::Inet4(struct sockaddr_in const &addr) throw() {
-	bzero(&m_addr, sizeof(m_addr));
-#ifdef SOCKADDR_HAS_LEN_FIELD
-	m_addr.sin_len = sizeof(m_addr);
-#endif
-	m_addr.sin_family = addr.sin_family;
-	m_addr.sin_port = addr.sin_port;
-	m_addr.sin_addr.s_addr = addr.sin_addr.s_addr;
-}
-
-std::string Inet4::string() const throw(Errno) {
-	std::string a("[");
-	{
-		char address[INET_ADDRSTRLEN];
-		if( inet_ntop(AF_INET, &m_addr.sin_addr, address, sizeof(address)) == NULL ) {
-			throw Errno("Could not convert IPv4 address to text", errno);
-		}
-		a.append(address);
-	}
-
-	a.append("]:");
-
-	{
-		char port[6];
-		int rv = snprintf(port, sizeof(port), "%d", ntohs(m_addr.sin_port));
-		assert( rv < (signed)sizeof(port) ); // unsigned shorts are always 5 digits or less
-		if( rv == -1 ) {
-			throw Errno("Could not convert IPv4 address to text", errno);
-		}
-		a.append(port);
-	}
-	return a;
-}
-
-Inet6::Inet6(struct sockaddr_in6 const &addr) throw() {
-	bzero(&m_addr, sizeof(m_addr));
-#ifdef SOCKADDR_HAS_LEN_FIELD
-	m_addr.sin6_len = sizeof(m_addr);
-#endif
-	m_addr.sin6_family = AF_INET6;
-	m_addr.sin6_port = addr.sin6_port;
-	m_addr.sin6_flowinfo = addr.sin6_flowinfo;
-	for( unsigned int i = 0; i < sizeof(addr.sin6_addr.s6_addr); i++) m_addr.sin6_addr.s6_addr[i] = addr.sin6_addr.s6_addr[i];
-	m_addr.sin6_scope_id = addr.sin6_scope_id;
-}
-
-std::string Inet6::string() const throw(std::runtime_error) {
-	std::string a("[");
-	{
-		char address[INET6_ADDRSTRLEN];
-		if( inet_ntop(AF_INET6, &m_addr.sin6_addr, address, sizeof(address)) == NULL ) {
-			throw Errno("Could not convert IPv6 address to text", errno);
-		}
-		a.append(address);
-	}
-
-	a.append("]:");
-
-	{
-		char port[6];
-		int rv = snprintf(port, sizeof(port), "%d", ntohs(m_addr.sin6_port));
-		assert( rv < (signed)sizeof(port) ); // unsigned shorts are always 5 digits or less
-		if( rv == -1 ) {
-			throw Errno("Could not convert IPv6 address to text", errno);
-		}
-		a.append(port);
-	}
-	return a;
-}
-
 } // namespace
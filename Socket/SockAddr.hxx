@@ -3,113 +3,144 @@
 
 #include "../config.h"
 #include <netinet/in.h>
-#include <memory>
+#include <arpa/inet.h>
+#include <string.h>
+#include <stdint.h>
 #include <string>
-#include <boost/ptr_container/ptr_vector.hpp>
+#include <vector>
+#include <stdexcept>
 
 #include "Errno.hxx"
 
 namespace SockAddr {
 
+/**
+ * An IPv4 or IPv6 socket address, by value
+ * Fixed size and trivially copyable: no allocation and no virtual calls.
+ * A default constructed SockAddr has family AF_UNSPEC.
+ */
 class SockAddr {
 protected:
-	SockAddr() throw() {}
+	struct sockaddr_storage m_addr;
 
-public:
-	virtual ~SockAddr() throw() {};
+	struct sockaddr_in const &in4() const throw() {
+		return *reinterpret_cast<struct sockaddr_in const*>(&m_addr); }
+	struct sockaddr_in6 const &in6() const throw() {
+		return *reinterpret_cast<struct sockaddr_in6 const*>(&m_addr); }
 
-	virtual operator struct sockaddr const*() const throw() =0;
-	virtual socklen_t const addr_len() const throw() =0;
+public:
+	/**
+	 * Enough room for string() and format(), including the '\0'
+	 */
+	enum { string_max = INET6_ADDRSTRLEN + 9 }; // "[" address "]:" port
+
+	SockAddr() throw() { memset(&m_addr, 0, sizeof(m_addr)); m_addr.ss_family = AF_UNSPEC; }
+	SockAddr(struct sockaddr_in const &addr) throw();
+	SockAddr(struct sockaddr_in6 const &addr) throw();
+
+	operator struct sockaddr const*() const throw() {
+		return reinterpret_cast<struct sockaddr const*>(&m_addr); }
+	socklen_t addr_len() const throw() {
+		switch( m_addr.ss_family ) {
+		case AF_INET:  return sizeof(struct sockaddr_in);
+		case AF_INET6: return sizeof(struct sockaddr_in6);
+		default:       return 0;
+		}
+	}
 
-	virtual bool operator ==(SockAddr const &b) const throw() {
+	bool operator ==(SockAddr const &b) const throw() {
 		return this->port_equal(b) && this->address_equal(b);
 	}
-	virtual bool address_equal(SockAddr const &b) const throw();
-	virtual bool port_equal(SockAddr const &b) const throw() {
+	bool operator !=(SockAddr const &b) const throw() { return !( *this == b ); }
+	bool operator <(SockAddr const &b) const throw();
+
+	bool address_equal(SockAddr const &b) const throw() {
+		if( m_addr.ss_family != b.m_addr.ss_family ) return false;
+		switch( m_addr.ss_family ) {
+		case AF_INET:  return in4().sin_addr.s_addr == b.in4().sin_addr.s_addr;
+		case AF_INET6: return memcmp(&in6().sin6_addr, &b.in6().sin6_addr, sizeof(struct in6_addr)) == 0;
+		default:       return true;
+		}
+	}
+	bool port_equal(SockAddr const &b) const throw() {
 		return this->port_number() == b.port_number();
 	}
 
-	virtual std::string string() const throw(std::runtime_error) = 0;
-
-	virtual int const proto_family() const throw() =0;
-	virtual int const addr_family() const throw() =0;
-
-	virtual int const port_number() const throw() =0;
+	/**
+	 * Hash of the address and port, e.g. for a hash table of peers
+	 */
+	size_t hash() const throw();
+
+	/**
+	 * Format as "[address]:port" into @buf, of @len bytes (string_max is
+	 * always enough)
+	 * Returns @buf, or NULL (with errno set) on failure
+	 */
+	char *format(char *buf, size_t len) const throw();
+	std::string string() const throw(Errno);
+
+	int proto_family() const throw() {
+		return m_addr.ss_family == AF_INET6 ? PF_INET6 : m_addr.ss_family == AF_INET ? PF_INET : PF_UNSPEC; }
+	int addr_family() const throw() { return m_addr.ss_family; }
+
+	int port_number() const throw() {
+		switch( m_addr.ss_family ) {
+		case AF_INET:  return ntohs(in4().sin_port);
+		case AF_INET6: return ntohs(in6().sin6_port);
+		default:       return 0;
+		}
+	}
 
-	virtual bool is_any() const throw() =0;
-	virtual bool is_loopback() const throw() =0;
+	bool is_any() const throw() {
+		switch( m_addr.ss_family ) {
+		case AF_INET:  return in4().sin_addr.s_addr == htonl(INADDR_ANY);
+		case AF_INET6: return memcmp(&in6().sin6_addr, &in6addr_any, sizeof(struct in6_addr)) == 0;
+		default:       return false;
+		}
+	}
+	bool is_loopback() const throw() {
+		switch( m_addr.ss_family ) {
+		case AF_INET:  return in4().sin_addr.s_addr == htonl(INADDR_LOOPBACK);
+		case AF_INET6: return memcmp(&in6().sin6_addr, &in6addr_loopback, sizeof(struct in6_addr)) == 0;
+		default:       return false;
+		}
+	}
 };
 
-std::auto_ptr<SockAddr> create(struct sockaddr_storage const *addr) throw(std::invalid_argument);
-inline std::auto_ptr<SockAddr> create(struct sockaddr_in const *addr) throw(std::invalid_argument) {
+SockAddr create(struct sockaddr_storage const *addr) throw(std::invalid_argument);
+inline SockAddr create(struct sockaddr const *addr) throw(std::invalid_argument) {
 	return create( reinterpret_cast<struct sockaddr_storage const*>(addr) );
 }
-inline std::auto_ptr<SockAddr> create(struct sockaddr_in6 const *addr) throw(std::invalid_argument) {
+inline SockAddr create(struct sockaddr_in const *addr) throw(std::invalid_argument) {
+	return create( reinterpret_cast<struct sockaddr_storage const*>(addr) );
+}
+inline SockAddr create(struct sockaddr_in6 const *addr) throw(std::invalid_argument) {
 	return create( reinterpret_cast<struct sockaddr_storage const*>(addr) );
 }
 
-std::auto_ptr<SockAddr> translate(std::string const &host, unsigned short const port) throw(std::invalid_argument);
-
-std::auto_ptr< boost::ptr_vector< SockAddr > > resolve(std::string const &host, std::string const &service, int const family = 0, int const socktype = 0, int const protocol = 0, bool const v4_mapped = false);
-
-std::auto_ptr< boost::ptr_vector< SockAddr > > getifaddrs();
-
-
-class Inet4 : public SockAddr {
-protected:
-	struct sockaddr_in m_addr;
-
-public:
-	Inet4(struct sockaddr_in const &addr) throw();
-	virtual ~Inet4() throw() {};
-
-	socklen_t const addr_len() const throw() { return sizeof(m_addr); }
-
-	virtual operator struct sockaddr const*() const throw() { return reinterpret_cast<struct sockaddr const*>(&m_addr); }
-	virtual bool address_equal(Inet4 const &b) const throw() {
-		return (m_addr.sin_addr.s_addr == b.m_addr.sin_addr.s_addr);
-	}
-
-	virtual std::string string() const throw(Errno);
-
-	virtual int const proto_family() const throw() { return PF_INET; }
-	virtual int const addr_family() const throw() { return AF_INET; }
-
-	virtual int const port_number() const throw() { return ntohs(m_addr.sin_port); }
-
-	virtual bool is_any() const throw() { return m_addr.sin_addr.s_addr == INADDR_ANY; }
-	virtual bool is_loopback() const throw() { return m_addr.sin_addr.s_addr == INADDR_LOOPBACK; }
-};
-
-
-class Inet6 : public SockAddr {
-protected:
-	struct sockaddr_in6 m_addr;
-
-public:
-	Inet6(struct sockaddr_in6 const &addr) throw();
-	virtual ~Inet6() throw() {}
-
-	socklen_t const addr_len() const throw() { return sizeof(m_addr); }
-
-	virtual operator struct sockaddr const*() const throw() { return reinterpret_cast<struct sockaddr const*>(&m_addr); }
-	virtual bool address_equal(Inet6 const &b) const throw() {
-		for( unsigned int i = 0; i < sizeof(m_addr.sin6_addr.s6_addr); i++) {
-			if( m_addr.sin6_addr.s6_addr[i] != b.m_addr.sin6_addr.s6_addr[i] ) return false;
-		}
-		return true;
-	}
-
-	virtual std::string string() const throw(std::runtime_error);
-
-	virtual int const proto_family() const throw() { return PF_INET6; }
-	virtual int const addr_family() const throw() { return AF_INET6; }
-
-	virtual int const port_number() const throw() { return ntohs(m_addr.sin6_port); }
-
-	virtual bool is_any() const throw() { return memcmp(&m_addr.sin6_addr, &in6addr_any, 16); }
-	virtual bool is_loopback() const throw() { return memcmp(&m_addr.sin6_addr, &in6addr_loopback, 16); }
-};
+SockAddr translate(std::string const &host, unsigned short const port) throw(std::invalid_argument);
+
+/**
+ * Resolve @host and @service with getaddrinfo()
+ * A "[numeric ip]" host or "[portnumber]" service is not looked up.
+ * This blocks for as long as the lookup takes; see Resolver.hxx for a
+ * non-blocking alternative.
+ */
+std::vector<SockAddr> resolve(std::string const &host, std::string const &service, int const family = 0, int const socktype = 0, int const protocol = 0, bool const v4_mapped = false);
+
+/**
+ * Like resolve(), but appends to @ret and returns the getaddrinfo() error
+ * (0 on success) instead of throwing
+ */
+int resolve(std::vector<SockAddr> *ret, std::string const &host, std::string const &service, int const family = 0, int const socktype = 0, int const protocol = 0, bool const v4_mapped = false);
+
+/**
+ * Whether @host is a numeric address, "[...]" or not; these resolve without
+ * a lookup
+ */
+bool is_numeric(std::string const &host) throw();
+
+std::vector<SockAddr> getifaddrs();
 
 } // namespace
 
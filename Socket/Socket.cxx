@@ -1,6 +1,7 @@
 #include "Socket.hxx"
 #include <sstream>
 #include <errno.h>
+#include <string.h>
 #include <fcntl.h>
 
 Socket Socket::socket(int const domain, int const type, int const protocol) throw(Errno) {
@@ -37,43 +38,42 @@ Socket Socket::accept(int const socket, struct sockaddr *address, socklen_t *add
 	return Socket(s);
 }
 
-Socket Socket::accept(std::auto_ptr<SockAddr::SockAddr> *client_address) throw(Errno) {
+Socket Socket::accept(SockAddr::SockAddr *client_address) throw(Errno) {
 	struct sockaddr_storage a;
 	socklen_t a_len = sizeof(a);
 	Socket s( accept(m_socket, reinterpret_cast<sockaddr*>(&a), &a_len) );
 	if( client_address != NULL ) {
 		*client_address = SockAddr::create(&a);
 	}
-	return s;
+	return s.move();
 }
 
-std::auto_ptr<SockAddr::SockAddr> Socket::getsockname() const throw(Errno) {
+SockAddr::SockAddr Socket::getsockname() const throw(Errno) {
 	struct sockaddr_storage a;
 	socklen_t a_len = sizeof(a);
 	if( -1 == ::getsockname(m_socket, reinterpret_cast<sockaddr*>(&a), &a_len) ) {
 		throw Errno("Could not getsockname()", errno);
 	}
-	std::auto_ptr<SockAddr::SockAddr> addr( SockAddr::create(&a) );
-	return addr;
+	return SockAddr::create(&a);
 }
 
-std::auto_ptr<SockAddr::SockAddr> Socket::getpeername() const throw(Errno) {
+SockAddr::SockAddr Socket::getpeername() const throw(Errno) {
 	struct sockaddr_storage a;
 	socklen_t a_len = sizeof(a);
 	if( -1 == ::getpeername(m_socket, reinterpret_cast<sockaddr*>(&a), &a_len) ) {
 		throw Errno("Could not getpeername()", errno);
 	}
-	std::auto_ptr<SockAddr::SockAddr> addr( SockAddr::create(&a) );
-	return addr;
+	return SockAddr::create(&a);
 }
 
 std::string Socket::recv(size_t const max_length ) throw(Errno) {
-	std::auto_ptr<char> buf( new char[max_length] );
-	ssize_t length = ::recv(m_socket, buf.get(), max_length, 0);
+	std::string buf(max_length, '\0'); // Received into directly, not copied
+	ssize_t length = this->recv_into(&buf[0], max_length);
 	if( length == -1 ) {
 		throw Errno("Could not recv()", errno);
 	}
-	return std::string(buf.get(), length); // TODO: avoid needless copy of data
+	buf.resize(length);
+	return buf;
 }
 
 ssize_t Socket::send(char const *data, size_t len) throw(Errno) {
@@ -84,7 +84,10 @@ ssize_t Socket::send(char const *data, size_t len) throw(Errno) {
 	return rv;
 }
 void Socket::send(std::string const &data) throw(Errno,std::runtime_error) {
-	ssize_t rv = this->send(data.data(), data.length());
+	ssize_t rv = this->send_all(data.data(), data.length());
+	if( rv == -1 ) {
+		throw Errno("Could not send()", errno);
+	}
 	if( rv != (signed)data.length() ) {
 		std::ostringstream e;
 		e << "Could not send(): Not enough bytes sent: " << rv << " < " << data.length();
@@ -92,6 +95,60 @@ void Socket::send(std::string const &data) throw(Errno,std::runtime_error) {
 	}
 }
 
+ssize_t Socket::recv_into(char *buf, size_t len, int flags) throw() {
+	ssize_t rv;
+	do {
+		rv = ::recv(m_socket, buf, len, flags);
+	} while( rv == -1 && errno == EINTR );
+	return rv;
+}
+
+ssize_t Socket::readv(struct iovec const *iov, int iovcnt) throw() {
+	ssize_t rv;
+	do {
+		rv = ::readv(m_socket, iov, iovcnt);
+	} while( rv == -1 && errno == EINTR );
+	return rv;
+}
+
+ssize_t Socket::writev(struct iovec const *iov, int iovcnt) throw() {
+	ssize_t rv;
+	do {
+		rv = ::writev(m_socket, iov, iovcnt);
+	} while( rv == -1 && errno == EINTR );
+	return rv;
+}
+
+ssize_t Socket::sendmsg(struct iovec const *iov, size_t iovcnt, int flags) throw() {
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = const_cast<struct iovec*>(iov);
+	msg.msg_iovlen = iovcnt;
+	return this->sendmsg(&msg, flags);
+}
+
+ssize_t Socket::sendmsg(struct msghdr const *msg, int flags) throw() {
+	ssize_t rv;
+	do {
+		rv = ::sendmsg(m_socket, msg, flags);
+	} while( rv == -1 && errno == EINTR );
+	return rv;
+}
+
+ssize_t Socket::send_all(char const *data, size_t len, int flags) throw() {
+	size_t sent = 0;
+	while( sent < len ) {
+		ssize_t rv = ::send(m_socket, data + sent, len - sent, flags);
+		if( rv == -1 ) {
+			if( errno == EINTR ) continue;
+			if( sent == 0 ) return -1;
+			break; // Partially sent; errno tells why the rest was not
+		}
+		sent += rv;
+	}
+	return sent;
+}
+
 void Socket::shutdown(int how) throw(Errno) {
 	if( ::shutdown(m_socket, how) == -1 ) {
 		throw Errno("Could not shutdown()", errno);
@@ -115,14 +172,14 @@ bool Socket::non_blocking() throw(Errno) {
 	if( flags == -1 ) {
 		throw Errno("Could not fcntl(, F_GETFL)", errno);
 	}
-	return flags | O_NONBLOCK;
+	return flags & O_NONBLOCK;
 }
 bool Socket::non_blocking(bool new_state) throw(Errno) {
 	int flags = fcntl(m_socket, F_GETFL);
 	if( flags == -1 ) {
 		throw Errno("Could not fcntl(, F_GETFL)", errno);
 	}
-	bool non_block_state = flags | O_NONBLOCK;
+	bool non_block_state = flags & O_NONBLOCK;
 
 	if( new_state ) {
 		flags |= O_NONBLOCK;
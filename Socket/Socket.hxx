@@ -3,6 +3,7 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <string>
 
@@ -18,7 +19,7 @@ public:
 	 * Take responsibility of a socket
 	 * Will close when this object is destroyed
 	 */
-	Socket(int const socket = -1) throw() : m_socket(socket) {}
+	explicit Socket(int const socket = -1) throw() : m_socket(socket) {}
 
 	~Socket() throw() { this->reset(); }
 
@@ -28,9 +29,27 @@ public:
 	 */
 	int release() throw() { int tmp = m_socket; m_socket = -1; return tmp; }
 
-	void reset(int const socket = -1) { if( m_socket != -1 ) close(m_socket); m_socket = socket; }
-	Socket & operator =(Socket &rhs) { this->reset( rhs.m_socket ); rhs.release(); return *this; }
-	Socket & operator =(Socket rhs) { this->reset( rhs.m_socket ); rhs.release(); return *this; }
+	void reset(int const socket = -1) throw() { if( m_socket != -1 ) close(m_socket); m_socket = socket; }
+
+	/**
+	 * Move semantics
+	 * A Socket is moved, never copied: the moved-from Socket is empty (-1)
+	 * afterwards. Use `a = b.move()` to move from an lvalue.
+	 * Without rvalue references (C++98), "copying" moves instead, like
+	 * std::auto_ptr does; that is what makes returning by value work there.
+	 */
+#if __cplusplus >= 201103L
+	Socket(Socket &&rhs) noexcept : m_socket(rhs.release()) {}
+	Socket & operator =(Socket &&rhs) noexcept { this->reset( rhs.release() ); return *this; }
+	Socket(Socket const &) = delete;
+	Socket & operator =(Socket const &) = delete;
+	Socket &&move() noexcept { return static_cast<Socket&&>(*this); }
+#else
+	Socket(Socket const &rhs) throw() : m_socket( const_cast<Socket&>(rhs).release() ) {}
+	Socket & operator =(Socket const &rhs) throw() {
+		this->reset( const_cast<Socket&>(rhs).release() ); return *this; }
+	Socket &move() throw() { return *this; }
+#endif
 
 	/*
 	 * Factory methods
@@ -53,19 +72,44 @@ public:
 	/**
 	 * Accept a new connection on this socket (must be in listening mode)
 	 * The new socket FD is returned
-	 * if client_address is not NULL, the target auto_ptr is reassigned to
-	 * own the SockAddr of the client.
+	 * if client_address is not NULL, the address of the client is stored
+	 * there.
 	 */
-	Socket accept(std::auto_ptr<SockAddr::SockAddr> *client_address) throw(Errno);
+	Socket accept(SockAddr::SockAddr *client_address) throw(Errno);
 
 	std::string recv(size_t const max_length = 4096) throw(Errno);
 	ssize_t send(char const *data, size_t len) throw(Errno);
 	void send(std::string const &data) throw(Errno,std::runtime_error);
 
+	/**
+	 * Hot path I/O
+	 * These don't allocate and don't throw: they return what the system call
+	 * returns, with errno set on -1, so EAGAIN on a non-blocking socket is
+	 * not exceptional. EINTR is retried.
+	 */
+	ssize_t recv_into(char *buf, size_t len, int flags = 0) throw();
+	template<size_t N>
+	ssize_t recv_into(char (&buf)[N], int flags = 0) throw() {
+		return this->recv_into(buf, N, flags); }
+
+	ssize_t readv(struct iovec const *iov, int iovcnt) throw();
+	ssize_t writev(struct iovec const *iov, int iovcnt) throw();
+	ssize_t sendmsg(struct iovec const *iov, size_t iovcnt, int flags = 0) throw();
+	ssize_t sendmsg(struct msghdr const *msg, int flags = 0) throw();
+
+	/**
+	 * Send all of @data, continuing after partial writes
+	 * On a non-blocking socket, this stops when the socket is full: the
+	 * number of bytes sent is returned, which is less than @len then (and
+	 * errno is EAGAIN). The caller should send the rest when the socket is
+	 * writable again. -1 is only returned when nothing could be sent.
+	 */
+	ssize_t send_all(char const *data, size_t len, int flags = 0) throw();
+
 	void shutdown(int how) throw(Errno);
 
-	std::auto_ptr<SockAddr::SockAddr> getsockname() const throw(Errno);
-	std::auto_ptr<SockAddr::SockAddr> getpeername() const throw(Errno);
+	SockAddr::SockAddr getsockname() const throw(Errno);
+	SockAddr::SockAddr getpeername() const throw(Errno);
 
 	/**
 	 * {set,get}sockopt calls
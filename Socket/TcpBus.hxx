@@ -0,0 +1,208 @@
+#ifndef __TCPBUS_HXX__
+#define __TCPBUS_HXX__
+
+/*
+ * C++ wrapper around libtcpbus
+ *
+ * A TcpBus::Bus<Handler> owns a bus, and calls the member functions of its
+ * Handler for the events of the bus. The handler is a template parameter, so
+ * its functions are called directly from a single trampoline per event, and
+ * can be inlined there; there is no global state, and events the handler does
+ * not handle are not registered with the bus at all.
+ */
+
+#include <string>
+#include <errno.h>
+
+#include "../include/libtcpbus.h"
+#include "Errno.hxx"
+
+namespace TcpBus {
+
+/**
+ * View of data on the bus
+ * This does not own the data, which is only valid during the call it was
+ * passed to. Use str() to keep a copy.
+ */
+class Buffer {
+private:
+	char const *m_data;
+	size_t m_len;
+
+public:
+	Buffer(char const *data, size_t len) throw() : m_data(data), m_len(len) {}
+	Buffer(std::string const &data) throw() : m_data(data.data()), m_len(data.size()) {}
+
+	char const *data() const throw() { return m_data; }
+	size_t size() const throw() { return m_len; }
+	bool empty() const throw() { return m_len == 0; }
+
+	char const *begin() const throw() { return m_data; }
+	char const *end() const throw() { return m_data + m_len; }
+	char operator[](size_t i) const throw() { return m_data[i]; }
+
+	std::string str() const { return std::string(m_data, m_len); }
+};
+
+/**
+ * Handle of a connection on the bus
+ * Copying it does not copy the connection. It is valid as long as the
+ * connection is (see libtcpbus.h). Data that came in over a bus link has no
+ * connection; valid() is false then.
+ */
+class Connection {
+private:
+	struct TcpBus_connection *m_conn;
+
+public:
+	explicit Connection(struct TcpBus_connection *conn) throw() : m_conn(conn) {}
+
+	bool valid() const throw() { return m_conn != NULL; }
+	struct TcpBus_connection *get() const throw() { return m_conn; }
+
+	uint64_t id() const throw() { return TcpBus_connection_id(m_conn); }
+	struct sockaddr const *addr(socklen_t *addr_len = NULL) const throw() {
+		return TcpBus_connection_addr(m_conn, addr_len); }
+
+	void *data() const throw() { return TcpBus_connection_get_data(m_conn); }
+	void data(void *data) throw() { TcpBus_connection_set_data(m_conn, data); }
+
+	unsigned int group() const throw() { return TcpBus_connection_get_group(m_conn); }
+	void group(unsigned int group) throw(Errno) {
+		if( TcpBus_connection_set_group(m_conn, group) == -1 ) {
+			throw Errno("TcpBus_connection_set_group()", errno);
+		}
+	}
+
+	/**
+	 * Send data to this connection only
+	 * On failure, the connection is closed and reported as usual.
+	 */
+	void send(Buffer const &data) throw(Errno) {
+		if( TcpBus_send_to(m_conn, data.data(), data.size()) == -1 ) {
+			throw Errno("TcpBus_send_to()", errno);
+		}
+	}
+};
+
+/**
+ * Base for handlers
+ * A handler derives from this, and declares the events it handles with the
+ * same signature, hiding the empty ones here. The bus only registers the
+ * events that are hidden. Handlers must not throw: the events are called from
+ * C code.
+ */
+struct Handler {
+	void on_rx(Connection conn, Buffer data) {}
+	void on_newcon(Connection conn, struct sockaddr const *addr, socklen_t addr_len) {}
+	void on_error(Connection conn, struct sockaddr const *addr, socklen_t addr_len,
+	              int err) {}
+	void on_disconnect(Connection conn, struct sockaddr const *addr, socklen_t addr_len) {}
+};
+
+namespace detail {
+	/*
+	 * Whether a handler declares an event itself: if it does not, &H::on_x
+	 * is a member of Handler, and matches the exact overload below.
+	 */
+	template<typename F> inline bool declares(F) { return true; }
+	inline bool declares(void (Handler::*)(Connection, Buffer)) { return false; }
+	inline bool declares(void (Handler::*)(Connection, struct sockaddr const*, socklen_t)) {
+		return false; }
+	inline bool declares(void (Handler::*)(Connection, struct sockaddr const*, socklen_t, int)) {
+		return false; }
+}
+
+/**
+ * A bus, calling a H for its events
+ * The bus is terminated when this is destroyed. Not copyable; the bus refers
+ * back to this object.
+ */
+template<class H>
+class Bus {
+private:
+	H m_handler;
+	struct TcpBus_bus *m_bus;
+
+	Bus(Bus const &);
+	Bus & operator =(Bus const &);
+
+	static H &handler_of(struct TcpBus_bus const *bus) throw() {
+		return static_cast<Bus*>(TcpBus_get_data(bus))->m_handler;
+	}
+
+	static void rx(struct TcpBus_bus const *bus, struct TcpBus_connection *conn,
+	               char const *data, size_t len) {
+		handler_of(bus).on_rx(Connection(conn), Buffer(data, len));
+	}
+	static void newcon(struct TcpBus_bus const *bus, struct TcpBus_connection *conn,
+	                   struct sockaddr const *addr, socklen_t addr_len) {
+		handler_of(bus).on_newcon(Connection(conn), addr, addr_len);
+	}
+	static void error(struct TcpBus_bus const *bus, struct TcpBus_connection *conn,
+	                  struct sockaddr const *addr, socklen_t addr_len, int err) {
+		handler_of(bus).on_error(Connection(conn), addr, addr_len, err);
+	}
+	static void disconnect(struct TcpBus_bus const *bus, struct TcpBus_connection *conn,
+	                       struct sockaddr const *addr, socklen_t addr_len) {
+		handler_of(bus).on_disconnect(Connection(conn), addr, addr_len);
+	}
+
+	void fail(char const *what) throw(Errno) {
+		int err = errno;
+		TcpBus_terminate(m_bus);
+		throw Errno(what, err);
+	}
+
+public:
+	/**
+	 * Start a bus on a listening socket, which is not closed with the bus
+	 */
+	Bus(EV_P_ int socket, H const &handler = H()) throw(Errno)
+	: m_handler(handler), m_bus(TcpBus_init(EV_A_ socket)) {
+		if( m_bus == NULL ) throw Errno("TcpBus_init()", errno);
+		TcpBus_set_data(m_bus, this);
+
+		if( detail::declares(&H::on_rx)
+		 && TcpBus_callback_rx_add(m_bus, rx) == -1 ) fail("TcpBus_callback_rx_add()");
+		if( detail::declares(&H::on_newcon)
+		 && TcpBus_callback_newcon_add(m_bus, newcon) == -1 ) fail("TcpBus_callback_newcon_add()");
+		if( detail::declares(&H::on_error)
+		 && TcpBus_callback_error_add(m_bus, error) == -1 ) fail("TcpBus_callback_error_add()");
+		if( detail::declares(&H::on_disconnect)
+		 && TcpBus_callback_disconnect_add(m_bus, disconnect) == -1 ) fail("TcpBus_callback_disconnect_add()");
+	}
+
+	~Bus() throw() { TcpBus_terminate(m_bus); }
+
+	H &handler() throw() { return m_handler; }
+	H const &handler() const throw() { return m_handler; }
+
+	/**
+	 * The C bus, for everything not wrapped here
+	 */
+	struct TcpBus_bus *get() const throw() { return m_bus; }
+
+	void send(Buffer const &data) throw(Errno) {
+		if( TcpBus_send(m_bus, data.data(), data.size()) == -1 ) {
+			throw Errno("TcpBus_send()", errno);
+		}
+	}
+	void send_except(Connection except, Buffer const &data) throw(Errno) {
+		if( TcpBus_send_except(m_bus, except.get(), data.data(), data.size()) == -1 ) {
+			throw Errno("TcpBus_send_except()", errno);
+		}
+	}
+	/**
+	 * Like send(), from any thread
+	 */
+	void send_async(Buffer const &data) throw(Errno) {
+		if( TcpBus_send_async(m_bus, data.data(), data.size()) == -1 ) {
+			throw Errno("TcpBus_send_async()", errno);
+		}
+	}
+};
+
+} // namespace TcpBus
+
+#endif // __TCPBUS_HXX__
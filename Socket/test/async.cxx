@@ -0,0 +1,120 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <vector>
+#include "../Socket.hxx"
+#include "../TcpBus.hxx"
+
+/* Several threads send through TcpBus_send_async() at once; a client checks
+ * that every message arrives exactly once, and in order per thread.
+ */
+
+#define PRODUCERS 4
+#define MESSAGES 5000 // Per producer
+
+#define CHECK(x) do { if( !(x) ) { fprintf(stderr, "Failed: %s\n", #x); return 1; } } while(0)
+
+struct producer {
+	struct TcpBus_bus *bus;
+	int id;
+	int failed;
+};
+
+static void *produce(void *arg) {
+	struct producer *p = static_cast<struct producer*>(arg);
+	char msg[32];
+
+	for( int i = 0; i < MESSAGES; i++ ) {
+		int len = snprintf(msg, sizeof(msg), "%d %d\n", p->id, i);
+		if( TcpBus_send_async(p->bus, msg, len) == -1 ) p->failed++;
+	}
+	return NULL;
+}
+
+static void run(int rounds) {
+	for( int i = 0; i < rounds; i++ ) {
+		usleep(10000);
+		ev_run(EV_DEFAULT_ EVRUN_NOWAIT);
+	}
+}
+
+static int round_trip(struct sockaddr_in const &sa, bool arena) {
+	Socket s_listen( Socket::socket(AF_INET, SOCK_STREAM, 0) );
+	struct sockaddr_in la = sa;
+	socklen_t la_len = sizeof(la);
+	s_listen.bind(reinterpret_cast<struct sockaddr const*>(&la), sizeof(la));
+	s_listen.listen(8);
+	::getsockname(s_listen, reinterpret_cast<struct sockaddr*>(&la), &la_len);
+
+	TcpBus::Bus<TcpBus::Handler> bus(EV_DEFAULT_ s_listen);
+	// Small enough to run out, so malloc() is used for some messages too
+	if( arena ) CHECK( TcpBus_arena(bus.get(), 1, 0) == 0 );
+
+	Socket client( Socket::socket(AF_INET, SOCK_STREAM, 0) );
+	client.connect(reinterpret_cast<struct sockaddr*>(&la), la_len);
+	run(5);
+
+	struct producer producers[PRODUCERS];
+	pthread_t threads[PRODUCERS];
+	for( int i = 0; i < PRODUCERS; i++ ) {
+		producers[i].bus = bus.get();
+		producers[i].id = i;
+		producers[i].failed = 0;
+		CHECK( pthread_create(&threads[i], NULL, produce, &producers[i]) == 0 );
+	}
+
+	std::vector<int> next(PRODUCERS, 0); // Expected sequence number
+	std::string rx;
+	int received = 0;
+	time_t deadline = time(NULL) + 10;
+	while( received < PRODUCERS * MESSAGES && time(NULL) < deadline ) {
+		char buf[4096];
+		ev_run(EV_DEFAULT_ EVRUN_NOWAIT);
+		ssize_t rv = ::recv(client, buf, sizeof(buf), MSG_DONTWAIT);
+		if( rv <= 0 ) {
+			usleep(100);
+			continue;
+		}
+		rx.append(buf, rv);
+
+		size_t start = 0, end;
+		while( (end = rx.find('\n', start)) != std::string::npos ) {
+			int id, seq;
+			CHECK( sscanf(rx.c_str() + start, "%d %d", &id, &seq) == 2 );
+			CHECK( id >= 0 && id < PRODUCERS );
+			if( seq != next[id] ) {
+				fprintf(stderr, "Producer %d: got %d, expected %d\n", id, seq, next[id]);
+				return 1;
+			}
+			next[id]++;
+			received++;
+			start = end + 1;
+		}
+		rx.erase(0, start);
+	}
+
+	for( int i = 0; i < PRODUCERS; i++ ) {
+		CHECK( pthread_join(threads[i], NULL) == 0 );
+		CHECK( producers[i].failed == 0 );
+		CHECK( next[i] == MESSAGES );
+	}
+	run(5);
+	char extra;
+	CHECK( ::recv(client, &extra, 1, MSG_DONTWAIT) == -1 ); // Nothing twice
+	return 0;
+}
+
+int main() {
+	struct sockaddr_in sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if( round_trip(sa, false) != 0 ) return 1;
+	if( round_trip(sa, true) != 0 ) return 1;
+	return 0;
+}
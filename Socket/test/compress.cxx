@@ -0,0 +1,178 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <string>
+#include <vector>
+#include "../../config.h"
+#include "../Socket.hxx"
+#include "../TcpBus.hxx"
+
+/* Every compressed connection can inflate its stream on its own: one that
+ * joins in the middle of the stream, one that misses chunks (its own data,
+ * and what is sent to others only), and one that gets the history replayed.
+ * A connection that stops being compressed sees the end of the stream.
+ */
+
+#ifdef HAVE_ZLIB_H
+#include <zlib.h>
+
+#define CHECK(x) do { if( !(x) ) { fprintf(stderr, "Failed: %s\n", #x); return 1; } } while(0)
+
+struct Compressing : public TcpBus::Handler {
+	std::vector<TcpBus::Connection> conns;
+
+	void on_newcon(TcpBus::Connection conn, struct sockaddr const *addr, socklen_t addr_len) {
+		if( TcpBus_connection_set_compression(conn.get(), 1) == -1 ) {
+			fprintf(stderr, "Can not compress: %s\n", strerror(errno));
+		}
+		conns.push_back(conn);
+	}
+};
+
+/* A client, inflating what it receives as one raw deflate stream, and
+ * keeping what follows the end of it as is
+ */
+struct Client {
+	Socket s;
+	z_stream z;
+	std::string rx, plain;
+	int error;
+	bool ended;
+
+	Client() : error(Z_OK), ended(false) {
+		memset(&z, 0, sizeof(z));
+		inflateInit2(&z, -15);
+	}
+	~Client() { inflateEnd(&z); }
+
+	void connect(struct sockaddr const *sa, socklen_t sa_len) {
+		s = Socket::socket(AF_INET, SOCK_STREAM, 0);
+		s.connect(sa, sa_len);
+	}
+
+	/* Inflate whatever arrived so far; returns what it decoded to */
+	std::string const &receive() {
+		char in[4096], out[4096];
+		ssize_t rv;
+		while( (rv = ::recv(s, in, sizeof(in), MSG_DONTWAIT)) > 0 ) {
+			if( ended ) {
+				plain.append(in, rv);
+				continue;
+			}
+			z.next_in = reinterpret_cast<Bytef*>(in);
+			z.avail_in = rv;
+			do {
+				z.next_out = reinterpret_cast<Bytef*>(out);
+				z.avail_out = sizeof(out);
+				int rc = inflate(&z, Z_SYNC_FLUSH);
+				if( rc == Z_STREAM_END ) {
+					ended = true;
+					plain.append(reinterpret_cast<char*>(z.next_in), z.avail_in);
+				} else if( rc != Z_OK && rc != Z_BUF_ERROR && error == Z_OK ) {
+					error = rc;
+				}
+				rx.append(out, sizeof(out) - z.avail_out);
+			} while( !ended && z.avail_out == 0 );
+		}
+		return rx;
+	}
+};
+
+static void run(int rounds) {
+	for( int i = 0; i < rounds; i++ ) {
+		usleep(10000);
+		ev_run(EV_DEFAULT_ EVRUN_NOWAIT);
+	}
+}
+
+/* Similar messages, so deflate refers back to earlier ones where it can */
+static std::string message(char const *name) {
+	std::string m;
+	for( int i = 0; i < 20; i++ ) {
+		m += "the quick brown fox jumps over the lazy dog, message ";
+		m += name;
+		m += "\n";
+	}
+	return m;
+}
+
+int main() {
+	struct sockaddr_in sa;
+	socklen_t sa_len = sizeof(sa);
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	Socket s_listen( Socket::socket(AF_INET, SOCK_STREAM, 0) );
+	s_listen.bind(reinterpret_cast<struct sockaddr*>(&sa), sizeof(sa));
+	s_listen.listen(8);
+	::getsockname(s_listen, reinterpret_cast<struct sockaddr*>(&sa), &sa_len);
+	struct sockaddr const *addr = reinterpret_cast<struct sockaddr*>(&sa);
+
+	TcpBus::Bus<Compressing> bus(EV_DEFAULT_ s_listen);
+
+	Client a, p, j, h;
+	a.connect(addr, sa_len);
+	p.connect(addr, sa_len);
+	run(5);
+
+	// p misses its own data, and what is sent to a alone
+	std::string m1 = message("1"), m2 = message("2"), m3 = message("3");
+	std::string m4 = message("4"), m5 = message("5");
+	p.s.send(m1.data(), m1.size());
+	run(5);
+	bus.send(TcpBus::Buffer(m2.data(), m2.size()));
+	run(5);
+	CHECK( bus.handler().conns.size() == 2 );
+	bus.handler().conns[0].send(TcpBus::Buffer(m3.data(), m3.size()));
+	bus.send(TcpBus::Buffer(m4.data(), m4.size()));
+	run(5);
+	CHECK( a.receive() == m1 + m2 + m3 + m4 );
+	CHECK( p.receive() == m2 + m4 );
+
+	// j only has the stream from here on
+	j.connect(addr, sa_len);
+	run(5);
+	bus.send(TcpBus::Buffer(m5.data(), m5.size()));
+	run(5);
+	CHECK( a.receive() == m1 + m2 + m3 + m4 + m5 );
+	CHECK( p.receive() == m2 + m4 + m5 );
+	CHECK( j.receive() == m5 );
+	CHECK( a.error == Z_OK && p.error == Z_OK && j.error == Z_OK );
+
+	// h is compressed before the history is replayed to it
+	std::string m6 = message("6"), m7 = message("7");
+	CHECK( TcpBus_set_history(bus.get(), 10000, 0) == 0 );
+	bus.send(TcpBus::Buffer(m6.data(), m6.size()));
+	run(5);
+	h.connect(addr, sa_len);
+	run(5);
+	bus.send(TcpBus::Buffer(m7.data(), m7.size()));
+	run(5);
+	CHECK( a.receive() == m1 + m2 + m3 + m4 + m5 + m6 + m7 );
+	CHECK( h.receive() == m6 + m7 );
+	CHECK( a.error == Z_OK && h.error == Z_OK );
+
+	// And it is compressed, not just stored
+	CHECK( a.z.total_in < a.z.total_out / 2 );
+
+	// a stops being compressed: its deflate stream ends where plain data starts
+	std::string m8 = message("8");
+	CHECK( TcpBus_connection_set_compression(bus.handler().conns[0].get(), 0) == 0 );
+	bus.send(TcpBus::Buffer(m8.data(), m8.size()));
+	run(5);
+	CHECK( a.receive() == m1 + m2 + m3 + m4 + m5 + m6 + m7 );
+	CHECK( a.ended && a.error == Z_OK && a.plain == m8 );
+	CHECK( p.receive() == m2 + m4 + m5 + m6 + m7 + m8 && !p.ended );
+	return 0;
+}
+
+#else
+
+int main() {
+	return 77; // Skipped: built without zlib
+}
+
+#endif
@@ -0,0 +1,60 @@
+#include <stdio.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include "../Resolver.hxx"
+
+struct Result {
+	int calls, error;
+	std::vector<SockAddr::SockAddr> addrs;
+	Result() : calls(0), error(-1) {}
+};
+
+static void done(std::vector<SockAddr::SockAddr> const &addrs, int error, void *data) {
+	Result *r = static_cast<Result*>(data);
+	r->calls++;
+	r->error = error;
+	r->addrs = addrs;
+}
+
+#define CHECK(x) do { if( !(x) ) { fprintf(stderr, "Failed: %s\n", #x); return 1; } } while(0)
+
+int main() {
+	SockAddr::Resolver resolver(EV_DEFAULT);
+
+	// Numeric addresses resolve immediately
+	Result n;
+	resolver.resolve("127.0.0.1", "[1234]", done, &n, 0, SOCK_STREAM);
+	CHECK( n.calls == 1 && n.error == 0 && n.addrs.size() == 1 );
+	CHECK( n.addrs[0].is_loopback() && n.addrs[0].port_number() == 1234 );
+	CHECK( resolver.cache_size() == 0 );
+
+	// Names (from /etc/hosts) on a thread; lookups of the same name are shared
+	Result a, b;
+	resolver.resolve("localhost", "[1234]", done, &a, 0, SOCK_STREAM);
+	resolver.resolve("localhost", "[1234]", done, &b, 0, SOCK_STREAM);
+	CHECK( a.calls == 0 && b.calls == 0 );
+	ev_run(EV_DEFAULT_ 0); // Returns when there are no more lookups
+	CHECK( a.calls == 1 && a.error == 0 && a.addrs.size() > 0 );
+	CHECK( a.addrs[0].is_loopback() && a.addrs[0].port_number() == 1234 );
+	CHECK( b.calls == 1 && b.addrs == a.addrs );
+	CHECK( resolver.cache_size() == 1 );
+
+	// ... and are cached afterwards
+	Result c;
+	resolver.resolve("localhost", "[1234]", done, &c, 0, SOCK_STREAM);
+	CHECK( c.calls == 1 && c.addrs == a.addrs );
+
+	// Failures are cached too
+	Result f, g;
+	resolver.resolve("localhost", "no-such-service", done, &f, 0, SOCK_STREAM);
+	ev_run(EV_DEFAULT_ 0);
+	CHECK( f.calls == 1 && f.error != 0 && f.addrs.empty() );
+	resolver.resolve("localhost", "no-such-service", done, &g, 0, SOCK_STREAM);
+	CHECK( g.calls == 1 && g.error == f.error );
+	CHECK( resolver.cache_size() == 2 );
+
+	resolver.flush();
+	CHECK( resolver.cache_size() == 0 );
+
+	return 0;
+}
@@ -0,0 +1,56 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <set>
+#include "../SockAddr.hxx"
+
+#define CHECK(x) do { if( !(x) ) { fprintf(stderr, "Failed: %s\n", #x); return 1; } } while(0)
+
+using SockAddr::translate;
+
+int main() {
+	// Both byte orders and both families
+	CHECK( translate("0.0.0.0", 80).is_any() );
+	CHECK( !translate("0.0.0.0", 80).is_loopback() );
+	CHECK( translate("127.0.0.1", 80).is_loopback() );
+	CHECK( !translate("127.0.0.1", 80).is_any() );
+	CHECK( !translate("1.0.0.127", 80).is_loopback() );
+	CHECK( !translate("192.0.2.1", 80).is_any() );
+	CHECK( translate("::", 80).is_any() );
+	CHECK( !translate("::", 80).is_loopback() );
+	CHECK( translate("::1", 80).is_loopback() );
+	CHECK( !translate("::1", 80).is_any() );
+	CHECK( !translate("2001:db8::1", 80).is_any() );
+	CHECK( !translate("2001:db8::1", 80).is_loopback() );
+	CHECK( !SockAddr::SockAddr().is_any() && !SockAddr::SockAddr().is_loopback() );
+
+	// Equal addresses hash the same; the port and the address both count
+	CHECK( translate("192.0.2.1", 80).hash() == translate("192.0.2.1", 80).hash() );
+	CHECK( translate("192.0.2.1", 80).hash() != translate("192.0.2.1", 81).hash() );
+	CHECK( translate("192.0.2.1", 80).hash() != translate("192.0.2.2", 80).hash() );
+	CHECK( translate("::1", 80).hash() != translate("::2", 80).hash() );
+
+	// A strict weak order: by family, then address, then port
+	SockAddr::SockAddr a = translate("192.0.2.1", 80);
+	SockAddr::SockAddr b = translate("192.0.2.1", 81);
+	SockAddr::SockAddr c = translate("192.0.2.2", 79);
+	SockAddr::SockAddr d = translate("::1", 1);
+	CHECK( a < b && b < c && c < d );
+	CHECK( !( b < a ) && !( c < b ) && !( d < c ) );
+	CHECK( !( a < a ) );
+	std::set<SockAddr::SockAddr> set;
+	set.insert(c); set.insert(a); set.insert(d); set.insert(b); set.insert(a);
+	CHECK( set.size() == 4 && *set.begin() == a && *set.rbegin() == d );
+
+	// format() never overruns, and says why it failed
+	char buf[SockAddr::SockAddr::string_max];
+	CHECK( strcmp(a.format(buf, sizeof(buf)), "[192.0.2.1]:80") == 0 );
+	CHECK( strcmp(translate("2001:db8::1", 443).format(buf, sizeof(buf)), "[2001:db8::1]:443") == 0 );
+	CHECK( translate("ffff:ffff:ffff:ffff:ffff:ffff:ffff:ffff", 65535).format(buf, sizeof(buf)) != NULL );
+	CHECK( a.format(buf, 14) == NULL && errno == ENOSPC );
+	CHECK( a.format(buf, 15) != NULL );
+	CHECK( SockAddr::SockAddr().format(buf, sizeof(buf)) == NULL && errno == EAFNOSUPPORT );
+	CHECK( a.string() == "[192.0.2.1]:80" );
+
+	return 0;
+}
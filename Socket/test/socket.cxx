@@ -0,0 +1,46 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include "../Socket.hxx"
+
+#define CHECK(x) do { if( !(x) ) { fprintf(stderr, "Failed: %s\n", #x); return 1; } } while(0)
+
+static Socket socket_pair(Socket &other) {
+	int sv[2];
+	if( socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1 ) throw Errno("socketpair()", errno);
+	other.reset(sv[1]);
+	return Socket(sv[0]);
+}
+
+int main() {
+	Socket b;
+	Socket a( socket_pair(b) );
+	CHECK( a != -1 && b != -1 );
+
+	// Moving leaves the source empty
+	Socket c;
+	c = a.move();
+	CHECK( a == -1 && c != -1 );
+
+	// Scatter/gather
+	struct iovec out[2] = { { (void*)"hel", 3 }, { (void*)"lo", 2 } };
+	CHECK( c.writev(out, 2) == 5 );
+	char buf[8];
+	CHECK( b.recv_into(buf) == 5 && memcmp(buf, "hello", 5) == 0 );
+
+	CHECK( b.sendmsg(out, 2) == 5 );
+	char x[2], y[3];
+	struct iovec in[2] = { { x, sizeof(x) }, { y, sizeof(y) } };
+	CHECK( c.readv(in, 2) == 5 && memcmp(x, "he", 2) == 0 && memcmp(y, "llo", 3) == 0 );
+
+	// Partial writes on a non-blocking socket
+	CHECK( c.non_blocking(true) == false );
+	CHECK( c.non_blocking() == true );
+	static char big[4 << 20];
+	ssize_t sent = c.send_all(big, sizeof(big));
+	CHECK( sent > 0 && (size_t)sent < sizeof(big) && errno == EAGAIN );
+	CHECK( c.send_all(big, sizeof(big)) == -1 && errno == EAGAIN );
+
+	return 0;
+}
@@ -0,0 +1,102 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <vector>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "../Socket.hxx"
+#include "../TcpBus.hxx"
+
+/* Counts what it sees; does not handle errors, so they aren't registered */
+struct Counter : public TcpBus::Handler {
+	int newcons, disconnects;
+	std::string rx;
+	intptr_t rx_from; // User data of the connection rx came from
+	std::vector<TcpBus::Connection> conns;
+
+	Counter() : newcons(0), disconnects(0), rx_from(0) {}
+
+	void on_rx(TcpBus::Connection conn, TcpBus::Buffer data) {
+		rx += data.str();
+		rx_from = reinterpret_cast<intptr_t>(conn.data());
+	}
+	void on_newcon(TcpBus::Connection conn, struct sockaddr const *addr, socklen_t addr_len) {
+		newcons++;
+		conn.data(reinterpret_cast<void*>(static_cast<intptr_t>(newcons)));
+		conns.push_back(conn);
+	}
+	void on_disconnect(TcpBus::Connection conn, struct sockaddr const *addr, socklen_t addr_len) {
+		disconnects++; }
+};
+
+#define CHECK(x) do { if( !(x) ) { fprintf(stderr, "Failed: %s\n", #x); return 1; } } while(0)
+
+static void run(int rounds) {
+	for( int i = 0; i < rounds; i++ ) {
+		usleep(10000);
+		ev_run(EV_DEFAULT_ EVRUN_NOWAIT);
+	}
+}
+
+/* Whatever a client received so far */
+static std::string received(int s) {
+	char buf[256];
+	ssize_t rv = ::recv(s, buf, sizeof(buf), MSG_DONTWAIT);
+	return rv > 0 ? std::string(buf, rv) : std::string();
+}
+
+int main() {
+	struct sockaddr_in sa;
+	socklen_t sa_len = sizeof(sa);
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	Socket s_listen( Socket::socket(AF_INET, SOCK_STREAM, 0) );
+	s_listen.bind(reinterpret_cast<struct sockaddr*>(&sa), sizeof(sa));
+	s_listen.listen(8);
+	::getsockname(s_listen, reinterpret_cast<struct sockaddr*>(&sa), &sa_len);
+
+	TcpBus::Bus<Counter> bus(EV_DEFAULT_ s_listen);
+
+	// Counter does not declare on_error, so it is not registered
+	CHECK( TcpBus::detail::declares(&Counter::on_rx) );
+	CHECK( !TcpBus::detail::declares(&Counter::on_error) );
+
+	{
+		Socket a( Socket::socket(AF_INET, SOCK_STREAM, 0) );
+		a.connect(reinterpret_cast<struct sockaddr*>(&sa), sa_len);
+		run(5);
+		CHECK( bus.handler().newcons == 1 );
+		Socket b( Socket::socket(AF_INET, SOCK_STREAM, 0) );
+		b.connect(reinterpret_cast<struct sockaddr*>(&sa), sa_len);
+		run(5);
+		CHECK( bus.handler().newcons == 2 );
+
+		a.send("hello", 5);
+		run(5);
+		CHECK( bus.handler().rx == "hello" );
+		CHECK( bus.handler().rx_from == 1 ); // The data set in on_newcon
+		CHECK( received(b) == "hello" );
+		CHECK( received(a) == "" );
+
+		b.send("world", 5);
+		run(5);
+		CHECK( bus.handler().rx_from == 2 );
+		CHECK( received(a) == "world" );
+
+		// Unicast, through the wrapper and the C API
+		TcpBus::Connection to_b = bus.handler().conns[1];
+		CHECK( to_b.valid() );
+		CHECK( to_b.id() != bus.handler().conns[0].id() );
+		to_b.send(TcpBus::Buffer("to b", 4));
+		CHECK( TcpBus_send_to(bus.handler().conns[0].get(), "to a", 4) == 0 );
+		run(5);
+		CHECK( received(a) == "to a" );
+		CHECK( received(b) == "to b" );
+	}
+	run(5);
+	CHECK( bus.handler().disconnects == 2 );
+
+	return 0;
+}
@@ -0,0 +1,174 @@
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <map>
+#include <string>
+#include "../Socket.hxx"
+#include "../TcpBus.hxx"
+
+/* Callbacks on worker threads: every connection sees its events in order,
+ * and a full queue holds up the loop (TcpBus_WORKER_BLOCK) rather than
+ * dropping data, unlike TcpBus_WORKER_DROP.
+ */
+
+#define CLIENTS 3
+#define CHUNKS 10      // Per client
+#define SLOW_RX 5000   // us per rx callback
+
+#define CHECK(x) do { if( !(x) ) { fprintf(stderr, "Failed: %s\n", #x); return 1; } } while(0)
+#define EXPECT(x) do { if( !(x) ) { fprintf(stderr, "Failed: %s\n", #x); return -1; } } while(0)
+
+/* What the callbacks saw, per client port: N for newcon, the data, and D
+ * when it is gone (clients leave the data of the others unread, so that may
+ * be a reset and reported as an error)
+ */
+struct Log {
+	pthread_mutex_t lock;
+	std::map<int, std::string> events;
+	int disconnects;
+
+	Log() : disconnects(0) { pthread_mutex_init(&lock, NULL); }
+	~Log() { pthread_mutex_destroy(&lock); }
+
+	void add(TcpBus::Connection conn, std::string const &what, bool disconnect = false) {
+		struct sockaddr_in const *sa = reinterpret_cast<struct sockaddr_in const*>(conn.addr());
+		pthread_mutex_lock(&lock);
+		events[ntohs(sa->sin_port)] += what;
+		if( disconnect ) disconnects++;
+		pthread_mutex_unlock(&lock);
+	}
+	int disconnected() {
+		pthread_mutex_lock(&lock);
+		int n = disconnects;
+		pthread_mutex_unlock(&lock);
+		return n;
+	}
+};
+
+/* Only uses what callbacks on workers may use: the address of the connection */
+struct Recorder : public TcpBus::Handler {
+	Log *log;
+
+	explicit Recorder(Log *log) : log(log) {}
+
+	void on_rx(TcpBus::Connection conn, TcpBus::Buffer data) {
+		usleep(SLOW_RX);
+		log->add(conn, data.str());
+	}
+	void on_newcon(TcpBus::Connection conn, struct sockaddr const *addr, socklen_t addr_len) {
+		log->add(conn, "N"); }
+	void on_error(TcpBus::Connection conn, struct sockaddr const *addr, socklen_t addr_len,
+	              int err) {
+		if( conn.valid() ) log->add(conn, "D", true); }
+	void on_disconnect(TcpBus::Connection conn, struct sockaddr const *addr, socklen_t addr_len) {
+		log->add(conn, "D", true); }
+};
+
+static void run(int rounds) {
+	for( int i = 0; i < rounds; i++ ) {
+		usleep(10000);
+		ev_run(EV_DEFAULT_ EVRUN_NOWAIT);
+	}
+}
+
+static double now() {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* Returns the number of clients whose events were all seen, in order, or -1
+ * on failure; *elapsed is how long sending took the loop
+ */
+static int round_trip(struct sockaddr_in const &sa, enum TcpBus_worker_policy policy,
+                      double *elapsed) {
+	Log log;
+	Socket s_listen( Socket::socket(AF_INET, SOCK_STREAM, 0) );
+	struct sockaddr_in la = sa;
+	socklen_t la_len = sizeof(la);
+	s_listen.bind(reinterpret_cast<struct sockaddr const*>(&la), sizeof(la));
+	s_listen.listen(8);
+	::getsockname(s_listen, reinterpret_cast<struct sockaddr*>(&la), &la_len);
+
+	TcpBus::Bus<Recorder> bus(EV_DEFAULT_ s_listen, Recorder(&log));
+	// A queue of one event, so it is full all the time
+	EXPECT( TcpBus_callback_workers(bus.get(), 2, 1, policy) == 0 );
+
+	int ports[CLIENTS];
+	std::string expected[CLIENTS];
+	{
+		Socket clients[CLIENTS];
+		for( int c = 0; c < CLIENTS; c++ ) {
+			clients[c] = Socket::socket(AF_INET, SOCK_STREAM, 0);
+			clients[c].connect(reinterpret_cast<struct sockaddr*>(&la), la_len);
+			struct sockaddr_in ca;
+			socklen_t ca_len = sizeof(ca);
+			::getsockname(clients[c], reinterpret_cast<struct sockaddr*>(&ca), &ca_len);
+			ports[c] = ntohs(ca.sin_port);
+			expected[c] = "N";
+		}
+		run(5);
+
+		// One chunk per client per iteration of the loop
+		double start = now();
+		for( int i = 0; i < CHUNKS; i++ ) {
+			for( int c = 0; c < CLIENTS; c++ ) {
+				char chunk[16];
+				int len = snprintf(chunk, sizeof(chunk), "%d,", i);
+				clients[c].send(chunk, len);
+				expected[c] += chunk;
+			}
+			ev_run(EV_DEFAULT_ EVRUN_NOWAIT);
+		}
+		*elapsed = now() - start;
+	}
+
+	double deadline = now() + 5;
+	while( log.disconnected() < CLIENTS && now() < deadline ) run(1);
+	EXPECT( log.disconnected() == CLIENTS );
+	TcpBus_callback_workers(bus.get(), 0, 0, policy); // Drain, and join
+
+	int complete = 0;
+	for( int c = 0; c < CLIENTS; c++ ) {
+		std::string const &seen = log.events[ports[c]];
+		expected[c] += "D";
+		if( seen == expected[c] ) {
+			complete++;
+			continue;
+		}
+		// Only data may be missing, and what is left is in order
+		EXPECT( seen.size() >= 2 && seen[0] == 'N' && seen[seen.size()-1] == 'D' );
+		size_t pos = 0;
+		for( size_t i = 1; i < seen.size() - 1; ) {
+			size_t end = seen.find(',', i) + 1;
+			size_t found = expected[c].find(seen.substr(i, end - i), pos);
+			EXPECT( found != std::string::npos );
+			pos = found + end - i;
+			i = end;
+		}
+	}
+	return complete;
+}
+
+int main() {
+	struct sockaddr_in sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	double elapsed;
+
+	// Every event is seen, and the loop waited for the workers: at least one
+	// of them handles two clients, that is 2 * CHUNKS slow callbacks
+	CHECK( round_trip(sa, TcpBus_WORKER_BLOCK, &elapsed) == CLIENTS );
+	CHECK( elapsed > CHUNKS * SLOW_RX / 1e6 );
+
+	// The loop doesn't wait, and data is lost
+	int complete = round_trip(sa, TcpBus_WORKER_DROP, &elapsed);
+	CHECK( complete >= 0 && complete < CLIENTS );
+	CHECK( elapsed < CHUNKS * SLOW_RX / 1e6 );
+
+	return 0;
+}
@@ -2,6 +2,7 @@
 #define __LIBTCPBUS_H__
 
 #include <ev.h>
+#include <stdint.h>
 #include <sys/socket.h>
 
 #ifndef __GNUC__
@@ -17,6 +18,12 @@ extern "C"{
  */
 struct TcpBus_bus;
 
+/* This datastructure represents a single connection on a TCP-bus
+ * It is valid from the newcon callback until the disconnect or error callback
+ * that reports its end has returned.
+ */
+struct TcpBus_connection;
+
 
 /* Initialize a new TCP-bus.
  *
@@ -58,20 +65,761 @@ void TcpBus_terminate(struct TcpBus_bus *bus) __attribute__((nonnull(1)));
 int TcpBus_send(const struct TcpBus_bus *bus, const char *data, size_t len)
                __attribute__((nonnull(1,2)));
 
+/* Send data to the bus from any thread
+ *
+ * @bus is the bus to send the data to.
+ * @data is the data to send of length @len
+ *
+ * returns -1 on failure
+ *
+ * All other functions must be called from the thread running the libev-loop
+ * of the bus. This one may be called from any thread, at any time between
+ * TcpBus_init() and TcpBus_terminate(). The data is copied and sent from the
+ * loop thread; data from a single thread is sent in order.
+ */
+int TcpBus_send_async(const struct TcpBus_bus *bus, const char *data, size_t len)
+                     __attribute__((nonnull(1,2)));
+
+/* Send data to the bus, except to a single connection
+ *
+ * @bus is the bus to send the data to.
+ * @except is the connection to skip, typically the one the data came from
+ * @data is the data to send of length @len
+ *
+ * returns -1 on failure
+ */
+int TcpBus_send_except(const struct TcpBus_bus *bus,
+                       const struct TcpBus_connection *except,
+                       const char *data, size_t len)
+                      __attribute__((nonnull(1,2,3)));
+
+/* Send data to a single connection
+ *
+ * @conn is the connection to send the data to.
+ * @data is the data to send of length @len
+ *
+ * returns -1 on failure, in which case the connection is closed (and
+ * reported through the error callbacks).
+ */
+int TcpBus_send_to(struct TcpBus_connection *conn, const char *data, size_t len)
+                  __attribute__((nonnull(1,2)));
+
+/* Priority of data on the bus, see TcpBus_priority_lanes()
+ */
+enum TcpBus_priority {
+	TcpBus_PRIORITY_CONTROL, // Overtakes everything else
+	TcpBus_PRIORITY_NORMAL,  // The default
+	TcpBus_PRIORITY_BULK,    // Gives way to everything else
+};
+#define TcpBus_PRIORITIES 3
+
+/* Send data to the bus, at a priority
+ *
+ * @bus is the bus to send the data to.
+ * @data is the data to send of length @len
+ * @priority is the lane to queue it in for connections that lag
+ *
+ * returns -1 on failure
+ *
+ * TcpBus_send() sends at TcpBus_PRIORITY_NORMAL.
+ */
+int TcpBus_send_priority(const struct TcpBus_bus *bus, const char *data, size_t len,
+                         enum TcpBus_priority priority)
+                        __attribute__((nonnull(1,2)));
+
+
+/* Get or set the user data of the bus
+ * This is NULL for a new bus. Since all callbacks get the bus, this is how
+ * they can find their context.
+ */
+void *TcpBus_get_data(const struct TcpBus_bus *bus)
+                     __attribute__((nonnull(1)));
+void TcpBus_set_data(struct TcpBus_bus *bus, void *data)
+                    __attribute__((nonnull(1)));
+
+
+/* Connections
+ **************/
+
+/* Get or set the user data of a connection
+ * This is NULL for new connections.
+ */
+void *TcpBus_connection_get_data(const struct TcpBus_connection *conn)
+                                __attribute__((nonnull(1)));
+void TcpBus_connection_set_data(struct TcpBus_connection *conn, void *data)
+                               __attribute__((nonnull(1)));
+
+/* Get the id of a connection
+ * Ids are unique within the bus, and never 0.
+ */
+uint64_t TcpBus_connection_id(const struct TcpBus_connection *conn)
+                             __attribute__((nonnull(1)));
+
+/* Get the peer address of a connection
+ * The length of the address is stored in @addr_len, if it's not NULL
+ */
+const struct sockaddr *TcpBus_connection_addr(const struct TcpBus_connection *conn,
+                                              socklen_t *addr_len)
+                                             __attribute__((nonnull(1)));
+
+
+/* Send a connection the bus compressed, or uncompressed again
+ *
+ * @conn is the connection to configure
+ * @enable is non-zero to compress, 0 to stop compressing
+ *
+ * Returns 0 on success, -1 on failure (errno ENOSYS if the library was built
+ * without zlib)
+ *
+ * From this point on, the connection receives a raw deflate stream (RFC 1951,
+ * e.g. inflateInit2() with -15 window bits), flushed after every chunk. Data
+ * the connection sends is not affected. All compressed connections share the
+ * compression work, so adding more does not take more CPU. How the client asks
+ * for compression is up to the application.
+ *
+ * Keepalives are sent as an empty deflate block to compressed connections.
+ * When compression is turned off, the deflate stream ends with an empty
+ * final block, so the client sees the end of the stream (Z_STREAM_END) right
+ * where the plain data starts. If it is turned on again, a new stream starts.
+ */
+int TcpBus_connection_set_compression(struct TcpBus_connection *conn, int enable)
+                                     __attribute__((nonnull(1)));
+
+
+/* Routing
+ **********
+ * By default, data a connection sends reaches all other connections. For
+ * anything else, connections can be put in groups, and a routing matrix says
+ * which groups hear which. A connection never hears its own data.
+ *
+ * Data sent with TcpBus_send() and friends, or coming in over a bus link,
+ * reaches all groups.
+ */
+
+#define TcpBus_GROUPS 64
+
+/* Put a connection in a group
+ *
+ * @conn is the connection to move
+ * @group is the group, below TcpBus_GROUPS. New connections are in group 0.
+ *
+ * Returns 0 on success, -1 on failure
+ */
+int TcpBus_connection_set_group(struct TcpBus_connection *conn, unsigned int group)
+                               __attribute__((nonnull(1)));
+unsigned int TcpBus_connection_get_group(const struct TcpBus_connection *conn)
+                                        __attribute__((nonnull(1)));
+
+/* Set whether a group hears another one
+ *
+ * @bus is the bus to configure
+ * @from is the group that sends
+ * @to is the group that hears @from or not. This may be the same group.
+ * @enable is non-zero to route, 0 to not route
+ *
+ * Returns 0 on success, -1 on failure
+ *
+ * Initially, all groups hear all groups. Changes take effect immediately.
+ */
+int TcpBus_route(struct TcpBus_bus *bus, unsigned int from, unsigned int to, int enable)
+                __attribute__((nonnull(1)));
+
+
+/* History
+ **********/
+
+/* Replay recent data to new connections
+ *
+ * @bus is the bus to configure
+ * @bytes is the maximum amount of data to replay, or 0 to disable (the
+ *        default). It can't exceed the backlog at which a connection is
+ *        dropped (1 MiB, unless a socket profile sets it).
+ * @age is the maximum age of the data to replay in seconds, or 0 for no limit
+ *
+ * Returns 0 on success, -1 on failure
+ *
+ * Everything sent on the bus is remembered, regardless of routing, and sent
+ * to each new connection right after the newcon callbacks. Replay always
+ * starts at the start of a chunk as it entered the bus (e.g. a single recv()
+ * from a connection), never halfway.
+ */
+int TcpBus_set_history(struct TcpBus_bus *bus, size_t bytes, ev_tstamp age)
+                      __attribute__((nonnull(1)));
+
+
+/* Journal
+ **********/
+
+/* Record everything sent on the bus in a journal
+ *
+ * @bus is the bus to record
+ * @directory is where to put the journal segments, or NULL to stop recording
+ * @segment_size is the size of a single segment file, in bytes
+ *
+ * Returns 0 on success, -1 on failure (including when the first segment
+ * can't be created in @directory)
+ *
+ * Every chunk is recorded with the time it was sent and the id of the
+ * connection it came from (0 for data sent through the API or coming in over
+ * a bus link). Recording happens on a separate thread; when the disk can't
+ * keep up, records are dropped, and the start of every such gap is reported
+ * through the error callbacks with ENOBUFS (see TcpBus_journal_dropped()).
+ * If writing fails later on, recording stops, and the errno is reported once
+ * through the error callbacks.
+ *
+ * Segment names start with the time recording started and the pid, so other
+ * processes can record in the same directory.
+ *
+ * The journal can be replayed with tcp-bus-replay.
+ */
+int TcpBus_journal(struct TcpBus_bus *bus, const char *directory, size_t segment_size)
+                  __attribute__((nonnull(1)));
+
+/* Get the number of records the journal dropped because the disk could not
+ * keep up, since recording started (0 if not recording)
+ */
+uint64_t TcpBus_journal_dropped(const struct TcpBus_bus *bus)
+                               __attribute__((nonnull(1)));
+
+
+/* Conflation
+ *************
+ * A connection that can't keep up is normally dropped once its backlog
+ * reaches 1 MiB (see TcpBus_set_socket_profile()). For feeds where only the
+ * latest value of everything matters, the backlog can be conflated instead:
+ * beyond a threshold, a message replaces the queued message with the same
+ * key, so the connection catches up at its own pace, with a backlog of at
+ * most one message per key.
+ *
+ * A message is a chunk as it entered the bus: one TcpBus_send(), or one
+ * recv() from a connection. Publishers should send one message at a time for
+ * this to be useful. Compressed connections are never conflated.
+ */
+
+/* Get the key of a message
+ * Returns a pointer to the key within @data, and its length in @key_len, or
+ * NULL if the message has no key and must always be delivered. This may be
+ * called from writer threads.
+ */
+typedef const char *(*TcpBus_conflation_key_t)(const char *data, size_t len,
+                                               size_t *key_len);
+
+/* Conflate the backlog of lagging connections
+ *
+ * @bus is the bus to configure
+ * @threshold is the backlog of a connection, in bytes, from which messages
+ *            are conflated. It must be below the backlog at which a
+ *            connection is dropped (1 MiB, unless a socket profile sets it).
+ * @key extracts the key of a message, or NULL to disable conflation (the
+ *      default)
+ *
+ * Returns 0 on success, -1 on failure (errno EBUSY if fan-out threads are
+ * running; configure this before TcpBus_fanout_threads())
+ *
+ * Queued messages keep the position of the first message with their key.
+ * Backlogs that were already conflated are still delivered after disabling.
+ */
+int TcpBus_set_conflation(struct TcpBus_bus *bus, size_t threshold,
+                          TcpBus_conflation_key_t key)
+                         __attribute__((nonnull(1)));
+
+
+/* Priority lanes
+ *****************
+ * A connection that can't keep up normally gets its backlog in the order it
+ * was sent, so urgent messages wait behind any bulk transfer ahead of them.
+ * With lanes, the backlog is kept per priority instead: control data
+ * overtakes normal data, which overtakes bulk data. Data of one priority
+ * stays in order.
+ *
+ * Like for conflation, a message is a chunk as it entered the bus. What a
+ * connection sends goes out at the priority of that connection; bus links
+ * and compressed connections carry everything at normal priority.
+ */
+
+/* Keep the backlog of lagging connections per priority
+ *
+ * @bus is the bus to configure
+ * @slice is the most data a connection has queued in order, in bytes, or 0
+ *        to disable the lanes (the default). More urgent data waits for at
+ *        most this much, plus what is in flight; bulk data is cut in pieces
+ *        of this size. It must be below the backlog at which a connection
+ *        is dropped (1 MiB, unless a socket profile sets it).
+ *
+ * Returns 0 on success, -1 on failure (errno EBUSY if fan-out threads are
+ * running or conflation is enabled)
+ *
+ * The send buffer of the kernel is limited to a slice as well
+ * (TCP_NOTSENT_LOWAT). Without lanes, priorities are ignored.
+ */
+int TcpBus_priority_lanes(struct TcpBus_bus *bus, size_t slice)
+                         __attribute__((nonnull(1)));
+
+/* Get or set the priority of the data a connection sends
+ * New connections are at TcpBus_PRIORITY_NORMAL.
+ * Returns 0 on success, -1 on failure
+ */
+int TcpBus_connection_set_priority(struct TcpBus_connection *conn,
+                                   enum TcpBus_priority priority)
+                                  __attribute__((nonnull(1)));
+enum TcpBus_priority TcpBus_connection_get_priority(const struct TcpBus_connection *conn)
+                                                   __attribute__((nonnull(1)));
+
+
+/* Fan-out threads
+ ******************
+ * Normally, the loop thread sends everything to every connection itself. With
+ * many connections, the connections can be spread over writer threads
+ * instead, which send in parallel. Data to a single connection stays in order.
+ *
+ * Connections that fail on a writer are reported through the error callbacks
+ * as usual, from the loop thread.
+ */
+
+/* Send to the connections from writer threads
+ *
+ * @bus is the bus to configure
+ * @threads is the number of writer threads, or 0 to send from the loop
+ *          thread again (the default)
+ *
+ * Returns 0 on success, -1 on failure
+ *
+ * Existing writers are stopped first, after sending what they had queued.
+ * Existing and new connections are spread evenly over the writers.
+ */
+int TcpBus_fanout_threads(struct TcpBus_bus *bus, int threads)
+                         __attribute__((nonnull(1)));
+
+
+/* Hot restart
+ **************
+ * A running bus can hand its listening sockets and all its connections
+ * (including the data that is still queued for them) over to a new process,
+ * without dropping a connection or a byte. Compressed connections stay
+ * compressed, and their deflate stream continues. Links to other buses are
+ * closed; the new process re-establishes them.
+ */
+
+/* Hand this bus over to another process
+ *
+ * @bus is the bus to hand over
+ * @unix_socket is a connected Unix-domain stream socket, with the new process
+ *               calling TcpBus_takeover() on the other end
+ *
+ * Returns 0 on success, -1 on failure
+ *
+ * This call blocks until the handover is complete. On success, the bus is
+ * left without connections and no longer accepts new ones, so the caller
+ * should TcpBus_terminate() it and exit. On failure, the bus continues as
+ * before. The lag monitor is stopped for the handover; after a failure, it
+ * starts over with its measurements reset.
+ */
+int TcpBus_handover(struct TcpBus_bus *bus, int unix_socket)
+                   __attribute__((nonnull(1)));
+
+/* Take over a bus from another process
+ *
+ * @loop is the libev-loop to use (if MULTIPLICITY is used).
+ * @unix_socket is a connected Unix-domain stream socket, with the old process
+ *               calling TcpBus_handover() on the other end
+ * @socket receives the listening socket of the bus
+ * @link_socket receives the socket listening for links, or -1 if the old bus
+ *              did not accept links
+ *
+ * returns a pointer to an TcpBus_bus structure which represents this bus.
+ * or NULL if an error occured
+ *
+ * This call blocks until the handover is complete. As with TcpBus_init(), the
+ * listening sockets are owned by the caller.
+ *
+ * The connections that were handed over are reported through the newcon
+ * callbacks when the loop first runs, so callbacks added right after this
+ * call see them, before any other callback about them. Their group,
+ * priority and compression are restored already; user data and whatever
+ * else the old process set up in its callbacks is not handed over.
+ */
+struct TcpBus_bus *TcpBus_takeover(EV_P_ int unix_socket,
+                                   int *socket, int *link_socket)
+                                  __attribute__((warn_unused_result));
+
+
+/* Idle detection
+ *****************
+ * Half-open connections (e.g. after a peer or switch reboot) are otherwise
+ * only noticed when sending to them fails.
+ */
+
+/* Close connections that did not send anything for a while
+ *
+ * @bus is the bus to configure
+ * @timeout is the number of seconds a connection may stay silent, or 0 to
+ *          disable (the default)
+ *
+ * Returns 0 on success, -1 on failure
+ *
+ * Expired connections are reported through the disconnect callbacks. Changing
+ * this setting starts a fresh idle period for all connections.
+ */
+int TcpBus_set_idle_timeout(struct TcpBus_bus *bus, ev_tstamp timeout)
+                           __attribute__((nonnull(1)));
+
+/* Send keepalive data to connections that did not send anything for a while
+ *
+ * @bus is the bus to configure
+ * @interval is the number of seconds of silence after which @data is sent,
+ *           or 0 to disable (the default)
+ * @data is the keepalive message, of length @len. It is sent as-is, so it
+ *       must be something the clients of the bus can ignore.
+ *
+ * Returns 0 on success, -1 on failure
+ *
+ * This is meant to be combined with TcpBus_set_idle_timeout(), with clients
+ * that answer the keepalive.
+ */
+int TcpBus_set_keepalive(struct TcpBus_bus *bus, ev_tstamp interval,
+                         const char *data, size_t len)
+                        __attribute__((nonnull(1)));
+
+
+/* Socket profiles
+ ******************
+ * Accepted connections normally get the socket options of the system. A
+ * profile sets the options that matter for a bus, and the backlog at which
+ * the bus gives up on a connection that can't keep up. Start from a preset,
+ * and override what is needed.
+ */
+
+struct TcpBus_socket_profile {
+	int nodelay;        // TCP_NODELAY: 0 or 1, -1 for the system default
+	int sndbuf;         // SO_SNDBUF in bytes, 0 for the system default
+	int rcvbuf;         // SO_RCVBUF in bytes, 0 for the system default
+	int notsent_lowat;  // TCP_NOTSENT_LOWAT in bytes, 0 for the system default
+	int rcvlowat;       // SO_RCVLOWAT in bytes, 0 for the system default
+	size_t backlog;     // Tx backlog to drop a connection at, 0 for 1 MiB
+};
+
+enum TcpBus_socket_preset {
+	TcpBus_PROFILE_DEFAULT,    // Nothing changed (the default)
+	TcpBus_PROFILE_LATENCY,    // TCP_NODELAY, 16 KiB TCP_NOTSENT_LOWAT
+	TcpBus_PROFILE_THROUGHPUT, // Nagle, 4 MiB buffers and backlog
+	TcpBus_PROFILE_LEAN,       // TCP_NODELAY, 16 KiB buffers, 64 KiB backlog
+};
+
+/* Fill in a preset
+ * Returns 0 on success, -1 on failure (errno EINVAL for an unknown preset)
+ */
+int TcpBus_socket_profile_preset(struct TcpBus_socket_profile *profile,
+                                 enum TcpBus_socket_preset preset)
+                                __attribute__((nonnull(1)));
+
+/* Use a socket profile
+ *
+ * @bus is the bus to configure
+ * @profile is the profile, which is copied
+ *
+ * Returns 0 on success, -1 on failure (errno EINVAL if the backlog is below
+ * the history, the slice of priority lanes or the conflation threshold)
+ *
+ * New connections get all options before they are reported. Existing
+ * connections get the options that are not left at the system default; the
+ * backlog applies to all connections right away. SO_RCVLOWAT holds back
+ * data until that much has arrived, so it only suits continuous feeds.
+ * With priority lanes, TCP_NOTSENT_LOWAT is the slice instead. Bus links
+ * keep the system defaults.
+ */
+int TcpBus_set_socket_profile(struct TcpBus_bus *bus,
+                              const struct TcpBus_socket_profile *profile)
+                             __attribute__((nonnull(1,2)));
+void TcpBus_get_socket_profile(const struct TcpBus_bus *bus,
+                               struct TcpBus_socket_profile *profile)
+                              __attribute__((nonnull(1,2)));
+
+
+/* TCP statistics
+ *****************
+ * When a connection is dropped, the errno alone does not tell a slow network
+ * from a slow client. The bus can sample what the kernel knows about each
+ * connection, at a low rate.
+ */
+
+struct TcpBus_connection_stats {
+	ev_tstamp sampled;     // ev_now() of the sample, 0 if not sampled yet
+	uint32_t rtt;          // Smoothed round trip time, in microseconds
+	uint32_t rtt_var;      // Its variation, in microseconds
+	uint32_t cwnd;         // Congestion window, in segments
+	uint32_t retransmits;  // Segments retransmitted, in total
+	uint32_t unacked;      // Segments sent but not acknowledged
+	uint32_t outq;         // Bytes in the send queue of the kernel
+	size_t backlog;        // Bytes queued in the bus, waiting for the kernel
+	unsigned int growing;  // Samples in a row in which outq + backlog grew
+};
+
+/* Sample the TCP state of all connections
+ *
+ * @bus is the bus to configure
+ * @interval is the number of seconds between samples of a connection, or 0
+ *           to stop sampling (the default)
+ * @evict is the number of queued bytes (outq + backlog) above which a
+ *        connection whose queue keeps growing is dropped, or 0 to never drop
+ *
+ * Returns 0 on success, -1 on failure
+ *
+ * Connections are not all sampled at once: a slice of them is sampled every
+ * 1/16th of @interval, so many connections never cause a burst of system
+ * calls. A connection is dropped (with ENOBUFS) when its queue grew for
+ * 3 samples in a row and is above @evict, before it reaches the hard limit.
+ */
+int TcpBus_set_tcp_sampling(struct TcpBus_bus *bus, ev_tstamp interval, size_t evict)
+                           __attribute__((nonnull(1)));
+
+/* Get the last sample of a connection
+ *
+ * Copies the statistics into @stats; stats->sampled is 0 if the connection
+ * was not sampled yet (or is not a TCP connection). While sampling is on, a
+ * connection that fails is sampled once more before the error callbacks.
+ *
+ * The loop thread writes the samples, so call this from the loop thread.
+ * On worker threads (see TcpBus_callback_workers()), only the error and
+ * disconnect callbacks may call it: a connection is not sampled once it has
+ * been reported.
+ */
+void TcpBus_connection_get_stats(const struct TcpBus_connection *conn,
+                                 struct TcpBus_connection_stats *stats)
+                                __attribute__((nonnull(1,2)));
+
+
+/* Loop lag
+ ***********
+ * A saturated loop shows as time spent handling events, instead of waiting
+ * for them. The bus can measure that on every iteration of the loop, and shed
+ * load in grades when it grows: first stop accepting connections, then read
+ * less from each connection per iteration, then drop the connections with
+ * the largest backlog.
+ */
+
+#define TcpBus_LAG_BUCKETS 24 // Histogram buckets, see below
+
+struct TcpBus_lag_stats {
+	uint64_t iterations;
+	ev_tstamp busy;        // Seconds spent handling events, in total
+	ev_tstamp waiting;     // Seconds spent waiting for events, in total
+	ev_tstamp lag;         // Moving average of the busy time per iteration
+	int level;             // Grade of shedding now, 0 for none
+	uint64_t paused;       // Times accepting was paused
+	uint64_t evicted;      // Connections dropped
+	/* Bucket 0 counts iterations under 1 µs, bucket i > 0 those from
+	 * 2^(i-1) up to 2^i µs; the last bucket counts everything longer.
+	 */
+	uint64_t busy_hist[TcpBus_LAG_BUCKETS];      // Busy time per iteration
+	uint64_t iteration_hist[TcpBus_LAG_BUCKETS]; // Busy and waiting time
+};
+
+/* Measure the lag of the loop
+ *
+ * @bus is the bus to configure
+ * @enable is non-zero to measure, 0 to stop (the default)
+ *
+ * Returns 0 on success, -1 on failure
+ *
+ * This costs two clock readings per iteration of the loop. Stopping also
+ * stops shedding, and resets the measurements.
+ */
+int TcpBus_lag_monitor(struct TcpBus_bus *bus, int enable)
+                      __attribute__((nonnull(1)));
+
+/* Shed load when the loop lags
+ *
+ * @bus is the bus to configure
+ * @accept is the lag (in seconds) from which new connections are not
+ *         accepted; they wait in the backlog of the listening socket
+ * @read is the lag from which each connection is read in smaller pieces, so
+ *       one iteration handles less
+ * @evict is the lag from which the connection with the largest backlog is
+ *        dropped (with ENOBUFS), at most one every 0.1 seconds
+ *
+ * Returns 0 on success, -1 on failure
+ *
+ * Any of the grades can be disabled with 0. This enables the monitor. The lag
+ * decays while the loop waits for events, so shedding ends by itself once the
+ * load is gone.
+ */
+int TcpBus_set_lag_shedding(struct TcpBus_bus *bus,
+                            ev_tstamp accept, ev_tstamp read, ev_tstamp evict)
+                           __attribute__((nonnull(1)));
+
+/* Get the measurements of the monitor
+ */
+void TcpBus_get_lag_stats(const struct TcpBus_bus *bus, struct TcpBus_lag_stats *stats)
+                         __attribute__((nonnull(1,2)));
+
+
+/* Busy polling
+ ***************
+ * For the lowest latency, the loop can keep polling instead of sleeping in
+ * the kernel, at the cost of a CPU core. tcp-bus-latency measures the
+ * round-trip time over a bus, to compare both modes.
+ */
+
+/* Keep polling for a while after activity, and pin the loop thread
+ *
+ * @bus is the bus to configure
+ * @cpu is the CPU to pin the calling thread to, which should be the thread
+ *      that runs the loop, or -1 to leave the affinity alone
+ * @spin is the number of seconds to keep polling after the last activity,
+ *       or 0 to block right away (the default)
+ *
+ * Returns 0 on success, -1 on failure
+ *
+ * While spinning, the loop polls without blocking, so other watchers on the
+ * same loop keep running. Connections also get SO_BUSY_POLL and
+ * SO_PREFER_BUSY_POLL, as far as the kernel allows.
+ */
+int TcpBus_set_busy_poll(struct TcpBus_bus *bus, int cpu, ev_tstamp spin)
+                        __attribute__((nonnull(1)));
+
+
+/* Payload arena
+ ****************/
+
+#define TcpBus_ARENA_MLOCK 1 // Lock the arena in memory
+
+/* Take data queued between threads from a preallocated arena
+ *
+ * @bus is the bus to configure
+ * @bytes is the size of the arena; it is rounded up to whole 2 MiB pages
+ * @flags is 0, or TcpBus_ARENA_MLOCK
+ *
+ * Returns 0 on success, -1 on failure (errno EBUSY if the bus already has an
+ * arena)
+ *
+ * Data handed to fan-out writers, callback workers and TcpBus_send_async() is
+ * normally copied into malloc()ed memory. With an arena, it goes into
+ * fixed-size slabs of about 4 KiB instead, in huge pages where available.
+ * Larger data, or data that comes when all slabs are in use, still uses
+ * malloc(). Call this before starting threads that use the bus, as it is only
+ * freed by TcpBus_terminate().
+ */
+int TcpBus_arena(struct TcpBus_bus *bus, size_t bytes, int flags)
+                __attribute__((nonnull(1)));
+
+
+/* Kernel forwarding
+ ********************/
+
+/* Forward between two connections inside the kernel, when possible
+ *
+ * @bus is the bus to configure
+ * @enable is non-zero to forward in the kernel when possible, 0 to always
+ *         forward in user space (the default)
+ *
+ * Returns 0 on success, -1 on failure (errno EPERM without CAP_BPF or
+ * CAP_NET_ADMIN, ENOSYS if the library was built without eBPF support, or
+ * whatever the kernel says it can't do). The bus keeps working in user space
+ * in that case.
+ *
+ * An eBPF program on a sockmap can only redirect data to a single socket, so
+ * this is used while the bus has exactly two connections, which hear each
+ * other, and nothing needs to see the data: no (batched) rx callbacks,
+ * history, journal, bus links, taps, compression, fan-out threads, idle
+ * timeout, keepalives, priority lanes or conflation. This is checked every time before the loop
+ * blocks. Data sent through the API while forwarding in the kernel is sent as
+ * usual; if a connection can't keep up, it may be interleaved with forwarded
+ * data.
+ */
+int TcpBus_kernel_forwarding(struct TcpBus_bus *bus, int enable)
+                            __attribute__((nonnull(1)));
+
+
+/* Bus links
+ ************
+ * Several buses can be linked together in a mesh, so that they behave as a
+ * single bus: data entering any of them is delivered to the connections of
+ * all of them, exactly once. Links use their own (framed) protocol, so they
+ * need a listening socket separate from the one passed to TcpBus_init().
+ *
+ * Links are reported through the newcon, error and disconnect callbacks, just
+ * like normal connections.
+ */
+
+/* Accept links from other buses
+ *
+ * @bus is the bus to link
+ * @socket is a socket opened in listening mode
+ *
+ * Returns 0 on success, -1 on failure
+ *
+ * Note that the listening socket will NOT be closed by TcpBus_terminate()
+ */
+int TcpBus_link_listen(struct TcpBus_bus *bus, int socket)
+                      __attribute__((nonnull(1)));
+
+/* Link to another bus
+ *
+ * @bus is the bus to link
+ * @addr is the address the other bus accepts links on, of length @addr_len
+ *
+ * Returns 0 on success, -1 on failure
+ *
+ * The connection is made in the background. Whenever it fails or is lost, it
+ * is retried with increasing delays.
+ */
+int TcpBus_link_connect(struct TcpBus_bus *bus,
+                        const struct sockaddr *addr, socklen_t addr_len)
+                       __attribute__((nonnull(1,2)));
+
+
+/* Taps
+ *******
+ * Monitoring tools can connect as taps, on a listening socket of their own,
+ * instead of as normal connections. A tap gets a sample of the chunks sent on
+ * the bus, each with the connection it came from and the time it was sent.
+ * What a tap sends is ignored, and a tap never slows down the bus: samples
+ * that don't fit in its socket right away are skipped.
+ *
+ * The stream a tap receives has the format of a journal segment (see
+ * TcpBus_journal()), so it can be saved and read with tcp-bus-replay; like
+ * the journal, it leaves out zero-length chunks. Taps are not reported
+ * through the callbacks, and are not handed over.
+ */
+
+/* Accept taps
+ *
+ * @bus is the bus to tap
+ * @socket is a socket opened in listening mode
+ * @every is 1 to send taps every chunk, or N to send only every Nth chunk
+ * @rate is the number of bytes per second (of data) each tap gets at most,
+ *       or 0 for no limit
+ *
+ * Returns 0 on success, -1 on failure (errno EBUSY if the bus already accepts
+ * taps)
+ *
+ * Note that the listening socket will NOT be closed by TcpBus_terminate()
+ */
+int TcpBus_tap_listen(struct TcpBus_bus *bus, int socket, unsigned int every, size_t rate)
+                     __attribute__((nonnull(1)));
+
 
 /* Callbacks
- ************/
+ ************
+ * All callbacks get the connection the event is about. This is NULL for
+ * events that are not about a single connection (e.g. a failed accept()) and
+ * for bus links.
+ */
 
 typedef void (*TcpBus_callback_rx_t)(const struct TcpBus_bus *bus,
+                                     struct TcpBus_connection *conn,
                                      const char *data, size_t len);
 typedef void (*TcpBus_callback_newcon_t)(const struct TcpBus_bus *bus,
+                                         struct TcpBus_connection *conn,
                                          const struct sockaddr *addr,
                                          socklen_t addr_len);
 typedef void (*TcpBus_callback_error_t)(const struct TcpBus_bus *bus,
+                                        struct TcpBus_connection *conn,
                                         const struct sockaddr *addr,
                                         socklen_t addr_len,
                                         int err_no);
 typedef void (*TcpBus_callback_disconnect_t)(const struct TcpBus_bus *bus,
+                                             struct TcpBus_connection *conn,
                                              const struct sockaddr *addr,
                                              socklen_t addr_len);
 
@@ -122,6 +870,79 @@ int TcpBus_callback_disconnect_remove(struct TcpBus_bus *bus,
                                      __attribute__((nonnull(1,2)));
 
 
+/* Batched rx callbacks
+ ***********************
+ * An rx callback is called for every chunk that is received, which is a lot
+ * of calls for consumers that only aggregate. A batched rx callback gets all
+ * chunks that were received during an iteration of the loop at once, after
+ * they have been forwarded, in the order they were received.
+ *
+ * Batched rx callbacks are always called from the loop thread, even with
+ * callback workers.
+ */
+
+/* A chunk in a batch
+ * @conn is NULL for data from a bus link. The connection stays valid during
+ * the callback, but may already be closed.
+ */
+struct TcpBus_rx_entry {
+	struct TcpBus_connection *conn;
+	const char *data;
+	size_t len;
+};
+
+/* The @n @entries, and their data, are only valid during the callback
+ */
+typedef void (*TcpBus_callback_rx_batch_t)(const struct TcpBus_bus *bus,
+                                           const struct TcpBus_rx_entry *entries,
+                                           size_t n);
+
+/* Register, or remove, a batched rx callback, like the other callbacks
+ */
+int TcpBus_callback_rx_batch_add(struct TcpBus_bus *bus,
+                                 TcpBus_callback_rx_batch_t f)
+                                __attribute__((nonnull(1,2)));
+int TcpBus_callback_rx_batch_remove(struct TcpBus_bus *bus,
+                                    TcpBus_callback_rx_batch_t f)
+                                   __attribute__((nonnull(1,2)));
+
+
+/* Callback workers
+ *******************
+ * By default, callbacks are called from the loop thread, so a slow callback
+ * holds up the whole bus. Alternatively, they can be called from a pool of
+ * worker threads. Data is then forwarded on the bus without waiting for the
+ * callbacks.
+ *
+ * The callbacks of a single connection are still called in order, from the
+ * same worker, and the connection stays valid until they have returned. From a
+ * worker, only TcpBus_send_async(), TcpBus_connection_get_data(),
+ * TcpBus_connection_set_data() and TcpBus_connection_addr() may be used.
+ * Callbacks must not be added or removed while workers are running.
+ */
+
+enum TcpBus_worker_policy {
+	TcpBus_WORKER_BLOCK, // Wait for room in the queue, holding up the bus
+	TcpBus_WORKER_DROP,  // Drop received data; other events always wait
+};
+
+/* Call the callbacks from worker threads
+ *
+ * @bus is the bus to configure
+ * @threads is the number of worker threads, or 0 to call the callbacks from
+ *          the loop thread again (the default)
+ * @queue_len is the number of events each worker can have queued
+ * @policy says what to do with an event when its worker's queue is full
+ *
+ * Returns 0 on success, -1 on failure
+ *
+ * Existing workers are stopped first, after they handled their queue.
+ */
+int TcpBus_callback_workers(struct TcpBus_bus *bus, int threads, size_t queue_len,
+                            enum TcpBus_worker_policy policy)
+                           __attribute__((nonnull(1)));
+
+
 
 #ifdef __cplusplus
 }
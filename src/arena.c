@@ -0,0 +1,133 @@
+/* Payload arena
+ *
+ * Chunks and other short-lived payloads can come from an arena of fixed-size
+ * slabs instead of malloc(). The arena is a single mapping, in 2 MiB huge
+ * pages if the system has them reserved, or in normal pages with a hint to
+ * use transparent huge pages otherwise, so it costs few TLB entries however
+ * busy the bus is.
+ *
+ * Slabs are allocated by any thread (TcpBus_send_async() runs on producer
+ * threads), and freed by whichever thread drops the last reference, so the
+ * free list is a lock-free stack with many poppers and pushers. Free slabs
+ * hold the index of the next free slab in their first bytes.
+ *
+ * A pop reads the next index of the head slab, then swaps it in. If other
+ * threads pop that slab and push it back in between, the head has the same
+ * index but a stale next (ABA). That can't go unnoticed: the head holds a
+ * tag next to the index, every push increments it, and the compare and swap
+ * covers both halves, so the pop fails and retries. Getting the slab back
+ * takes a push, so only 2^32 pushes during one pop could wrap the tag. The
+ * stale read itself is harmless, since slabs are never unmapped while the
+ * arena is in use.
+ */
+
+#include "internal.h"
+
+#include "../config.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#define ARENA_HUGE_PAGE (2*1024*1024)
+#define ARENA_SLAB_SIZE 4224 // A full recv() of 4 KiB, plus a header
+#define ARENA_NONE 0xffffffffu // Index that ends the free list
+
+struct arena {
+	char *base;
+	size_t size;       // Of the mapping
+	uint32_t n_slabs;
+	uint64_t head;     // Tag in the upper half, index of the first free slab
+};
+
+static inline uint32_t *slab_next(struct arena *a, uint32_t i) {
+	return (uint32_t*)(a->base + (size_t)i * ARENA_SLAB_SIZE);
+}
+
+void *arena_alloc(struct arena *a, size_t size) {
+	uint64_t head, next;
+
+	if( a == NULL || size > ARENA_SLAB_SIZE ) return NULL;
+
+	head = __atomic_load_n(&a->head, __ATOMIC_ACQUIRE);
+	do {
+		uint32_t i = head & 0xffffffff;
+		if( i == ARENA_NONE ) return NULL; // Exhausted
+		next = ( head & ~(uint64_t)0xffffffff )
+		     | __atomic_load_n(slab_next(a, i), __ATOMIC_RELAXED);
+	} while( !__atomic_compare_exchange_n(&a->head, &head, next, 1,
+	                                      __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE) );
+	return slab_next(a, head & 0xffffffff);
+}
+
+void arena_free(struct arena *a, void *p) {
+	uint32_t i = ((char*)p - a->base) / ARENA_SLAB_SIZE;
+	uint64_t head, next;
+
+	head = __atomic_load_n(&a->head, __ATOMIC_RELAXED);
+	do {
+		__atomic_store_n(slab_next(a, i), (uint32_t)head, __ATOMIC_RELAXED);
+		next = ( ( head >> 32 ) + 1 ) << 32 | i;
+	} while( !__atomic_compare_exchange_n(&a->head, &head, next, 1,
+	                                      __ATOMIC_RELEASE, __ATOMIC_RELAXED) );
+}
+
+void arena_init(struct TcpBus_bus *bus) {
+	bus->arena = NULL;
+}
+
+void arena_terminate(struct TcpBus_bus *bus) {
+	struct arena *a = bus->arena;
+
+	if( a == NULL ) return;
+	munmap(a->base, a->size);
+	free(a);
+	bus->arena = NULL;
+}
+
+
+int TcpBus_arena(struct TcpBus_bus *bus, size_t bytes, int flags) {
+	struct arena *a;
+	size_t i;
+
+	if( bus->arena != NULL ) {
+		errno = EBUSY; // Chunks may still point into it
+		return -1;
+	}
+	if( bytes == 0 || bytes / ARENA_SLAB_SIZE >= ARENA_NONE / 2 ) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	a = malloc(sizeof(*a)); // free() is in arena_terminate()
+	if( a == NULL ) return -1;
+	a->size = ( bytes + ARENA_HUGE_PAGE - 1 ) & ~(size_t)(ARENA_HUGE_PAGE - 1);
+	a->n_slabs = a->size / ARENA_SLAB_SIZE;
+
+	a->base = mmap(NULL, a->size, PROT_READ | PROT_WRITE,
+	               MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if( a->base == MAP_FAILED ) { // No huge pages reserved
+		a->base = mmap(NULL, a->size, PROT_READ | PROT_WRITE,
+		               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if( a->base == MAP_FAILED ) {
+			free(a);
+			return -1;
+		}
+		madvise(a->base, a->size, MADV_HUGEPAGE); // Not all kernels have THP
+	}
+	if( ( flags & TcpBus_ARENA_MLOCK ) && mlock(a->base, a->size) == -1 ) {
+		int err = errno;
+		munmap(a->base, a->size);
+		free(a);
+		errno = err;
+		return -1;
+	}
+
+	for( i = 0; i < a->n_slabs; i++ ) {
+		*slab_next(a, i) = ( i + 1 < a->n_slabs ) ? i + 1 : ARENA_NONE;
+	}
+	a->head = 0; // Tag 0, slab 0
+
+	bus->arena = a;
+	return 0;
+}
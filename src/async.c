@@ -0,0 +1,127 @@
+/* Thread-safe sending
+ *
+ * Other threads hand their data to the loop thread through a multi-producer,
+ * single-consumer queue (D. Vyukov's intrusive MPSC queue). Enqueueing is a
+ * single atomic exchange, so producers never wait for each other or for the
+ * loop thread. The loop thread is woken through an ev_async watcher, and
+ * drains the queue in batches.
+ */
+
+#include "internal.h"
+
+#include "../config.h"
+
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+
+#define ASYNC_BATCH 1024 // Messages per wakeup, so the loop is never starved
+
+struct async_msg {
+	struct async_node node;
+	struct arena *arena; // Where it came from, or NULL for malloc()
+	size_t len;
+	char data[];
+};
+
+static void async_msg_free(struct async_msg *m) {
+	if( m->arena ) arena_free(m->arena, m);
+	else free(m);
+}
+
+static void mpsc_push(struct TcpBus_bus *bus, struct async_node *m) {
+	struct async_node *prev;
+
+	__atomic_store_n(&m->next, NULL, __ATOMIC_RELAXED);
+	prev = __atomic_exchange_n(&bus->async_head, m, __ATOMIC_ACQ_REL);
+	// Between these two lines, the consumer sees the queue as empty
+	__atomic_store_n(&prev->next, m, __ATOMIC_RELEASE);
+}
+
+/* Only called from the loop thread
+ * Returns NULL when the queue is empty, or when a producer is halfway an
+ * enqueue; that producer will wake us again.
+ */
+static struct async_node *mpsc_pop(struct TcpBus_bus *bus) {
+	struct async_node *tail = bus->async_tail;
+	struct async_node *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+	if( tail == &bus->async_stub ) {
+		if( next == NULL ) return NULL;
+		bus->async_tail = tail = next;
+		next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+	}
+	if( next != NULL ) {
+		bus->async_tail = next;
+		return tail;
+	}
+	if( tail != __atomic_load_n(&bus->async_head, __ATOMIC_ACQUIRE) ) return NULL;
+
+	// tail is the last message; put the stub behind it so we can take it
+	mpsc_push(bus, &bus->async_stub);
+	next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+	if( next != NULL ) {
+		bus->async_tail = next;
+		return tail;
+	}
+	return NULL;
+}
+
+static void async_ready(EV_P_ ev_async *w, int revents) {
+	struct TcpBus_bus *bus = w->data;
+	struct async_node *node;
+	struct async_msg *m;
+	int n;
+
+	busy_poll_kick(bus);
+	for( n = 0; n < ASYNC_BATCH; n++ ) {
+		node = mpsc_pop(bus);
+		if( node == NULL ) return;
+		m = container_of(node, struct async_msg, node);
+		send_data(bus, m->data, m->len, NULL, GROUPS_ALL, TcpBus_PRIORITY_NORMAL);
+		link_publish(bus, m->data, m->len);
+		async_msg_free(m);
+	}
+	ev_async_send(EV_A_ w); // More to do, after the other watchers had a go
+}
+
+
+void async_init(struct TcpBus_bus *bus) {
+	bus->async_stub.next = NULL;
+	bus->async_head = bus->async_tail = &bus->async_stub;
+
+	ev_async_init(&bus->async_ready, async_ready);
+	bus->async_ready.data = bus;
+	ev_async_start(PBUS_EV_A_ &bus->async_ready);
+}
+
+void async_terminate(struct TcpBus_bus *bus) {
+	struct async_node *node;
+
+	ev_async_stop(PBUS_EV_A_ &bus->async_ready);
+	while( (node = mpsc_pop(bus)) != NULL ) {
+		async_msg_free(container_of(node, struct async_msg, node));
+	}
+}
+
+
+int TcpBus_send_async(const struct TcpBus_bus *cbus, const char *data, size_t len) {
+	// The queue is the only part of the bus touched here
+	struct TcpBus_bus *bus = (struct TcpBus_bus*)cbus;
+	struct async_msg *m;
+
+	m = arena_alloc(bus->arena, sizeof(*m) + len); // free() is in async_msg_free()
+	if( m != NULL ) {
+		m->arena = bus->arena;
+	} else {
+		m = malloc(sizeof(*m) + len); // free() is in async_msg_free()
+		if( m == NULL ) return -1;
+		m->arena = NULL;
+	}
+	m->len = len;
+	memcpy(m->data, data, len);
+
+	mpsc_push(bus, &m->node);
+	ev_async_send(PBUS_EV_A_ &bus->async_ready);
+	return 0;
+}
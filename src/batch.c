@@ -0,0 +1,116 @@
+/* Batched rx callbacks
+ *
+ * Everything received during an iteration of the loop is gathered in a
+ * single buffer, with an entry per chunk in a second buffer, and handed to
+ * the batch callbacks all at once. An ev_check watcher at the lowest
+ * priority does that: check watchers become pending together with the I/O
+ * watchers when the loop wakes up, and are invoked in order of priority, so
+ * it runs after the reads of that iteration. It has to be active before the
+ * loop wakes up, so it runs while there are batch callbacks.
+ *
+ * The entries hold a reference to their connection until the callbacks
+ * have returned.
+ */
+
+#include "internal.h"
+
+#include "../config.h"
+
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+
+static void batch_release(struct TcpBus_bus *bus) {
+	struct TcpBus_rx_entry *e = (struct TcpBus_rx_entry*)buffer_head(&bus->batch_entries);
+	size_t i, n = bus->batch_entries.len / sizeof(*e);
+
+	for( i = 0; i < n; i++ ) {
+		if( e[i].conn ) connection_release(e[i].conn);
+	}
+	buffer_consume(&bus->batch_entries, bus->batch_entries.len);
+	buffer_consume(&bus->batch_data, bus->batch_data.len);
+}
+
+static void batch_flush(EV_P_ ev_check *w, int revents) {
+	struct TcpBus_bus *bus = w->data;
+	struct TcpBus_rx_entry *e = (struct TcpBus_rx_entry*)buffer_head(&bus->batch_entries);
+	size_t i, n = bus->batch_entries.len / sizeof(*e);
+	const char *data = buffer_head(&bus->batch_data);
+	struct callback_rx_batch_t *cb;
+
+	if( n == 0 ) return;
+
+	// The data buffer may have moved while the batch grew
+	for( i = 0; i < n; i++ ) {
+		e[i].data = data;
+		data += e[i].len;
+	}
+	list_for_each_entry(cb, &bus->callback_rx_batch, list) {
+		cb->f(bus, e, n);
+	}
+	batch_release(bus);
+}
+
+void batch_rx(struct TcpBus_bus *bus, struct TcpBus_connection *conn,
+              const char *data, size_t len) {
+	struct TcpBus_rx_entry *e;
+
+	e = (struct TcpBus_rx_entry*)buffer_reserve(&bus->batch_entries, sizeof(*e));
+	if( e == NULL || buffer_append(&bus->batch_data, data, len) == -1 ) {
+		callback_error_call(bus, conn, conn ? &conn->addr : NULL,
+		                    conn ? conn->addr_len : 0, ENOMEM);
+		return;
+	}
+	e->conn = conn;
+	e->data = NULL; // Set in batch_flush()
+	e->len = len;
+	buffer_commit(&bus->batch_entries, sizeof(*e));
+	if( conn ) connection_hold(conn);
+}
+
+void batch_init(struct TcpBus_bus *bus) {
+	buffer_init(&bus->batch_data);
+	buffer_init(&bus->batch_entries);
+	ev_check_init(&bus->batch_check, batch_flush);
+	ev_set_priority(&bus->batch_check, EV_MINPRI); // After the reads it gathers
+	bus->batch_check.data = bus;
+}
+
+void batch_terminate(struct TcpBus_bus *bus) {
+	ev_check_stop(PBUS_EV_A_ &bus->batch_check);
+	batch_release(bus); // Undelivered: the bus is going away
+	buffer_free(&bus->batch_data);
+	buffer_free(&bus->batch_entries);
+}
+
+
+int TcpBus_callback_rx_batch_add(struct TcpBus_bus *bus, TcpBus_callback_rx_batch_t f) {
+	struct callback_rx_batch_t *cb;
+
+	cb = malloc(sizeof *cb); // free is in _remove()
+	if( cb == NULL ) return -1;
+	cb->f = f;
+
+	list_add(&cb->list, &bus->callback_rx_batch);
+	ev_check_start(PBUS_EV_A_ &bus->batch_check);
+	return 0;
+}
+
+int TcpBus_callback_rx_batch_remove(struct TcpBus_bus *bus, TcpBus_callback_rx_batch_t f) {
+	int count = 0;
+	struct callback_rx_batch_t *i, *tmp;
+
+	list_for_each_entry_safe(i, tmp, &bus->callback_rx_batch, list) {
+		if( i->f == f ) {
+			list_del(&i->list);
+			free(i);
+			count++;
+		}
+	}
+	if( list_empty(&bus->callback_rx_batch) ) {
+		// Nobody left to deliver the rest to
+		ev_check_stop(PBUS_EV_A_ &bus->batch_check);
+		batch_release(bus);
+	}
+	return count;
+}
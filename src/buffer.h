@@ -0,0 +1,77 @@
+#ifndef __BUFFER_H__
+#define __BUFFER_H__
+
+/* Simple growable byte buffer
+ *
+ * Data is appended at the end and consumed from the front. Consumed space is
+ * only reclaimed when the buffer runs empty or needs to grow, so consuming is
+ * O(1).
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+struct buffer {
+	char *data;
+	size_t start; // offset of the first unconsumed byte
+	size_t len;   // number of unconsumed bytes
+	size_t alloc;
+};
+
+#define BUFFER_INIT { NULL, 0, 0, 0 }
+
+static inline void buffer_init(struct buffer *b) {
+	b->data = NULL;
+	b->start = b->len = b->alloc = 0;
+}
+
+static inline void buffer_free(struct buffer *b) {
+	free(b->data);
+	buffer_init(b);
+}
+
+static inline char *buffer_head(const struct buffer *b) {
+	return b->data + b->start;
+}
+
+/* Make room for at least @len more bytes at the end
+ * Returns a pointer to the free space, or NULL on failure
+ */
+static inline char *buffer_reserve(struct buffer *b, size_t len) {
+	if( b->start > 0 && b->start + b->len + len > b->alloc ) {
+		memmove(b->data, b->data + b->start, b->len);
+		b->start = 0;
+	}
+	if( b->len + len > b->alloc ) {
+		size_t n = b->alloc ? b->alloc : 4096;
+		char *d;
+		while( n < b->len + len ) n *= 2;
+		d = realloc(b->data, n);
+		if( d == NULL ) return NULL;
+		b->data = d;
+		b->alloc = n;
+	}
+	return b->data + b->start + b->len;
+}
+
+/* Mark @len bytes, previously reserved, as used
+ */
+static inline void buffer_commit(struct buffer *b, size_t len) {
+	b->len += len;
+}
+
+static inline int buffer_append(struct buffer *b, const char *data, size_t len) {
+	char *p = buffer_reserve(b, len);
+	if( p == NULL ) return -1;
+	memcpy(p, data, len);
+	buffer_commit(b, len);
+	return 0;
+}
+
+static inline void buffer_consume(struct buffer *b, size_t len) {
+	b->start += len;
+	b->len -= len;
+	if( b->len == 0 ) b->start = 0;
+}
+
+#endif // __BUFFER_H__
@@ -0,0 +1,100 @@
+/* Busy polling
+ *
+ * Waking up from a blocking epoll_wait() costs tens of microseconds. In
+ * busy-poll mode, the loop keeps polling without blocking for a while after
+ * every bit of activity, so data that arrives shortly after is picked up
+ * right away. We don't own the loop, so this is done with an ev_idle watcher:
+ * as long as one is active, libev polls with a zero timeout. Once the spin
+ * budget is used up without activity, the watcher stops and the loop blocks
+ * as usual.
+ *
+ * Sockets also get SO_BUSY_POLL and SO_PREFER_BUSY_POLL, where the kernel
+ * supports (and allows) it, so the kernel polls the device queue too.
+ */
+
+#define _GNU_SOURCE // pthread_setaffinity_np()
+
+#include "internal.h"
+
+#include "../config.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/socket.h>
+
+static void busy_spin(EV_P_ ev_idle *w, int revents) {
+	struct TcpBus_bus *bus = w->data;
+
+	if( ev_now(EV_A) - bus->busy_last_activity >= bus->busy_spin ) {
+		ev_idle_stop(EV_A_ w); // Block again until something happens
+	}
+}
+
+void busy_poll_kick(struct TcpBus_bus *bus) {
+	if( bus->busy_spin <= 0 ) return;
+	bus->busy_last_activity = ev_now(PBUS_EV_A);
+	if( !ev_is_active(&bus->busy_idle) ) ev_idle_start(PBUS_EV_A_ &bus->busy_idle);
+}
+
+void busy_poll_socket(struct TcpBus_bus *bus, int socket) {
+	int usecs;
+
+	if( bus->busy_spin <= 0 ) return;
+	usecs = bus->busy_spin >= 1 ? 1000000 : bus->busy_spin * 1e6;
+	if( usecs < 1 ) usecs = 1;
+
+	// Raising SO_BUSY_POLL above net.core.busy_read needs CAP_NET_ADMIN;
+	// we spin in user space either way
+	setsockopt(socket, SOL_SOCKET, SO_BUSY_POLL, &usecs, sizeof(usecs));
+#ifdef SO_PREFER_BUSY_POLL // Linux 5.11
+	{
+		int one = 1;
+		setsockopt(socket, SOL_SOCKET, SO_PREFER_BUSY_POLL, &one, sizeof(one));
+	}
+#endif
+}
+
+void busy_poll_init(struct TcpBus_bus *bus) {
+	bus->busy_spin = 0;
+	bus->busy_last_activity = 0;
+	ev_idle_init(&bus->busy_idle, busy_spin);
+	bus->busy_idle.data = bus;
+}
+
+void busy_poll_terminate(struct TcpBus_bus *bus) {
+	ev_idle_stop(PBUS_EV_A_ &bus->busy_idle);
+}
+
+
+int TcpBus_set_busy_poll(struct TcpBus_bus *bus, int cpu, ev_tstamp spin) {
+	struct TcpBus_connection *i;
+
+	if( spin < 0 || cpu < -1 || cpu >= CPU_SETSIZE ) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if( cpu >= 0 ) {
+		cpu_set_t set;
+		int err;
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+		if( err != 0 ) {
+			errno = err;
+			return -1;
+		}
+	}
+
+	bus->busy_spin = spin;
+	if( spin > 0 ) {
+		list_for_each_entry(i, &bus->connections, list) {
+			busy_poll_socket(bus, i->socket);
+		}
+		busy_poll_kick(bus);
+	} else {
+		ev_idle_stop(PBUS_EV_A_ &bus->busy_idle);
+	}
+	return 0;
+}
@@ -0,0 +1,52 @@
+#ifndef __CHUNK_H__
+#define __CHUNK_H__
+
+/* Reference counted chunk of bus data
+ *
+ * A chunk is written once and then only read, so it can be shared between
+ * threads without copying. The last chunk_put() free()s it.
+ */
+
+#include "internal.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+struct chunk {
+	int refcnt;
+	struct arena *arena; // Where it came from, or NULL for malloc()
+	size_t len;
+	char data[];
+};
+
+/* Create a chunk holding a copy of @data, with a single reference
+ * It comes from @arena if there is one with room, from malloc() otherwise.
+ * Returns NULL on failure
+ */
+static inline struct chunk *chunk_new(struct arena *arena, const char *data, size_t len) {
+	struct chunk *c = arena_alloc(arena, sizeof(*c) + len); // free() is in chunk_put()
+	if( c == NULL ) {
+		arena = NULL;
+		c = malloc(sizeof(*c) + len); // free() is in chunk_put()
+		if( c == NULL ) return NULL;
+	}
+	c->refcnt = 1;
+	c->arena = arena;
+	c->len = len;
+	memcpy(c->data, data, len);
+	return c;
+}
+
+static inline struct chunk *chunk_get(struct chunk *c) {
+	__atomic_add_fetch(&c->refcnt, 1, __ATOMIC_RELAXED);
+	return c;
+}
+
+static inline void chunk_put(struct chunk *c) {
+	if( __atomic_sub_fetch(&c->refcnt, 1, __ATOMIC_ACQ_REL) == 0 ) {
+		if( c->arena ) arena_free(c->arena, c);
+		else free(c);
+	}
+}
+
+#endif // __CHUNK_H__
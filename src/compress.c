@@ -0,0 +1,246 @@
+/* Compression
+ *
+ * Connections can opt in to receive the bus compressed, as a raw deflate
+ * stream (RFC 1951). All of them share a single deflate stream, so every
+ * chunk is compressed only once, however many connections receive it.
+ *
+ * Chunks normally end with a sync flush, so the connections can decode them
+ * right away, and the dictionary carries over to the next chunk. A connection
+ * that does not get a chunk (because it sent it itself, or because of
+ * routing) would lose track of the dictionary, so such a chunk ends with a
+ * full flush instead. The same is done, without data, before a connection
+ * joins, or before data is sent to a single compressed connection.
+ */
+
+#include "internal.h"
+#include "chunk.h"
+
+#include "../config.h"
+
+#include <errno.h>
+#include <stdlib.h>
+
+#ifdef HAVE_ZLIB_H
+#include <zlib.h>
+
+struct compressor {
+	z_stream z;
+	struct buffer out;
+};
+
+/* Run deflate() over @data, leaving the output in c->out
+ */
+static int deflate_buffer(struct compressor *c, const char *data, size_t len, int flush) {
+	int rv;
+
+	buffer_consume(&c->out, c->out.len);
+	c->z.next_in = (Bytef*)data;
+	c->z.avail_in = len;
+	do {
+		size_t room = deflateBound(&c->z, c->z.avail_in) + 16;
+		char *p = buffer_reserve(&c->out, room);
+		if( p == NULL ) {
+			errno = ENOMEM;
+			return -1;
+		}
+		c->z.next_out = (Bytef*)p;
+		c->z.avail_out = room;
+		rv = deflate(&c->z, flush);
+		if( rv != Z_OK && rv != Z_BUF_ERROR ) {
+			errno = ENOMEM;
+			return -1;
+		}
+		buffer_commit(&c->out, room - c->z.avail_out);
+	} while( c->z.avail_out == 0 );
+	return 0;
+}
+
+/* Send what's in the compressor to all compressed connections
+ */
+static void broadcast(struct TcpBus_bus *bus) {
+	struct TcpBus_connection *i, *tmp;
+	struct buffer *out = &bus->compressor->out;
+
+	list_for_each_entry_safe(i, tmp, &bus->compressed, compress_list) {
+		if( connection_send(i, buffer_head(out), out->len) == -1 ) {
+			connection_drop(i, errno);
+		}
+	}
+}
+
+int compress_resync(struct TcpBus_bus *bus) {
+	if( bus->compress_fresh ) return 0;
+	if( list_empty(&bus->compressed) ) {
+		deflateReset(&bus->compressor->z); // Nobody to keep in sync
+	} else {
+		if( deflate_buffer(bus->compressor, NULL, 0, Z_FULL_FLUSH) == -1 ) return -1;
+		broadcast(bus);
+	}
+	bus->compress_fresh = 1;
+	return 0;
+}
+
+static void drop_all(struct TcpBus_bus *bus, int err) {
+	struct TcpBus_connection *i, *tmp;
+	list_for_each_entry_safe(i, tmp, &bus->compressed, compress_list) {
+		connection_drop(i, err);
+	}
+}
+
+
+int compress_data(struct TcpBus_bus *bus, const char *data, size_t len,
+                  const struct TcpBus_connection *skip, uint64_t groups,
+                  struct chunk **out) {
+	struct TcpBus_connection *i;
+	int flush = Z_SYNC_FLUSH;
+
+	*out = NULL;
+	if( list_empty(&bus->compressed) ) return 0;
+
+	list_for_each_entry(i, &bus->compressed, compress_list) {
+		if( i == skip || !( groups >> i->group & 1 ) ) {
+			flush = Z_FULL_FLUSH; // i misses this chunk
+			break;
+		}
+	}
+
+	if( deflate_buffer(bus->compressor, data, len, flush) == -1
+	 || (*out = chunk_new(bus->arena, buffer_head(&bus->compressor->out),
+	                      bus->compressor->out.len)) == NULL ) {
+		int err = errno;
+		drop_all(bus, err); // Their stream is broken now
+		errno = err;
+		return -1;
+	}
+	bus->compress_fresh = ( flush == Z_FULL_FLUSH );
+	return 0;
+}
+
+int compress_send_to(struct TcpBus_connection *c, const char *data, size_t len) {
+	struct TcpBus_bus *bus = c->bus;
+	char hdr[5];
+
+	if( compress_resync(bus) == -1 ) return -1;
+	if( c->dead ) {
+		errno = EPIPE;
+		return -1;
+	}
+
+	// Stored blocks; the next shared chunk won't refer back to them, since
+	// we just resynced
+	do {
+		size_t n = len > 0xffff ? 0xffff : len;
+		hdr[0] = 0; // Not final, stored
+		hdr[1] = n & 0xff;
+		hdr[2] = n >> 8;
+		hdr[3] = ~n & 0xff;
+		hdr[4] = (~n >> 8) & 0xff;
+		if( connection_send(c, hdr, sizeof(hdr)) == -1 ) return -1;
+		if( connection_send(c, data, n) == -1 ) return -1;
+		data += n;
+		len -= n;
+	} while( len > 0 );
+	return 0;
+}
+
+int compress_keepalive(struct TcpBus_connection *c) {
+	static const char empty[] = "\0\0\0\xff\xff"; // Stored, 0 bytes
+	return connection_send(c, empty, sizeof(empty) - 1);
+}
+
+void compress_init(struct TcpBus_bus *bus) {
+	bus->compressor = NULL;
+	bus->compress_fresh = 1;
+	INIT_LIST_HEAD(&bus->compressed);
+}
+
+void compress_terminate(struct TcpBus_bus *bus) {
+	if( bus->compressor == NULL ) return;
+	deflateEnd(&bus->compressor->z);
+	buffer_free(&bus->compressor->out);
+	free(bus->compressor);
+	bus->compressor = NULL;
+}
+
+
+int TcpBus_connection_set_compression(struct TcpBus_connection *conn, int enable) {
+	struct TcpBus_bus *bus = conn->bus;
+
+	if( conn->dead ) {
+		errno = EPIPE;
+		return -1;
+	}
+	enable = !!enable;
+	if( conn->compress == enable ) return 0;
+
+	if( enable ) {
+		if( bus->compressor == NULL ) {
+			struct compressor *c = malloc(sizeof(*c)); // free() is in compress_terminate()
+			if( c == NULL ) return -1;
+			c->z.zalloc = Z_NULL;
+			c->z.zfree = Z_NULL;
+			c->z.opaque = Z_NULL;
+			if( deflateInit2(&c->z, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+			                 -15, 8, Z_DEFAULT_STRATEGY) != Z_OK ) {
+				free(c);
+				errno = ENOMEM;
+				return -1;
+			}
+			buffer_init(&c->out);
+			bus->compressor = c;
+			bus->compress_fresh = 1;
+		}
+		if( compress_resync(bus) == -1 ) return -1;
+		if( conn->dead ) { // Got dropped while resyncing
+			errno = EPIPE;
+			return -1;
+		}
+		list_add(&conn->compress_list, &bus->compressed);
+	} else {
+		// Chunks end on a byte boundary, so an empty final block (fixed
+		// Huffman codes) ends the stream right before the plain data
+		if( connection_send(conn, "\x03\x00", 2) == -1 ) return -1;
+		list_del_init(&conn->compress_list);
+	}
+	conn->compress = enable;
+	if( conn->writer ) fanout_compress(conn, enable);
+	return 0;
+}
+
+#else // HAVE_ZLIB_H
+
+int compress_data(struct TcpBus_bus *bus, const char *data, size_t len,
+                  const struct TcpBus_connection *skip, uint64_t groups,
+                  struct chunk **out) {
+	*out = NULL;
+	return 0;
+}
+
+int compress_send_to(struct TcpBus_connection *c, const char *data, size_t len) {
+	errno = ENOSYS;
+	return -1;
+}
+
+int compress_keepalive(struct TcpBus_connection *c) {
+	errno = ENOSYS;
+	return -1;
+}
+
+int compress_resync(struct TcpBus_bus *bus) {
+	return 0;
+}
+
+void compress_init(struct TcpBus_bus *bus) {
+	INIT_LIST_HEAD(&bus->compressed);
+}
+
+void compress_terminate(struct TcpBus_bus *bus) {
+}
+
+int TcpBus_connection_set_compression(struct TcpBus_connection *conn, int enable) {
+	if( !enable ) return 0;
+	errno = ENOSYS;
+	return -1;
+}
+
+#endif // HAVE_ZLIB_H
@@ -0,0 +1,191 @@
+/* Conflation
+ *
+ * Normally, a connection that can't keep up collects a backlog in its Tx
+ * buffer until it is dropped. With conflation, once the Tx buffer holds more
+ * than a threshold, further messages are queued per connection instead. A
+ * message whose key is already queued replaces that message, in place, so
+ * the connection only gets the latest value for every key, in the order the
+ * keys were first queued.
+ *
+ * The queue is indexed by a chained hash table. Whenever the Tx buffer drains
+ * below the threshold, it is refilled from the queue, one whole message at a
+ * time. All of this is done by whoever owns the Tx side of the connection:
+ * the loop thread, or its fan-out writer.
+ */
+
+#include "internal.h"
+
+#include "../config.h"
+
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+
+#define CONFLATE_BUCKETS_MIN 16
+
+struct conflate_entry {
+	struct list_head order; // In c->conflate_queue
+	struct list_head index; // In the bucket of the hash, if keyed
+	int keyed;
+	uint32_t hash;
+	size_t key_off, key_len;
+	size_t len;
+	char *data;
+};
+
+static uint32_t hash_key(const char *key, size_t len) {
+	uint32_t h = 2166136261u; // FNV-1a
+	while( len-- > 0 ) {
+		h ^= (unsigned char)*key++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static void entry_free(struct TcpBus_connection *c, struct conflate_entry *e) {
+	list_del(&e->order);
+	if( e->keyed ) list_del(&e->index);
+	c->conflate_bytes -= e->len;
+	c->conflate_entries--;
+	free(e->data);
+	free(e);
+}
+
+static int index_grow(struct TcpBus_connection *c) {
+	size_t n = c->conflate_buckets ? c->conflate_buckets * 2 : CONFLATE_BUCKETS_MIN;
+	struct list_head *b;
+	struct conflate_entry *e;
+	size_t i;
+
+	b = malloc(n * sizeof(*b)); // free() is in conflate_connection_free()
+	if( b == NULL ) return -1;
+	for( i = 0; i < n; i++ ) INIT_LIST_HEAD(&b[i]);
+
+	list_for_each_entry(e, &c->conflate_queue, order) {
+		if( e->keyed ) list_move_tail(&e->index, &b[e->hash & (n-1)]);
+	}
+	free(c->conflate_index);
+	c->conflate_index = b;
+	c->conflate_buckets = n;
+	return 0;
+}
+
+static struct conflate_entry *index_find(struct TcpBus_connection *c, uint32_t hash,
+                                         const char *key, size_t key_len) {
+	struct conflate_entry *e;
+
+	if( c->conflate_buckets == 0 ) return NULL;
+	list_for_each_entry(e, &c->conflate_index[hash & (c->conflate_buckets-1)], index) {
+		if( e->hash == hash && e->key_len == key_len
+		 && memcmp(e->data + e->key_off, key, key_len) == 0 ) {
+			return e;
+		}
+	}
+	return NULL;
+}
+
+
+int conflate_queue(struct TcpBus_connection *c, const char *data, size_t len,
+                   int keyed) {
+	TcpBus_conflation_key_t key_f = c->bus->conflate_key;
+	struct conflate_entry *e = NULL;
+	const char *key = NULL;
+	size_t key_len = 0;
+	uint32_t hash = 0;
+	char *copy;
+
+	if( keyed && key_f ) key = key_f(data, len, &key_len);
+	if( key != NULL ) {
+		hash = hash_key(key, key_len);
+		e = index_find(c, hash, key, key_len);
+	}
+
+	if( c->tx.len + c->conflate_bytes - ( e ? e->len : 0 ) + len > connection_tx_max(c->bus) ) {
+		errno = ENOBUFS;
+		return -1;
+	}
+
+	copy = malloc(len); // free() is in entry_free()
+	if( copy == NULL ) {
+		errno = ENOMEM;
+		return -1;
+	}
+	memcpy(copy, data, len);
+
+	if( e != NULL ) { // Replace in place
+		free(e->data);
+		c->conflate_bytes -= e->len;
+	} else {
+		if( key != NULL && c->conflate_entries >= c->conflate_buckets
+		 && index_grow(c) == -1 ) {
+			free(copy);
+			errno = ENOMEM;
+			return -1;
+		}
+		e = malloc(sizeof(*e)); // free() is in entry_free()
+		if( e == NULL ) {
+			free(copy);
+			errno = ENOMEM;
+			return -1;
+		}
+		e->keyed = ( key != NULL );
+		e->hash = hash;
+		list_add_tail(&e->order, &c->conflate_queue);
+		if( e->keyed ) list_add(&e->index, &c->conflate_index[hash & (c->conflate_buckets-1)]);
+		c->conflate_entries++;
+	}
+	e->key_off = key ? key - data : 0;
+	e->key_len = key_len;
+	e->len = len;
+	e->data = copy;
+	c->conflate_bytes += len;
+	return 0;
+}
+
+int conflate_refill(struct TcpBus_connection *c, size_t threshold) {
+	while( !list_empty(&c->conflate_queue) && c->tx.len < threshold ) {
+		struct conflate_entry *e = list_entry(c->conflate_queue.next,
+		                                      struct conflate_entry, order);
+		if( buffer_append(&c->tx, e->data, e->len) == -1 ) {
+			errno = ENOMEM;
+			return -1;
+		}
+		entry_free(c, e);
+	}
+	return 0;
+}
+
+void conflate_init(struct TcpBus_bus *bus) {
+	bus->conflate_key = NULL;
+	bus->conflate_threshold = 0;
+}
+
+void conflate_connection_init(struct TcpBus_connection *c) {
+	INIT_LIST_HEAD(&c->conflate_queue);
+	c->conflate_index = NULL;
+	c->conflate_buckets = c->conflate_entries = c->conflate_bytes = 0;
+}
+
+void conflate_connection_free(struct TcpBus_connection *c) {
+	while( !list_empty(&c->conflate_queue) ) {
+		entry_free(c, list_entry(c->conflate_queue.next, struct conflate_entry, order));
+	}
+	free(c->conflate_index);
+	conflate_connection_init(c);
+}
+
+
+int TcpBus_set_conflation(struct TcpBus_bus *bus, size_t threshold,
+                          TcpBus_conflation_key_t key) {
+	if( key != NULL && ( threshold == 0 || threshold >= connection_tx_max(bus) ) ) {
+		errno = EINVAL;
+		return -1;
+	}
+	if( bus->writers || ( key != NULL && bus->lane_slice > 0 ) ) {
+		errno = EBUSY; // The writers read these without locking; lanes have their own queue
+		return -1;
+	}
+	bus->conflate_key = key;
+	if( key != NULL ) bus->conflate_threshold = threshold;
+	return 0;
+}
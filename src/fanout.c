@@ -0,0 +1,391 @@
+/* Fan-out threads
+ *
+ * With many connections, sending every chunk to all of them takes the loop
+ * thread most of its time. Fan-out spreads the connections over a number of
+ * writer threads, each with its own libev-loop. A writer owns the Tx side of
+ * its connections: their socket, Tx buffer and write watcher. The loop thread
+ * keeps reading, and hands each chunk to all writers at once.
+ *
+ * Everything the loop thread has to tell a writer goes through a lock-free
+ * single-producer, single-consumer ring, so the messages for a connection
+ * are handled in order. Data is copied once, into a refcounted chunk that is
+ * shared by all writers.
+ *
+ * Writers can't report errors through the callbacks themselves. Instead, they
+ * note the error in the connection and shut its socket down, so the loop
+ * thread reads EOF and drops the connection as usual.
+ */
+
+#include "internal.h"
+#include "chunk.h"
+
+#include "../config.h"
+
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <sched.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define FANOUT_RING 4096 // Messages per writer, must be a power of 2
+
+enum fanout_type {
+	FANOUT_ADD,      // Take over the Tx side of a connection
+	FANOUT_REMOVE,   // Close and release a connection
+	FANOUT_SEND_ALL, // Send a chunk to all connections in groups, except conn
+	FANOUT_SEND_TO,  // Send a chunk to conn
+	FANOUT_COMPRESS, // Send conn the compressed chunks from now on, or not
+	FANOUT_STOP,     // Leave the loop, handing the connections back
+};
+
+struct fanout_msg {
+	enum fanout_type type;
+	struct TcpBus_connection *conn;
+	struct chunk *chunk;
+	struct chunk *zchunk; // FANOUT_SEND_ALL: for compressed connections, or NULL
+	uint64_t groups;      // FANOUT_SEND_ALL: destination, FANOUT_COMPRESS: on/off
+	unsigned int priority; // FANOUT_SEND_*: lane of the data
+};
+
+struct writer {
+	struct TcpBus_bus *bus;
+	pthread_t thread;
+	struct ev_loop *loop;
+	ev_async wake;
+	struct list_head connections; // Only touched by the writer thread while it runs
+
+	struct fanout_msg ring[FANOUT_RING];
+	size_t head; // Only written by the loop thread
+	size_t tail; // Only written by the writer thread
+};
+
+
+/* Writer thread
+ ****************/
+
+/* Give up on a connection; the loop thread will notice and drop it
+ */
+static void writer_fail(struct writer *w, struct TcpBus_connection *c, int err) {
+	__atomic_store_n(&c->tx_error, err, __ATOMIC_RELAXED);
+	ev_io_stop(w->loop, &c->write_ready);
+	buffer_consume(&c->tx, c->tx.len);
+	conflate_connection_free(c);
+	lanes_connection_free(c);
+	shutdown(c->socket, SHUT_RDWR);
+}
+
+static void writer_send(struct writer *w, struct TcpBus_connection *c,
+                        const char *data, size_t len, unsigned int priority) {
+	size_t slice = c->bus->lane_slice;
+	ssize_t rv = 0;
+
+	if( c->tx_error ) return;
+
+	if( conflate_wanted(c, c->tx_compress) ) {
+		if( conflate_queue(c, data, len, !c->tx_compress) == -1 ) writer_fail(w, c, errno);
+		return;
+	}
+
+	if( c->tx.len == 0 ) {
+		rv = send(c->socket, data, len, 0);
+		if( rv == -1 ) {
+			if( errno != EAGAIN && errno != EWOULDBLOCK ) {
+				writer_fail(w, c, errno);
+				return;
+			}
+			rv = 0;
+		}
+		if( (size_t)rv == len ) return;
+	}
+
+	if( slice > 0 && c->tx.len + len - rv > slice ) {
+		if( c->tx_compress ) priority = TcpBus_PRIORITY_NORMAL; // One stream, in order
+		if( lane_queue(c, data + rv, len - rv, priority) == -1
+		 || lane_refill(c, slice) == -1 ) {
+			writer_fail(w, c, errno);
+			return;
+		}
+	} else if( c->tx.len + len - rv > connection_tx_max(c->bus) ) {
+		writer_fail(w, c, ENOBUFS);
+		return;
+	} else if( buffer_append(&c->tx, data + rv, len - rv) == -1 ) {
+		writer_fail(w, c, ENOMEM);
+		return;
+	}
+	if( !ev_is_active(&c->write_ready) ) {
+		ev_io_start(w->loop, &c->write_ready);
+	}
+}
+
+static void writer_ready_to_write(struct ev_loop *loop, ev_io *iow, int revents) {
+	struct TcpBus_connection *c = iow->data;
+	ssize_t rv;
+
+	rv = send(c->socket, buffer_head(&c->tx), c->tx.len, 0);
+	if( rv == -1 ) {
+		if( errno == EAGAIN || errno == EWOULDBLOCK ) return;
+		writer_fail(c->writer, c, errno);
+		return;
+	}
+	buffer_consume(&c->tx, rv);
+	if( conflate_refill(c, c->bus->conflate_threshold) == -1
+	 || lane_refill(c, c->bus->lane_slice) == -1 ) {
+		writer_fail(c->writer, c, errno);
+		return;
+	}
+	if( c->tx.len == 0 ) ev_io_stop(loop, iow);
+}
+
+static void writer_handle(struct writer *w, struct fanout_msg *m) {
+	struct TcpBus_connection *c = m->conn;
+	struct TcpBus_connection *i;
+
+	switch( m->type ) {
+	case FANOUT_ADD:
+		list_add(&c->fanout_list, &w->connections);
+		if( c->tx.len > 0 ) ev_io_start(w->loop, &c->write_ready);
+		break;
+
+	case FANOUT_REMOVE:
+		ev_io_stop(w->loop, &c->write_ready);
+		list_del(&c->fanout_list);
+		close(c->socket);
+		buffer_free(&c->tx);
+		conflate_connection_free(c);
+		lanes_connection_free(c);
+		connection_release(c); // The reference taken by fanout_add()
+		break;
+
+	case FANOUT_SEND_ALL:
+		list_for_each_entry(i, &w->connections, fanout_list) {
+			if( i == c ) continue; // Don't loop to self
+			if( !( m->groups >> __atomic_load_n(&i->group, __ATOMIC_RELAXED) & 1 ) ) continue;
+			if( i->tx_compress ) {
+				if( m->zchunk ) writer_send(w, i, m->zchunk->data, m->zchunk->len,
+				                            TcpBus_PRIORITY_NORMAL);
+			} else {
+				writer_send(w, i, m->chunk->data, m->chunk->len, m->priority);
+			}
+		}
+		chunk_put(m->chunk);
+		if( m->zchunk ) chunk_put(m->zchunk);
+		break;
+
+	case FANOUT_SEND_TO:
+		writer_send(w, c, m->chunk->data, m->chunk->len, m->priority);
+		chunk_put(m->chunk);
+		break;
+
+	case FANOUT_COMPRESS:
+		c->tx_compress = m->groups;
+		break;
+
+	case FANOUT_STOP:
+		ev_break(w->loop, EVBREAK_ALL);
+		break;
+	}
+}
+
+static void writer_wake(struct ev_loop *loop, ev_async *a, int revents) {
+	struct writer *w = a->data;
+	size_t tail = w->tail;
+
+	while( tail != __atomic_load_n(&w->head, __ATOMIC_ACQUIRE) ) {
+		struct fanout_msg m = w->ring[tail & (FANOUT_RING-1)];
+		__atomic_store_n(&w->tail, ++tail, __ATOMIC_RELEASE);
+		writer_handle(w, &m);
+	}
+}
+
+static void *writer_main(void *arg) {
+	struct writer *w = arg;
+	struct TcpBus_connection *c;
+
+	ev_run(w->loop, 0);
+
+	// The loop thread takes the connections back after we're gone
+	list_for_each_entry(c, &w->connections, fanout_list) {
+		ev_io_stop(w->loop, &c->write_ready);
+	}
+	return NULL;
+}
+
+
+/* Loop thread
+ **************/
+
+static void fanout_push(struct writer *w, enum fanout_type type,
+                        struct TcpBus_connection *conn,
+                        struct chunk *chunk, struct chunk *zchunk,
+                        uint64_t groups, unsigned int priority) {
+	size_t head = w->head;
+	struct fanout_msg *m;
+
+	while( head - __atomic_load_n(&w->tail, __ATOMIC_ACQUIRE) == FANOUT_RING ) {
+		// The writer is behind; it never blocks, so this won't take long
+		ev_async_send(w->loop, &w->wake);
+		sched_yield();
+	}
+	m = &w->ring[head & (FANOUT_RING-1)];
+	m->type = type;
+	m->conn = conn;
+	m->chunk = chunk;
+	m->zchunk = zchunk;
+	m->groups = groups;
+	m->priority = priority;
+	__atomic_store_n(&w->head, head + 1, __ATOMIC_RELEASE);
+}
+
+void fanout_add(struct TcpBus_connection *c) {
+	struct TcpBus_bus *bus = c->bus;
+	struct writer *w = &bus->writers[bus->writer_next++ % bus->n_writers];
+
+	ev_io_stop(PBUS_EV_A_ &c->write_ready);
+	ev_set_cb(&c->write_ready, writer_ready_to_write);
+	c->writer = w;
+	c->tx_compress = c->compress;
+	connection_hold(c); // Released by the writer on FANOUT_REMOVE
+	fanout_push(w, FANOUT_ADD, c, NULL, NULL, 0, 0);
+	ev_async_send(w->loop, &w->wake);
+}
+
+void fanout_remove(struct TcpBus_connection *c) {
+	struct writer *w = c->writer;
+	fanout_push(w, FANOUT_REMOVE, c, NULL, NULL, 0, 0);
+	ev_async_send(w->loop, &w->wake);
+}
+
+void fanout_send(const struct TcpBus_bus *bus, const char *data, size_t len,
+                 struct chunk *zchunk,
+                 const struct TcpBus_connection *skip, uint64_t groups,
+                 unsigned int priority) {
+	struct chunk *chunk;
+	int i;
+
+	chunk = chunk_new(bus->arena, data, len); // Put by the writers
+	if( chunk == NULL ) return;
+	for( i = 0; i < bus->n_writers; i++ ) {
+		fanout_push(&bus->writers[i], FANOUT_SEND_ALL,
+		            (struct TcpBus_connection*)skip, chunk_get(chunk),
+		            zchunk ? chunk_get(zchunk) : NULL, groups, priority);
+	}
+	for( i = 0; i < bus->n_writers; i++ ) {
+		ev_async_send(bus->writers[i].loop, &bus->writers[i].wake);
+	}
+	chunk_put(chunk);
+}
+
+int fanout_send_to(struct TcpBus_connection *c, const char *data, size_t len,
+                   unsigned int priority) {
+	struct chunk *chunk;
+
+	chunk = chunk_new(c->bus->arena, data, len); // Put by the writer
+	if( chunk == NULL ) return -1;
+	fanout_push(c->writer, FANOUT_SEND_TO, c, chunk, NULL, 0, priority);
+	ev_async_send(c->writer->loop, &c->writer->wake);
+	return 0;
+}
+
+void fanout_compress(struct TcpBus_connection *c, int enable) {
+	fanout_push(c->writer, FANOUT_COMPRESS, c, NULL, NULL, enable, 0);
+	ev_async_send(c->writer->loop, &c->writer->wake);
+}
+
+void fanout_stop(struct TcpBus_bus *bus) {
+	int i;
+
+	for( i = 0; i < bus->n_writers; i++ ) {
+		struct writer *w = &bus->writers[i];
+		fanout_push(w, FANOUT_STOP, NULL, NULL, NULL, 0, 0);
+		ev_async_send(w->loop, &w->wake);
+	}
+	for( i = 0; i < bus->n_writers; i++ ) {
+		struct writer *w = &bus->writers[i];
+		struct TcpBus_connection *c, *tmp;
+
+		pthread_join(w->thread, NULL);
+
+		list_for_each_entry_safe(c, tmp, &w->connections, fanout_list) {
+			list_del_init(&c->fanout_list);
+			c->writer = NULL;
+			ev_set_cb(&c->write_ready, connection_ready_to_write);
+			if( c->tx.len > 0 ) ev_io_start(PBUS_EV_A_ &c->write_ready);
+			connection_release(c); // The reference taken by fanout_add()
+		}
+		ev_async_stop(w->loop, &w->wake);
+		ev_loop_destroy(w->loop);
+	}
+	free(bus->writers);
+	bus->writers = NULL;
+	bus->n_writers = 0;
+}
+
+void fanout_init(struct TcpBus_bus *bus) {
+	bus->writers = NULL;
+	bus->n_writers = 0;
+	bus->writer_next = 0;
+}
+
+void fanout_terminate(struct TcpBus_bus *bus) {
+	fanout_stop(bus);
+}
+
+
+int TcpBus_fanout_threads(struct TcpBus_bus *bus, int threads) {
+	struct writer *writers;
+	struct TcpBus_connection *c;
+	sigset_t all, old;
+	int i, err = 0;
+
+	if( threads < 0 ) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	fanout_stop(bus);
+	if( threads == 0 ) return 0;
+
+	writers = calloc(threads, sizeof(*writers)); // free() is in fanout_stop()
+	if( writers == NULL ) return -1;
+	bus->writers = writers;
+
+	// Signals are for the loop thread
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+
+	for( i = 0; i < threads; i++ ) {
+		struct writer *w = &writers[i];
+		w->bus = bus;
+		INIT_LIST_HEAD(&w->connections);
+		w->loop = ev_loop_new(EVFLAG_AUTO);
+		if( w->loop == NULL ) {
+			err = ENOMEM;
+			break;
+		}
+		ev_async_init(&w->wake, writer_wake);
+		w->wake.data = w;
+		ev_async_start(w->loop, &w->wake);
+		err = pthread_create(&w->thread, NULL, writer_main, w);
+		if( err != 0 ) {
+			ev_async_stop(w->loop, &w->wake);
+			ev_loop_destroy(w->loop);
+			break;
+		}
+		bus->n_writers++;
+	}
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if( err != 0 ) {
+		fanout_stop(bus);
+		errno = err;
+		return -1;
+	}
+
+	list_for_each_entry(c, &bus->connections, list) {
+		fanout_add(c);
+	}
+	return 0;
+}
@@ -0,0 +1,359 @@
+/* Hot restart
+ *
+ * A running bus can hand its listening sockets and all its connections over
+ * to a new process over a Unix socket. File descriptors are passed with
+ * SCM_RIGHTS, together with the peer address, the group, the priority,
+ * whether it is compressed and the Tx data that was still queued for the
+ * connection. The routing matrix is not handed over.
+ *
+ * The shared deflate stream ends with a full flush before the handover, so
+ * the deflate stream of the new process can simply continue it.
+ *
+ * The new process reports the connections through the newcon callbacks when
+ * its loop first runs: the application can only add callbacks once
+ * TcpBus_takeover() returned.
+ *
+ * The old process stops reading before handing over, so anything that
+ * arrives in the mean time stays in the kernel socket buffer and is read by
+ * the new process. Since the sockets are shared, closing them in the old
+ * process afterwards does not affect the connection.
+ *
+ * Every record is a struct handover_record (carrying the file descriptor),
+ * followed by tx_len bytes of queued Tx data. Both processes must run the
+ * same version of the library.
+ */
+
+#include "internal.h"
+
+#include "../config.h"
+
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#define HANDOVER_MAGIC 0x54424833 // "TBH3"
+#define HANDOVER_TIMEOUT 5 // seconds
+
+enum handover_type {
+	HANDOVER_LISTEN = 1,
+	HANDOVER_LINK_LISTEN,
+	HANDOVER_CONNECTION,
+	HANDOVER_END,
+};
+
+struct handover_record {
+	uint32_t magic;
+	uint32_t type;
+	uint32_t tx_len;
+	uint32_t group;
+	uint32_t priority;
+	uint32_t compress;
+	socklen_t addr_len;
+	struct sockaddr_storage addr;
+};
+
+/* Send a record, for connection @c if it is not NULL
+ */
+static int send_record(int s, enum handover_type type, int fd,
+                       const struct TcpBus_connection *c) {
+	const struct buffer *tx = c ? &c->tx : NULL;
+	struct handover_record r;
+	struct iovec iov[2];
+	struct msghdr msg;
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} cmsg;
+	ssize_t rv;
+	size_t total;
+
+	memset(&r, 0, sizeof(r));
+	r.magic = HANDOVER_MAGIC;
+	r.type = type;
+	if( c ) {
+		r.tx_len = tx->len;
+		r.group = c->group;
+		r.priority = c->priority;
+		r.compress = c->compress;
+		r.addr_len = c->addr_len;
+		memcpy(&r.addr, &c->addr, c->addr_len);
+	}
+
+	iov[0].iov_base = &r;
+	iov[0].iov_len = sizeof(r);
+	iov[1].iov_base = tx ? buffer_head(tx) : NULL;
+	iov[1].iov_len = r.tx_len;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 2;
+	if( fd != -1 ) {
+		memset(&cmsg, 0, sizeof(cmsg));
+		msg.msg_control = cmsg.buf;
+		msg.msg_controllen = sizeof(cmsg.buf);
+		cmsg.hdr.cmsg_level = SOL_SOCKET;
+		cmsg.hdr.cmsg_type = SCM_RIGHTS;
+		cmsg.hdr.cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(&cmsg.hdr), &fd, sizeof(int));
+	}
+
+	rv = sendmsg(s, &msg, 0);
+	if( rv == -1 ) return -1;
+
+	// The descriptor went with the first byte; send the rest plainly
+	total = sizeof(r) + r.tx_len;
+	while( (size_t)rv < total ) {
+		ssize_t n;
+		if( (size_t)rv < sizeof(r) ) {
+			n = send(s, (char*)&r + rv, sizeof(r) - rv, 0);
+		} else {
+			n = send(s, buffer_head(tx) + (rv - sizeof(r)), total - rv, 0);
+		}
+		if( n == -1 ) return -1;
+		rv += n;
+	}
+	return 0;
+}
+
+static int recv_all(int s, void *buf, size_t len) {
+	size_t done = 0;
+	while( done < len ) {
+		ssize_t n = recv(s, (char*)buf + done, len - done, 0);
+		if( n == 0 ) errno = ECONNRESET;
+		if( n <= 0 ) return -1;
+		done += n;
+	}
+	return 0;
+}
+
+/* Receive a record header and its file descriptor (or -1)
+ */
+static int recv_record(int s, struct handover_record *r, int *fd) {
+	struct iovec iov;
+	struct msghdr msg;
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} cmsg;
+	struct cmsghdr *c;
+	ssize_t rv;
+
+	iov.iov_base = r;
+	iov.iov_len = sizeof(*r);
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cmsg.buf;
+	msg.msg_controllen = sizeof(cmsg.buf);
+
+	*fd = -1;
+	rv = recvmsg(s, &msg, MSG_WAITALL);
+	if( rv == -1 ) return -1;
+	for( c = CMSG_FIRSTHDR(&msg); c != NULL; c = CMSG_NXTHDR(&msg, c) ) {
+		if( c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS ) {
+			memcpy(fd, CMSG_DATA(c), sizeof(int));
+		}
+	}
+	if( (size_t)rv < sizeof(*r) && recv_all(s, (char*)r + rv, sizeof(*r) - rv) == -1 ) {
+		goto fail;
+	}
+	if( r->magic != HANDOVER_MAGIC || r->addr_len > sizeof(r->addr)
+	 || msg.msg_flags & MSG_CTRUNC ) {
+		errno = EPROTO;
+		goto fail;
+	}
+	return 0;
+
+fail:
+	if( *fd != -1 ) close(*fd);
+	*fd = -1;
+	return -1;
+}
+
+static void set_timeout(int s) {
+	struct timeval tv = { HANDOVER_TIMEOUT, 0 };
+	setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+/* Stop or restart all I/O of the bus
+ */
+static void handover_pause(struct TcpBus_bus *bus, int pause) {
+	struct TcpBus_connection *i;
+
+	accept_pause(bus, pause);
+	if( pause ) {
+		ev_io_stop(PBUS_EV_A_ &bus->e_link_listen);
+	} else {
+		if( bus->link_listening ) ev_io_start(PBUS_EV_A_ &bus->e_link_listen);
+	}
+	list_for_each_entry(i, &bus->connections, list) {
+		if( pause ) {
+			ev_io_stop(PBUS_EV_A_ &i->read_ready);
+			ev_io_stop(PBUS_EV_A_ &i->write_ready);
+		} else {
+			ev_io_start(PBUS_EV_A_ &i->read_ready);
+			if( i->tx.len > 0 ) ev_io_start(PBUS_EV_A_ &i->write_ready);
+		}
+	}
+}
+
+/* Report the connections we took over, before anything else happens to them
+ */
+static void takeover_report(EV_P_ ev_timer *w, int revents) {
+	struct TcpBus_bus *bus = w->data;
+	struct TcpBus_connection *i, *tmp;
+
+	list_for_each_entry_safe(i, tmp, &bus->connections, list) {
+		callback_newcon_call(bus, i, &i->addr, i->addr_len);
+	}
+}
+
+void handover_init(struct TcpBus_bus *bus) {
+	ev_timer_init(&bus->takeover_report, takeover_report, 0., 0.);
+	ev_set_priority(&bus->takeover_report, EV_MAXPRI); // Before their first read
+	bus->takeover_report.data = bus;
+}
+
+void handover_terminate(struct TcpBus_bus *bus) {
+	ev_timer_stop(PBUS_EV_A_ &bus->takeover_report);
+}
+
+
+int TcpBus_handover(struct TcpBus_bus *bus, int unix_socket) {
+	struct TcpBus_connection *i, *tmp;
+	int writers = bus->n_writers;
+	int lagging;
+	char ack;
+
+	set_timeout(unix_socket);
+	lagging = lag_stop(bus); // So shedding doesn't evict, or pause, meanwhile
+	fanout_stop(bus); // Takes the Tx buffers back from the writers
+	sockmap_release(bus); // Our maps go away with us
+	handover_pause(bus, 1);
+	if( compress_resync(bus) == -1 ) goto fail; // Nothing to refer back to
+
+	if( send_record(unix_socket, HANDOVER_LISTEN, bus->e_listen.fd, NULL) == -1 ) {
+		goto fail;
+	}
+	if( bus->link_listening
+	 && send_record(unix_socket, HANDOVER_LINK_LISTEN, bus->e_link_listen.fd, NULL) == -1 ) {
+		goto fail;
+	}
+	list_for_each_entry(i, &bus->connections, list) {
+		// The new process gets the conflated backlog as plain Tx data
+		if( conflate_refill(i, (size_t)-1) == -1 || lane_refill(i, (size_t)-1) == -1 ) goto fail;
+		if( send_record(unix_socket, HANDOVER_CONNECTION, i->socket, i) == -1 ) goto fail;
+	}
+	if( send_record(unix_socket, HANDOVER_END, -1, NULL) == -1 ) {
+		goto fail;
+	}
+
+	// Only let go once the new process confirms it has everything
+	if( recv_all(unix_socket, &ack, 1) == -1 ) goto fail;
+
+	list_for_each_entry_safe(i, tmp, &bus->connections, list) {
+		kill_connection(i); // Only closes our copy of the socket
+	}
+	// Links are not handed over, the new process re-establishes them
+	link_terminate(bus);
+	link_init(bus);
+	return 0;
+
+fail:
+	{
+		int err = errno;
+		handover_pause(bus, 0);
+		if( writers > 0 ) TcpBus_fanout_threads(bus, writers);
+		if( lagging ) TcpBus_lag_monitor(bus, 1);
+		errno = err;
+	}
+	return -1;
+}
+
+struct TcpBus_bus *TcpBus_takeover(
+#ifdef EV_MULTIPLICITY
+		struct ev_loop *loop,
+#endif
+		int unix_socket, int *socket, int *link_socket) {
+	struct TcpBus_bus *bus = NULL;
+	struct handover_record r;
+	int fd, err;
+	char ack = 1;
+
+	set_timeout(unix_socket);
+	*socket = *link_socket = -1;
+
+	for(;;) {
+		if( recv_record(unix_socket, &r, &fd) == -1 ) goto fail;
+
+		if( r.type == HANDOVER_END ) break;
+
+		if( fd == -1 || ( bus == NULL && r.type != HANDOVER_LISTEN ) ) {
+			errno = EPROTO;
+			goto fail;
+		}
+
+		switch( r.type ) {
+		case HANDOVER_LISTEN:
+			*socket = fd;
+			bus = TcpBus_init(EV_A_ fd);
+			if( bus == NULL ) goto fail;
+			break;
+
+		case HANDOVER_LINK_LISTEN:
+			*link_socket = fd;
+			if( TcpBus_link_listen(bus, fd) == -1 ) goto fail;
+			break;
+
+		case HANDOVER_CONNECTION: {
+			struct TcpBus_connection *c = connection_new(bus, fd, &r.addr, r.addr_len);
+			char *p;
+			if( c == NULL ) {
+				close(fd);
+				goto fail;
+			}
+			if( TcpBus_connection_set_group(c, r.group) == -1
+			 || TcpBus_connection_set_priority(c, (enum TcpBus_priority)r.priority) == -1
+			 || ( r.compress && TcpBus_connection_set_compression(c, 1) == -1 ) ) {
+				goto fail;
+			}
+			if( r.tx_len == 0 ) break;
+			p = buffer_reserve(&c->tx, r.tx_len);
+			if( p == NULL ) {
+				errno = ENOMEM;
+				goto fail;
+			}
+			if( recv_all(unix_socket, p, r.tx_len) == -1 ) goto fail;
+			buffer_commit(&c->tx, r.tx_len);
+			ev_io_start(EV_A_ &c->write_ready);
+			break;
+			}
+
+		default:
+			close(fd);
+			errno = EPROTO;
+			goto fail;
+		}
+	}
+
+	if( bus == NULL ) {
+		errno = EPROTO;
+		goto fail;
+	}
+	if( send(unix_socket, &ack, 1, 0) != 1 ) goto fail;
+	ev_timer_start(EV_A_ &bus->takeover_report);
+	return bus;
+
+fail:
+	err = errno;
+	if( bus != NULL ) TcpBus_terminate(bus);
+	if( *socket != -1 ) close(*socket);
+	if( *link_socket != -1 ) close(*link_socket);
+	*socket = *link_socket = -1;
+	errno = err;
+	return NULL;
+}
@@ -0,0 +1,125 @@
+/* History replay
+ *
+ * The most recent data sent on the bus is kept in a single contiguous buffer,
+ * so it can be replayed to a new connection with one send (in stored deflate
+ * blocks, if the connection is compressed by then). A second buffer holds an
+ * entry per chunk, so old data is trimmed (and replay starts) at the boundary
+ * of a chunk as it entered the bus.
+ *
+ * Once full, the history is trimmed at the front as fast as it grows at the
+ * end. A buffer just large enough would move all of it to the front for
+ * every chunk; history_append() keeps twice the room, so it only does so
+ * after at least as much was trimmed.
+ */
+
+#include "internal.h"
+
+#include "../config.h"
+
+#include <errno.h>
+#include <stdlib.h>
+
+struct history_entry {
+	size_t len;
+	ev_tstamp time; // ev_now() when it was sent
+};
+
+static struct history_entry *history_oldest(const struct TcpBus_bus *bus) {
+	return (struct history_entry*)buffer_head(&bus->history_entries);
+}
+
+/* Like buffer_append(), but only moving data that is outweighed by what was
+ * consumed before it
+ */
+static int history_append(struct buffer *b, const char *data, size_t len) {
+	if( b->alloc < 2 * ( b->len + len ) && buffer_reserve(b, b->len + 2 * len) == NULL ) {
+		return -1;
+	}
+	return buffer_append(b, data, len);
+}
+
+static void history_pop(struct TcpBus_bus *bus) {
+	buffer_consume(&bus->history, history_oldest(bus)->len);
+	buffer_consume(&bus->history_entries, sizeof(struct history_entry));
+}
+
+static void history_clear(struct TcpBus_bus *bus) {
+	buffer_consume(&bus->history, bus->history.len);
+	buffer_consume(&bus->history_entries, bus->history_entries.len);
+}
+
+/* Drop what is too old to replay
+ */
+static void history_expire(struct TcpBus_bus *bus) {
+	ev_tstamp oldest;
+
+	if( bus->history_age <= 0 ) return;
+	oldest = ev_now(PBUS_EV_A) - bus->history_age;
+	while( bus->history_entries.len > 0 && history_oldest(bus)->time < oldest ) {
+		history_pop(bus);
+	}
+}
+
+
+void history_record(struct TcpBus_bus *bus, const char *data, size_t len) {
+	struct history_entry e;
+
+	if( bus->history_max == 0 ) return;
+
+	if( len > bus->history_max ) {
+		history_clear(bus); // Replaying anything older would leave a gap
+		return;
+	}
+	while( bus->history.len + len > bus->history_max ) {
+		history_pop(bus);
+	}
+
+	e.len = len;
+	e.time = ev_now(PBUS_EV_A);
+	if( history_append(&bus->history_entries, (char*)&e, sizeof(e)) == -1 ) {
+		history_clear(bus);
+		return;
+	}
+	if( history_append(&bus->history, data, len) == -1 ) {
+		history_clear(bus);
+		return;
+	}
+}
+
+int history_replay(struct TcpBus_connection *c) {
+	struct TcpBus_bus *bus = c->bus;
+
+	history_expire(bus);
+	if( bus->history.len == 0 ) return 0;
+	if( c->compress ) { // Compressed in a newcon callback, before the replay
+		return compress_send_to(c, buffer_head(&bus->history), bus->history.len);
+	}
+	return connection_send(c, buffer_head(&bus->history), bus->history.len);
+}
+
+void history_init(struct TcpBus_bus *bus) {
+	bus->history_max = 0;
+	bus->history_age = 0;
+	buffer_init(&bus->history);
+	buffer_init(&bus->history_entries);
+}
+
+void history_terminate(struct TcpBus_bus *bus) {
+	buffer_free(&bus->history);
+	buffer_free(&bus->history_entries);
+}
+
+
+int TcpBus_set_history(struct TcpBus_bus *bus, size_t bytes, ev_tstamp age) {
+	if( bytes > connection_tx_max(bus) || age < 0 ) {
+		errno = EINVAL;
+		return -1;
+	}
+	bus->history_max = bytes;
+	bus->history_age = age;
+	while( bus->history.len > bytes ) {
+		history_pop(bus);
+	}
+	if( bytes == 0 ) history_terminate(bus); // Give the memory back
+	return 0;
+}
@@ -0,0 +1,182 @@
+/* Idle detection and keepalive
+ *
+ * Connections are kept in a hashed timing wheel, driven by a single ev_timer
+ * per bus, so the cost does not depend on the number of connections.
+ *
+ * Receiving data only records the current tick in the connection
+ * (idle_refresh()); the wheel entry is not moved. When the entry comes up, the
+ * real deadline is recalculated from that tick, and the entry is either
+ * expired or moved to the slot of its new deadline. An entry whose deadline
+ * is more than a full turn away simply stays in its slot for another turn.
+ */
+
+#include "internal.h"
+
+#include "../config.h"
+
+#include <errno.h>
+#include <stdlib.h>
+
+#define WHEEL_RESOLUTION_MIN 0.01
+#define WHEEL_RESOLUTION_MAX 1.
+#define WHEEL_TICKS_PER_PERIOD 8 // Precision of the shortest period
+
+static void wheel_schedule(struct TcpBus_bus *bus, struct TcpBus_connection *c,
+                           uint64_t tick) {
+	c->idle_expire = tick;
+	list_move_tail(&c->idle_wheel,
+	               &bus->idle_wheel[tick & (IDLE_WHEEL_SLOTS-1)]);
+}
+
+static void wheel_expire_entry(struct TcpBus_bus *bus, struct TcpBus_connection *c) {
+	uint64_t now = bus->idle_now;
+	uint64_t next = UINT64_MAX;
+
+	if( bus->idle_timeout ) {
+		uint64_t d = c->idle_last_rx + bus->idle_timeout;
+		if( now >= d ) {
+			connection_drop(c, 0);
+			return;
+		}
+		next = d;
+	}
+
+	if( bus->keepalive_interval ) {
+		uint64_t last = c->idle_last_rx > c->idle_last_keepalive ?
+		                c->idle_last_rx : c->idle_last_keepalive;
+		uint64_t k = last + bus->keepalive_interval;
+		if( now >= k ) {
+			if( ( c->compress ? compress_keepalive(c)
+			                  : connection_send(c, buffer_head(&bus->keepalive),
+			                                    bus->keepalive.len) ) == -1 ) {
+				connection_drop(c, errno);
+				return;
+			}
+			c->idle_last_keepalive = now;
+			k = now + bus->keepalive_interval;
+		}
+		if( k < next ) next = k;
+	}
+
+	wheel_schedule(bus, c, next);
+}
+
+static void wheel_tick(EV_P_ ev_timer *w, int revents) {
+	struct TcpBus_bus *bus = w->data;
+	uint64_t target;
+
+	// Catch up on ticks that were missed because the loop was busy
+	target = (ev_now(EV_A) - bus->idle_start) / bus->idle_resolution;
+	while( bus->idle_now < target ) {
+		struct list_head *slot;
+		struct TcpBus_connection *i, *tmp;
+
+		bus->idle_now++;
+		slot = &bus->idle_wheel[bus->idle_now & (IDLE_WHEEL_SLOTS-1)];
+		list_for_each_entry_safe(i, tmp, slot, idle_wheel) {
+			if( i->idle_expire > bus->idle_now ) continue; // Next turn
+			wheel_expire_entry(bus, i);
+		}
+	}
+}
+
+/* (Re)start the wheel with the current settings
+ * All connections start a fresh idle period.
+ */
+static void wheel_restart(struct TcpBus_bus *bus) {
+	struct TcpBus_connection *i;
+	ev_tstamp shortest = 0;
+
+	ev_timer_stop(PBUS_EV_A_ &bus->idle_tick);
+
+	list_for_each_entry(i, &bus->connections, list) {
+		list_del_init(&i->idle_wheel);
+	}
+
+	if( bus->idle_timeout_s > 0 ) shortest = bus->idle_timeout_s;
+	if( bus->keepalive_interval_s > 0
+	 && ( shortest == 0 || bus->keepalive_interval_s < shortest ) ) {
+		shortest = bus->keepalive_interval_s;
+	}
+	if( shortest == 0 ) return; // Nothing to watch
+
+	bus->idle_resolution = shortest / WHEEL_TICKS_PER_PERIOD;
+	if( bus->idle_resolution < WHEEL_RESOLUTION_MIN ) bus->idle_resolution = WHEEL_RESOLUTION_MIN;
+	if( bus->idle_resolution > WHEEL_RESOLUTION_MAX ) bus->idle_resolution = WHEEL_RESOLUTION_MAX;
+	// Round up, so we never expire early
+	bus->idle_timeout = bus->idle_timeout_s > 0 ?
+		(uint64_t)(bus->idle_timeout_s / bus->idle_resolution) + 1 : 0;
+	bus->keepalive_interval = bus->keepalive_interval_s > 0 ?
+		(uint64_t)(bus->keepalive_interval_s / bus->idle_resolution) + 1 : 0;
+
+	bus->idle_start = ev_now(PBUS_EV_A);
+	bus->idle_now = 0;
+
+	list_for_each_entry(i, &bus->connections, list) {
+		idle_add(i);
+	}
+
+	ev_timer_set(&bus->idle_tick, bus->idle_resolution, bus->idle_resolution);
+	ev_timer_start(PBUS_EV_A_ &bus->idle_tick);
+}
+
+
+void idle_add(struct TcpBus_connection *c) {
+	struct TcpBus_bus *bus = c->bus;
+	uint64_t next = UINT64_MAX;
+
+	if( !ev_is_active(&bus->idle_tick) ) return;
+
+	c->idle_last_rx = c->idle_last_keepalive = bus->idle_now;
+	if( bus->idle_timeout ) next = bus->idle_now + bus->idle_timeout;
+	if( bus->keepalive_interval && bus->idle_now + bus->keepalive_interval < next ) {
+		next = bus->idle_now + bus->keepalive_interval;
+	}
+	wheel_schedule(bus, c, next);
+}
+
+void idle_init(struct TcpBus_bus *bus) {
+	int i;
+
+	for( i = 0; i < IDLE_WHEEL_SLOTS; i++ ) {
+		INIT_LIST_HEAD(&bus->idle_wheel[i]);
+	}
+	bus->idle_timeout_s = bus->keepalive_interval_s = 0;
+	bus->idle_timeout = bus->keepalive_interval = 0;
+	bus->idle_now = 0;
+	buffer_init(&bus->keepalive);
+
+	ev_init(&bus->idle_tick, wheel_tick);
+	bus->idle_tick.data = bus;
+}
+
+void idle_terminate(struct TcpBus_bus *bus) {
+	ev_timer_stop(PBUS_EV_A_ &bus->idle_tick);
+	buffer_free(&bus->keepalive);
+}
+
+
+int TcpBus_set_idle_timeout(struct TcpBus_bus *bus, ev_tstamp timeout) {
+	if( timeout < 0 ) {
+		errno = EINVAL;
+		return -1;
+	}
+	bus->idle_timeout_s = timeout;
+	wheel_restart(bus);
+	return 0;
+}
+
+int TcpBus_set_keepalive(struct TcpBus_bus *bus, ev_tstamp interval,
+                         const char *data, size_t len) {
+	if( interval < 0 || ( interval > 0 && ( data == NULL || len == 0 ) ) ) {
+		errno = EINVAL;
+		return -1;
+	}
+	buffer_consume(&bus->keepalive, bus->keepalive.len);
+	if( interval > 0 && buffer_append(&bus->keepalive, data, len) == -1 ) {
+		return -1;
+	}
+	bus->keepalive_interval_s = interval;
+	wheel_restart(bus);
+	return 0;
+}
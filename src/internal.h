@@ -0,0 +1,645 @@
+#ifndef __INTERNAL_H__
+#define __INTERNAL_H__
+
+/* Datastructures shared between the source files of the library.
+ * Nothing in here is part of the public API.
+ */
+
+#include "../include/libtcpbus.h"
+
+#include "list.h"
+#include "buffer.h"
+#include <stdint.h>
+#include <stdlib.h>
+
+#define INTERNAL __attribute__((visibility("hidden")))
+
+struct TcpBus_connection {
+	struct TcpBus_bus *bus;
+	struct list_head list;
+	uint64_t id;
+	int socket;
+	struct sockaddr_storage addr;
+	socklen_t addr_len;
+	ev_io read_ready;
+	ev_io write_ready;
+	struct buffer tx; // Data the kernel did not accept yet
+	void *user_data;
+	unsigned int group;
+	struct list_head group_list; // In bus->groups[group]
+	int refcnt; // Held by the bus until killed, and by callbacks using it
+	int dead;   // Closed, free()d when the last reference is released
+
+	/* Fan-out, see fanout.c */
+	struct writer *writer;        // Owner of the Tx side, or NULL for the loop thread
+	struct list_head fanout_list; // In the list of the writer
+	int tx_error;                 // Set by the writer when it gave up
+	int tx_compress;              // The writer's view of compress
+
+	/* Compression, see compress.c */
+	int compress;                 // Receives the compressed stream
+	struct list_head compress_list;
+
+	/* Conflation, see conflate.c; owned by whoever owns the Tx side */
+	struct list_head conflate_queue; // Messages waiting for room in tx
+	struct list_head *conflate_index;
+	size_t conflate_buckets, conflate_entries, conflate_bytes;
+
+	/* Priority lanes, see lanes.c; owned by whoever owns the Tx side */
+	unsigned int priority;        // Of the data this connection sends
+	struct list_head lanes[TcpBus_PRIORITIES]; // Data waiting for room in tx
+	size_t lane_bytes;
+
+	/* TCP statistics, see tcpinfo.c */
+	struct list_head tcpinfo_ring;
+	struct TcpBus_connection_stats stats;
+	ev_tstamp tcpinfo_due;        // When to sample next
+	size_t tcpinfo_queue;         // outq + backlog at the last sample
+
+	/* Idle detection, see idle.c */
+	struct list_head idle_wheel;
+	uint64_t idle_expire;         // Tick of the wheel slot we're in
+	uint64_t idle_last_rx;        // Tick of the last received data
+	uint64_t idle_last_keepalive; // Tick of the last keepalive sent
+};
+
+
+struct async_node {
+	struct async_node *next;
+};
+
+
+#define callback_list(type) \
+	struct callback_ ## type ## _t { \
+		struct list_head list; \
+		TcpBus_callback_ ## type ## _t f; \
+	};
+callback_list(rx);
+callback_list(newcon);
+callback_list(error);
+callback_list(disconnect);
+callback_list(rx_batch);
+
+
+struct TcpBus_bus {
+	ev_io e_listen;
+	unsigned int accept_pauses;  // Reasons e_listen is stopped, see accept_pause()
+	EV_P;
+	struct list_head connections;
+	uint64_t connection_id;  // Of the last new connection
+	void *user_data;
+	struct list_head callback_rx;
+	struct list_head callback_newcon;
+	struct list_head callback_error;
+	struct list_head callback_disconnect;
+	struct list_head callback_rx_batch; // See batch.c
+
+	/* Routing, see TcpBus_route() */
+	uint64_t routes[TcpBus_GROUPS]; // Destination groups of each source group
+	struct list_head groups[TcpBus_GROUPS];
+
+	/* Bus links, see link.c */
+	uint64_t id;            // Unique id of this bus in the mesh
+	uint64_t link_seq;      // Sequence number of the last frame we originated
+	ev_io e_link_listen;
+	int link_listening;
+	struct list_head links;
+	struct list_head origins;         // Least recently seen first
+	struct list_head *origin_index;   // Hash buckets of the origins
+	size_t origin_buckets, origin_count;
+
+	/* Hot restart, see handover.c */
+	ev_timer takeover_report;     // Reports handed over connections
+
+	/* Idle detection, see idle.c */
+#define IDLE_WHEEL_SLOTS 256 // Must be a power of 2
+	ev_timer idle_tick;
+	ev_tstamp idle_start;         // ev_now() at tick 0
+	ev_tstamp idle_resolution;    // Seconds per tick
+	ev_tstamp idle_timeout_s, keepalive_interval_s;
+	uint64_t idle_timeout;        // In ticks, 0 if disabled
+	uint64_t keepalive_interval;  // In ticks, 0 if disabled
+	uint64_t idle_now;            // Current tick
+	struct buffer keepalive;      // Data to send as keepalive
+	struct list_head idle_wheel[IDLE_WHEEL_SLOTS];
+
+	/* Thread-safe sending, see async.c */
+	ev_async async_ready;
+	struct async_node *async_head; // Producers push here
+	struct async_node *async_tail; // The loop thread pops here
+	struct async_node async_stub;
+
+	/* Callback workers, see workers.c */
+	struct worker *workers; // NULL if callbacks run on the loop thread
+	int n_workers;
+	size_t worker_queue_len;
+	enum TcpBus_worker_policy worker_policy;
+
+	/* Fan-out threads, see fanout.c */
+	struct writer *writers; // NULL if the loop thread sends
+	int n_writers;
+	unsigned int writer_next; // Round robin for new connections
+
+	/* History replay, see history.c */
+	size_t history_max;             // In bytes, 0 if disabled
+	ev_tstamp history_age;          // In seconds, 0 if unlimited
+	struct buffer history;          // The data
+	struct buffer history_entries;  // A struct history_entry per chunk
+
+	/* Journal, see journal.c */
+	struct journal *journal; // NULL if disabled
+
+	/* Compression, see compress.c */
+	struct compressor *compressor; // NULL until first used
+	int compress_fresh;            // Nothing compressed since the last full flush
+	struct list_head compressed;   // Connections that receive compressed data
+
+	/* Payload arena, see arena.c */
+	struct arena *arena; // NULL if disabled
+
+	/* Kernel forwarding, see sockmap.c */
+	struct sockmap *sockmap; // NULL if disabled
+
+	/* Batched rx callbacks, see batch.c */
+	ev_check batch_check;         // Active while a batch is queued
+	struct buffer batch_data;     // Data of the batch, back to back
+	struct buffer batch_entries;  // A struct TcpBus_rx_entry per chunk
+
+	/* Taps, see tap.c */
+	ev_io e_tap_listen;
+	int tap_listening;
+	struct list_head taps;
+	unsigned int tap_every;   // Sample every Nth chunk
+	unsigned int tap_count;   // Chunks since the last sample
+	size_t tap_rate;          // Bytes per second per tap, 0 if unlimited
+
+	/* Loop lag, see lag.c */
+	ev_prepare lag_prepare;
+	ev_check lag_check;
+	ev_timer lag_recover;         // Wakes the loop while shedding
+	ev_tstamp lag_prepared;       // ev_time() in the last prepare
+	ev_tstamp lag_checked;        // ev_time() in the last check
+	ev_tstamp lag_accept, lag_read, lag_evict; // Shedding thresholds
+	ev_tstamp lag_last_evict;
+	int lag_paused;               // We hold an accept_pause()
+	size_t read_budget;           // Bytes to read per wakeup
+	struct TcpBus_lag_stats lag;
+
+	/* TCP statistics, see tcpinfo.c */
+	ev_timer tcpinfo_tick;
+	ev_tstamp tcpinfo_interval;  // Seconds between samples, 0 if disabled
+	size_t tcpinfo_evict;        // Queue to drop growing connections at, 0 if never
+	struct list_head tcpinfo_ring; // Connections, the next one to sample first
+	size_t tcpinfo_count;          // In the ring
+
+	/* Busy polling, see busypoll.c */
+	ev_tstamp busy_spin;          // Seconds to keep polling, 0 if disabled
+	ev_tstamp busy_last_activity;
+	ev_idle busy_idle;            // Active while spinning
+
+	/* Conflation, see conflate.c */
+	TcpBus_conflation_key_t conflate_key; // NULL if disabled
+	size_t conflate_threshold;            // Tx backlog from which we conflate
+
+	/* Priority lanes, see lanes.c */
+	size_t lane_slice;                    // Most Tx data in order, 0 if disabled
+
+	/* Socket profile, see profile.c */
+	struct TcpBus_socket_profile profile;
+	size_t tx_max;                        // Backlog to drop connections at
+};
+#ifdef EV_MULTIPLICITY
+#define PBUS_EV_A bus->loop
+#define PBUS_EV_A_ PBUS_EV_A ,
+#else
+#define PBUS_EV_A
+#define PBUS_EV_A_
+#endif
+
+
+static inline void callback_rx_run(const struct TcpBus_bus *bus,
+                                   struct TcpBus_connection *conn,
+                                   const char *buf, size_t rx_len) {
+	struct callback_rx_t *i;
+	list_for_each_entry(i, &bus->callback_rx, list) {
+		i->f(bus, conn, buf, rx_len);
+	}
+}
+
+static inline void callback_newcon_run(const struct TcpBus_bus *bus,
+                                       struct TcpBus_connection *conn,
+                                       const struct sockaddr_storage *addr, socklen_t addr_len) {
+	struct callback_newcon_t *i;
+	list_for_each_entry(i, &bus->callback_newcon, list) {
+		i->f(bus, conn, (struct sockaddr*)addr, addr_len);
+	}
+}
+
+static inline void callback_error_run(const struct TcpBus_bus *bus,
+                                      struct TcpBus_connection *conn,
+                                      const struct sockaddr_storage *addr, socklen_t addr_len,
+                                      int err) {
+	struct callback_error_t *i;
+	list_for_each_entry(i, &bus->callback_error, list) {
+		i->f(bus, conn, (struct sockaddr*)addr, addr_len, err);
+	}
+}
+
+static inline void callback_disconnect_run(const struct TcpBus_bus *bus,
+                                           struct TcpBus_connection *conn,
+                                           const struct sockaddr_storage *addr, socklen_t addr_len) {
+	struct callback_disconnect_t *i;
+	list_for_each_entry(i, &bus->callback_disconnect, list) {
+		i->f(bus, conn, (struct sockaddr*)addr, addr_len);
+	}
+}
+
+
+/* workers.c */
+
+INTERNAL void workers_init(struct TcpBus_bus *bus);
+INTERNAL void workers_terminate(struct TcpBus_bus *bus);
+
+/* Queue a callback event for the workers
+ */
+INTERNAL void worker_rx(const struct TcpBus_bus *bus, struct TcpBus_connection *conn,
+                        const char *data, size_t len);
+INTERNAL void worker_newcon(const struct TcpBus_bus *bus, struct TcpBus_connection *conn,
+                            const struct sockaddr_storage *addr, socklen_t addr_len);
+INTERNAL void worker_error(const struct TcpBus_bus *bus, struct TcpBus_connection *conn,
+                           const struct sockaddr_storage *addr, socklen_t addr_len,
+                           int err);
+INTERNAL void worker_disconnect(const struct TcpBus_bus *bus, struct TcpBus_connection *conn,
+                                const struct sockaddr_storage *addr, socklen_t addr_len);
+
+/* batch.c */
+
+INTERNAL void batch_init(struct TcpBus_bus *bus);
+INTERNAL void batch_terminate(struct TcpBus_bus *bus);
+
+/* Add received data to the batch of this iteration of the loop
+ */
+INTERNAL void batch_rx(struct TcpBus_bus *bus, struct TcpBus_connection *conn,
+                       const char *data, size_t len);
+
+/* Call the callbacks, on the workers if they are enabled
+ * Batched rx callbacks always run on the loop thread.
+ */
+static inline void callback_rx_call(const struct TcpBus_bus *bus,
+                                    struct TcpBus_connection *conn,
+                                    const char *buf, size_t rx_len) {
+	// The bus is const to the caller, but collects the batch
+	if( !list_empty(&bus->callback_rx_batch) ) batch_rx((struct TcpBus_bus*)bus, conn, buf, rx_len);
+	if( bus->workers ) worker_rx(bus, conn, buf, rx_len);
+	else callback_rx_run(bus, conn, buf, rx_len);
+}
+
+static inline void callback_newcon_call(const struct TcpBus_bus *bus,
+                                        struct TcpBus_connection *conn,
+                                        const struct sockaddr_storage *addr, socklen_t addr_len) {
+	if( bus->workers ) worker_newcon(bus, conn, addr, addr_len);
+	else callback_newcon_run(bus, conn, addr, addr_len);
+}
+
+static inline void callback_error_call(const struct TcpBus_bus *bus,
+                                       struct TcpBus_connection *conn,
+                                       const struct sockaddr_storage *addr, socklen_t addr_len,
+                                       int err) {
+	if( bus->workers ) worker_error(bus, conn, addr, addr_len, err);
+	else callback_error_run(bus, conn, addr, addr_len, err);
+}
+
+static inline void callback_disconnect_call(const struct TcpBus_bus *bus,
+                                            struct TcpBus_connection *conn,
+                                            const struct sockaddr_storage *addr, socklen_t addr_len) {
+	if( bus->workers ) worker_disconnect(bus, conn, addr, addr_len);
+	else callback_disconnect_run(bus, conn, addr, addr_len);
+}
+
+
+/* libtcpbus.c */
+
+#define CONNECTION_TX_MAX (1024*1024) // Connections that lag more are dropped, by default
+#define CONNECTION_RX_MAX 4096 // Bytes read per wakeup, at most
+
+/* Tx backlog at which a connection is dropped, see profile.c
+ * Fan-out writers read it too.
+ */
+static inline size_t connection_tx_max(const struct TcpBus_bus *bus) {
+	return __atomic_load_n(&bus->tx_max, __ATOMIC_RELAXED);
+}
+
+/* Set up a connection on an accepted socket, which is made non-blocking
+ * Returns NULL (with errno set) on failure, in which case the socket is left
+ * open
+ */
+INTERNAL struct TcpBus_connection *connection_new(struct TcpBus_bus *bus, int socket,
+                                                  const struct sockaddr_storage *addr,
+                                                  socklen_t addr_len);
+
+/* Stop accepting connections, or undo one such stop (@pause 0)
+ * Pauses add up: e_listen only runs again once all of them are undone, so
+ * load shedding and a handover don't resume each other's pauses.
+ */
+INTERNAL void accept_pause(struct TcpBus_bus *bus, int pause);
+
+/* Close and free() a connection
+ * If the connection is held, free()ing is postponed until it is released.
+ */
+INTERNAL void kill_connection(struct TcpBus_connection *c);
+
+/* Keep a connection from being free()d while callbacks may use it
+ * After connection_release(), it may be gone. These may be called from any
+ * thread.
+ */
+static inline void connection_hold(struct TcpBus_connection *c) {
+	__atomic_add_fetch(&c->refcnt, 1, __ATOMIC_RELAXED);
+}
+static inline void connection_release(struct TcpBus_connection *c) {
+	if( __atomic_sub_fetch(&c->refcnt, 1, __ATOMIC_ACQ_REL) == 0 ) free(c);
+}
+
+/* Report the end of a connection through the callbacks, and kill it
+ * @err is the errno that caused it, or 0 for a normal disconnect
+ */
+INTERNAL void connection_drop(struct TcpBus_connection *c, int err);
+
+/* Send data over a connection, queueing what the kernel does not accept
+ * @priority is the lane for what has to be queued, see lanes.c
+ * Returns -1 (with errno set) if the connection should be dropped
+ */
+INTERNAL int connection_send_lane(struct TcpBus_connection *c, const char *data, size_t len,
+                                  unsigned int priority);
+static inline int connection_send(struct TcpBus_connection *c, const char *data, size_t len) {
+	return connection_send_lane(c, data, len, TcpBus_PRIORITY_NORMAL);
+}
+
+/* Send the Tx buffer of a connection when its socket is writable
+ */
+INTERNAL void connection_ready_to_write(EV_P_ ev_io *w, int revents);
+
+#define GROUPS_ALL (~(uint64_t)0)
+
+/* Send data to all local connections in @groups (a bitset), except @skip
+ * (which may be NULL), at @priority
+ */
+INTERNAL void send_data(const struct TcpBus_bus *bus,
+                        const char *data, size_t len,
+                        const struct TcpBus_connection *skip, uint64_t groups,
+                        unsigned int priority);
+
+/* link.c */
+
+INTERNAL void link_init(struct TcpBus_bus *bus);
+INTERNAL void link_terminate(struct TcpBus_bus *bus);
+
+/* Send data that entered the bus here to all linked buses
+ */
+INTERNAL void link_publish(struct TcpBus_bus *bus, const char *data, size_t len);
+
+/* handover.c */
+
+INTERNAL void handover_init(struct TcpBus_bus *bus);
+INTERNAL void handover_terminate(struct TcpBus_bus *bus);
+
+/* idle.c */
+
+INTERNAL void idle_init(struct TcpBus_bus *bus);
+INTERNAL void idle_terminate(struct TcpBus_bus *bus);
+
+/* Put a new connection on the wheel, if idle detection is enabled
+ */
+INTERNAL void idle_add(struct TcpBus_connection *c);
+
+/* Record activity on a connection, O(1)
+ */
+static inline void idle_refresh(struct TcpBus_connection *c) {
+	c->idle_last_rx = c->bus->idle_now;
+}
+
+/* async.c */
+
+INTERNAL void async_init(struct TcpBus_bus *bus);
+INTERNAL void async_terminate(struct TcpBus_bus *bus);
+
+/* history.c */
+
+INTERNAL void history_init(struct TcpBus_bus *bus);
+INTERNAL void history_terminate(struct TcpBus_bus *bus);
+
+/* Remember data that is sent on the bus
+ */
+INTERNAL void history_record(struct TcpBus_bus *bus, const char *data, size_t len);
+
+/* Send the remembered data to a new connection
+ * Returns -1 (with errno set) if the connection should be dropped
+ */
+INTERNAL int history_replay(struct TcpBus_connection *c);
+
+/* compress.c */
+
+struct chunk;
+
+INTERNAL void compress_init(struct TcpBus_bus *bus);
+INTERNAL void compress_terminate(struct TcpBus_bus *bus);
+
+/* Compress data for the compressed connections that will get it
+ * @out is set to the compressed data, or NULL if there are no compressed
+ * connections. Returns -1 on failure, in which case the compressed
+ * connections have been dropped.
+ */
+INTERNAL int compress_data(struct TcpBus_bus *bus, const char *data, size_t len,
+                           const struct TcpBus_connection *skip, uint64_t groups,
+                           struct chunk **out);
+
+/* Send data to a single compressed connection, like connection_send()
+ */
+INTERNAL int compress_send_to(struct TcpBus_connection *c, const char *data, size_t len);
+
+/* End the current deflate block with a full flush, so compressed connections
+ * that missed something, or are new, can continue from here; after it, any
+ * new deflate stream is a valid continuation
+ */
+INTERNAL int compress_resync(struct TcpBus_bus *bus);
+
+/* Send an empty deflate block to a compressed connection
+ * Unlike compress_send_to(), this never affects other connections.
+ */
+INTERNAL int compress_keepalive(struct TcpBus_connection *c);
+
+/* arena.c */
+
+INTERNAL void arena_init(struct TcpBus_bus *bus);
+INTERNAL void arena_terminate(struct TcpBus_bus *bus);
+
+/* Get a slab for @size bytes, from any thread
+ * Returns NULL if @arena is NULL, @size does not fit in a slab, or all slabs
+ * are in use; the caller falls back to malloc() then.
+ */
+INTERNAL void *arena_alloc(struct arena *arena, size_t size);
+
+/* Give back a slab from arena_alloc(), from any thread
+ */
+INTERNAL void arena_free(struct arena *arena, void *p);
+
+/* sockmap.c */
+
+INTERNAL void sockmap_init(struct TcpBus_bus *bus);
+INTERNAL void sockmap_terminate(struct TcpBus_bus *bus);
+
+/* Stop forwarding in the kernel, until the loop runs again
+ */
+INTERNAL void sockmap_release(struct TcpBus_bus *bus);
+
+/* tap.c */
+
+INTERNAL void tap_init(struct TcpBus_bus *bus);
+INTERNAL void tap_terminate(struct TcpBus_bus *bus);
+
+/* Offer data that is sent on the bus to the taps
+ * @origin is the connection it came from, or NULL
+ */
+INTERNAL void tap_record(struct TcpBus_bus *bus, const char *data, size_t len,
+                         const struct TcpBus_connection *origin);
+
+/* lag.c */
+
+INTERNAL void lag_init(struct TcpBus_bus *bus);
+INTERNAL void lag_terminate(struct TcpBus_bus *bus);
+
+/* Stop the monitor, and give up its accept_pause(), keeping the thresholds
+ * Returns whether it was running.
+ */
+INTERNAL int lag_stop(struct TcpBus_bus *bus);
+
+/* tcpinfo.c */
+
+INTERNAL void tcpinfo_init(struct TcpBus_bus *bus);
+INTERNAL void tcpinfo_terminate(struct TcpBus_bus *bus);
+
+/* Add a new connection to the ones that are sampled, or remove it
+ */
+INTERNAL void tcpinfo_add(struct TcpBus_connection *c);
+INTERNAL void tcpinfo_remove(struct TcpBus_connection *c);
+
+/* Sample a connection now, if sampling is enabled, without evicting it
+ */
+INTERNAL void tcpinfo_refresh(struct TcpBus_connection *c);
+
+/* busypoll.c */
+
+INTERNAL void busy_poll_init(struct TcpBus_bus *bus);
+INTERNAL void busy_poll_terminate(struct TcpBus_bus *bus);
+
+/* Record activity, and keep polling for a while
+ */
+INTERNAL void busy_poll_kick(struct TcpBus_bus *bus);
+
+/* Set the busy poll socket options on a new socket, if enabled
+ */
+INTERNAL void busy_poll_socket(struct TcpBus_bus *bus, int socket);
+
+/* conflate.c */
+
+INTERNAL void conflate_init(struct TcpBus_bus *bus);
+
+/* Set up, or throw away, the queue of a connection
+ */
+INTERNAL void conflate_connection_init(struct TcpBus_connection *c);
+INTERNAL void conflate_connection_free(struct TcpBus_connection *c);
+
+/* Whether data for a connection should go through conflate_queue(), rather
+ * than into its Tx buffer
+ * @compressed is whether the data is part of the compressed stream, which
+ * can't be conflated, but has to stay in order with what is queued.
+ */
+static inline int conflate_wanted(const struct TcpBus_connection *c, int compressed) {
+	return !list_empty(&c->conflate_queue)
+	    || ( !compressed && c->bus->conflate_key != NULL
+	      && c->tx.len >= c->bus->conflate_threshold );
+}
+
+/* Queue a message, replacing the queued one with the same key, if @keyed
+ * Returns -1 (with errno set) if the connection should be dropped
+ */
+INTERNAL int conflate_queue(struct TcpBus_connection *c, const char *data, size_t len,
+                            int keyed);
+
+/* Move queued messages into the Tx buffer, until it holds @threshold bytes
+ * Returns -1 (with errno set) if the connection should be dropped
+ */
+INTERNAL int conflate_refill(struct TcpBus_connection *c, size_t threshold);
+
+/* profile.c */
+
+INTERNAL void profile_init(struct TcpBus_bus *bus);
+
+/* Set the socket options of the profile on a new socket
+ */
+INTERNAL void profile_socket(struct TcpBus_bus *bus, int socket);
+
+/* lanes.c */
+
+INTERNAL void lanes_init(struct TcpBus_bus *bus);
+
+/* Set up, or throw away, the lanes of a connection
+ */
+INTERNAL void lanes_connection_init(struct TcpBus_connection *c);
+INTERNAL void lanes_connection_free(struct TcpBus_connection *c);
+
+/* Set the socket options for the lanes on a new socket, if enabled
+ */
+INTERNAL void lanes_socket(struct TcpBus_bus *bus, int socket);
+
+/* Queue data in a lane of a connection
+ * Returns -1 (with errno set) if the connection should be dropped
+ */
+INTERNAL int lane_queue(struct TcpBus_connection *c, const char *data, size_t len,
+                        unsigned int priority);
+
+/* Move queued data into the Tx buffer, most urgent first, until it holds
+ * @threshold bytes
+ * Returns -1 (with errno set) if the connection should be dropped
+ */
+INTERNAL int lane_refill(struct TcpBus_connection *c, size_t threshold);
+
+/* journal.c */
+
+INTERNAL void journal_init(struct TcpBus_bus *bus);
+INTERNAL void journal_terminate(struct TcpBus_bus *bus);
+
+/* Record data that is sent on the bus, coming from @origin (or NULL)
+ */
+INTERNAL void journal_record(struct TcpBus_bus *bus, const char *data, size_t len,
+                             const struct TcpBus_connection *origin);
+
+/* fanout.c */
+
+INTERNAL void fanout_init(struct TcpBus_bus *bus);
+INTERNAL void fanout_terminate(struct TcpBus_bus *bus);
+
+/* Hand the Tx side of a connection to a writer, or close it there
+ */
+INTERNAL void fanout_add(struct TcpBus_connection *c);
+INTERNAL void fanout_remove(struct TcpBus_connection *c);
+
+/* Have the writers send data, like send_data() and connection_send()
+ * Compressed connections get @zchunk instead, if not NULL. Writers report
+ * failures through c->tx_error, so these only fail when out of memory.
+ */
+INTERNAL void fanout_send(const struct TcpBus_bus *bus, const char *data, size_t len,
+                          struct chunk *zchunk,
+                          const struct TcpBus_connection *skip, uint64_t groups,
+                          unsigned int priority);
+INTERNAL int fanout_send_to(struct TcpBus_connection *c, const char *data, size_t len,
+                            unsigned int priority);
+
+/* Tell the writer about a change of c->compress, in line with the data
+ */
+INTERNAL void fanout_compress(struct TcpBus_connection *c, int enable);
+
+/* Stop the writers, and take their connections back to the loop thread
+ */
+INTERNAL void fanout_stop(struct TcpBus_bus *bus);
+
+#endif // __INTERNAL_H__
@@ -0,0 +1,345 @@
+/* Journal
+ *
+ * Everything sent on the bus can be recorded in a journal on disk. The loop
+ * thread only appends the record to a buffer in memory; a journal thread
+ * swaps that buffer for an empty one and writes it out, so records are
+ * written in batches, and the bus never waits for the disk.
+ *
+ * Segments are preallocated when they are opened, and truncated to what was
+ * actually used when they are closed. See journal.h for the format. Segment
+ * names hold the time the journal was started, and our pid, so several
+ * processes (or a process and its successor after a handover) can record in
+ * the same directory.
+ *
+ * The first segment is opened by TcpBus_journal() itself, so a directory we
+ * can't write to is reported right away. Errors of the journal thread wake the
+ * loop thread to report them through the callbacks.
+ *
+ * When the disk can't keep up, records are dropped, and counted. The start of
+ * every such gap is reported with ENOBUFS, so nobody relies on a journal with
+ * holes in it unknowingly.
+ */
+
+#include "internal.h"
+#include "journal.h"
+
+#include "../config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define JOURNAL_PENDING_MAX (64*1024*1024) // Records beyond this are dropped
+#define JOURNAL_NAME_TRIES 1000 // Segment names tried before giving up
+
+struct journal {
+	struct TcpBus_bus *bus;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	struct buffer pending; // Records waiting for the journal thread
+	int stop;
+	int error;             // errno that stopped the journal thread, or 0
+	int error_reported;
+	ev_async failed;       // Signalled by the journal thread when it stops
+	uint64_t dropped;      // Records, because the disk can't keep up
+	int overflowing;       // Dropped the last record
+
+	/* Only used by the journal thread */
+	char *directory;
+	size_t segment_size;
+	time_t started;
+	unsigned int seq;
+	int fd;                // Current segment, or -1
+	size_t offset;         // Bytes used in the current segment
+};
+
+
+/* Journal thread
+ *****************/
+
+static int write_all(int fd, const char *data, size_t len) {
+	while( len > 0 ) {
+		ssize_t rv = write(fd, data, len);
+		if( rv == -1 ) {
+			if( errno == EINTR ) continue;
+			return -1;
+		}
+		data += rv;
+		len -= rv;
+	}
+	return 0;
+}
+
+static int segment_close(struct journal *j) {
+	int rv = 0;
+
+	if( j->fd == -1 ) return 0;
+	// Give back what we preallocated too much
+	if( ftruncate(j->fd, j->offset) == -1 || fdatasync(j->fd) == -1 ) rv = -1;
+	if( close(j->fd) == -1 ) rv = -1;
+	j->fd = -1;
+	return rv;
+}
+
+static int segment_open(struct journal *j) {
+	char path[4096];
+	int rv, tries = 0;
+
+	if( segment_close(j) == -1 ) return -1;
+
+	do {
+		// Taken after all: TcpBus_journal() was called twice within a second
+		rv = snprintf(path, sizeof(path), "%s/%010lu-%d-%06u.journal",
+		              j->directory, (unsigned long)j->started, (int)getpid(), j->seq++);
+		if( rv < 0 || (size_t)rv >= sizeof(path) ) {
+			errno = ENAMETOOLONG;
+			return -1;
+		}
+		j->fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+	} while( j->fd == -1 && errno == EEXIST && ++tries < JOURNAL_NAME_TRIES );
+	if( j->fd == -1 ) return -1;
+
+	// Not all filesystems can preallocate; we can do without
+	posix_fallocate(j->fd, 0, j->segment_size);
+
+	if( write_all(j->fd, JOURNAL_MAGIC, JOURNAL_MAGIC_LEN) == -1 ) return -1;
+	j->offset = JOURNAL_MAGIC_LEN;
+	return 0;
+}
+
+/* Write a batch of records, in as few write()s as the segments allow
+ */
+static int journal_write(struct journal *j, const struct buffer *batch) {
+	const char *p = buffer_head(batch);
+	const char *end = p + batch->len;
+
+	while( p < end ) {
+		const char *run = p;
+		size_t run_len = 0;
+
+		if( j->fd == -1 && segment_open(j) == -1 ) return -1;
+
+		// Take as many records as fit in this segment
+		while( p < end ) {
+			const struct journal_record *r = (const struct journal_record*)p;
+			size_t rec_len = sizeof(*r) + r->len;
+			if( j->offset + run_len + rec_len > j->segment_size ) break;
+			run_len += rec_len;
+			p += rec_len;
+		}
+
+		if( run_len == 0 ) {
+			// Not even the first one fits
+			if( j->offset == JOURNAL_MAGIC_LEN ) {
+				errno = EFBIG; // Not in an empty segment either
+				return -1;
+			}
+			if( segment_open(j) == -1 ) return -1;
+			continue;
+		}
+
+		if( write_all(j->fd, run, run_len) == -1 ) return -1;
+		j->offset += run_len;
+	}
+	return 0;
+}
+
+static void *journal_main(void *arg) {
+	struct journal *j = arg;
+	struct buffer batch = BUFFER_INIT;
+
+	pthread_mutex_lock(&j->lock);
+	for(;;) {
+		struct buffer swap;
+
+		while( j->pending.len == 0 && !j->stop ) {
+			pthread_cond_wait(&j->wake, &j->lock);
+		}
+		if( j->pending.len == 0 ) break; // Stopped, and written everything
+
+		swap = batch;
+		batch = j->pending;
+		j->pending = swap;
+		pthread_mutex_unlock(&j->lock);
+
+		if( !j->error && journal_write(j, &batch) == -1 ) {
+			struct TcpBus_bus *bus = j->bus;
+			__atomic_store_n(&j->error, errno, __ATOMIC_RELAXED);
+			ev_async_send(PBUS_EV_A_ &j->failed);
+		}
+		buffer_consume(&batch, batch.len);
+
+		pthread_mutex_lock(&j->lock);
+		if( j->error ) buffer_consume(&j->pending, j->pending.len);
+	}
+	pthread_mutex_unlock(&j->lock);
+
+	if( segment_close(j) == -1 && !j->error ) {
+		__atomic_store_n(&j->error, errno, __ATOMIC_RELAXED); // See journal_stop()
+	}
+	buffer_free(&batch);
+	return NULL;
+}
+
+
+/* Loop thread
+ **************/
+
+static void journal_report(struct TcpBus_bus *bus, struct journal *j) {
+	if( j->error_reported ) return;
+	j->error_reported = 1;
+	callback_error_call(bus, NULL, NULL, 0, __atomic_load_n(&j->error, __ATOMIC_RELAXED));
+}
+
+static void journal_failed(EV_P_ ev_async *w, int revents) {
+	struct journal *j = w->data;
+	journal_report(j->bus, j);
+}
+
+void journal_record(struct TcpBus_bus *bus, const char *data, size_t len,
+                    const struct TcpBus_connection *origin) {
+	struct journal *j = bus->journal;
+	struct journal_record r;
+	char *p = NULL;
+
+	if( j == NULL ) return;
+	if( len == 0 ) return; // Nothing to replay, and it would end the segment
+
+	if( __atomic_load_n(&j->error, __ATOMIC_RELAXED) ) return; // Reported by journal_failed()
+
+	memset(&r, 0, sizeof(r));
+	r.len = len;
+	r.origin = origin ? origin->id : 0;
+	r.time = ev_now(PBUS_EV_A);
+
+	pthread_mutex_lock(&j->lock);
+	if( j->pending.len + sizeof(r) + len <= JOURNAL_PENDING_MAX
+	 && (p = buffer_reserve(&j->pending, sizeof(r) + len)) != NULL ) {
+		memcpy(p, &r, sizeof(r));
+		memcpy(p + sizeof(r), data, len);
+		buffer_commit(&j->pending, sizeof(r) + len);
+		if( j->pending.len == sizeof(r) + len ) pthread_cond_signal(&j->wake);
+	}
+	pthread_mutex_unlock(&j->lock);
+
+	if( p != NULL ) {
+		j->overflowing = 0;
+		return;
+	}
+	// The disk can't keep up; drop it, and tell once per gap
+	j->dropped++;
+	if( !j->overflowing ) {
+		j->overflowing = 1;
+		callback_error_call(bus, NULL, NULL, 0, ENOBUFS);
+	}
+}
+
+/* Stop the journal thread, after it wrote everything
+ */
+static void journal_stop(struct TcpBus_bus *bus) {
+	struct journal *j = bus->journal;
+
+	if( j == NULL ) return;
+
+	pthread_mutex_lock(&j->lock);
+	j->stop = 1;
+	pthread_cond_signal(&j->wake);
+	pthread_mutex_unlock(&j->lock);
+	pthread_join(j->thread, NULL);
+
+	ev_async_stop(PBUS_EV_A_ &j->failed);
+	if( j->error ) journal_report(bus, j); // Maybe in closing the last segment
+	pthread_cond_destroy(&j->wake);
+	pthread_mutex_destroy(&j->lock);
+	buffer_free(&j->pending);
+	free(j->directory);
+	free(j);
+	bus->journal = NULL;
+}
+
+void journal_init(struct TcpBus_bus *bus) {
+	bus->journal = NULL;
+}
+
+void journal_terminate(struct TcpBus_bus *bus) {
+	journal_stop(bus);
+}
+
+
+int TcpBus_journal(struct TcpBus_bus *bus, const char *directory, size_t segment_size) {
+	struct journal *j;
+	sigset_t all, old;
+	int err;
+
+	if( directory != NULL && segment_size <= JOURNAL_MAGIC_LEN + sizeof(struct journal_record) ) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	journal_stop(bus);
+	if( directory == NULL ) return 0;
+
+	j = malloc(sizeof(*j)); // free() is in journal_stop()
+	if( j == NULL ) return -1;
+	j->directory = strdup(directory); // free() is in journal_stop()
+	if( j->directory == NULL ) {
+		free(j);
+		return -1;
+	}
+	pthread_mutex_init(&j->lock, NULL);
+	pthread_cond_init(&j->wake, NULL);
+	buffer_init(&j->pending);
+	j->stop = j->error = j->error_reported = 0;
+	j->dropped = 0;
+	j->overflowing = 0;
+	j->segment_size = segment_size;
+	j->started = time(NULL);
+	j->seq = 0;
+	j->fd = -1;
+	j->offset = 0;
+
+	// Fail now, rather than on the first record
+	if( segment_open(j) == -1 ) {
+		err = errno;
+		if( j->fd != -1 ) close(j->fd);
+		goto fail;
+	}
+
+	j->bus = bus;
+	ev_async_init(&j->failed, journal_failed);
+	j->failed.data = j;
+	ev_async_start(PBUS_EV_A_ &j->failed);
+
+	// Signals are for the loop thread
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	err = pthread_create(&j->thread, NULL, journal_main, j);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if( err != 0 ) {
+		ev_async_stop(PBUS_EV_A_ &j->failed);
+		close(j->fd);
+		goto fail;
+	}
+
+	bus->journal = j;
+	return 0;
+
+fail:
+	pthread_cond_destroy(&j->wake);
+	pthread_mutex_destroy(&j->lock);
+	free(j->directory);
+	free(j);
+	errno = err;
+	return -1;
+}
+
+uint64_t TcpBus_journal_dropped(const struct TcpBus_bus *bus) {
+	return bus->journal ? bus->journal->dropped : 0;
+}
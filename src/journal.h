@@ -0,0 +1,27 @@
+#ifndef __JOURNAL_H__
+#define __JOURNAL_H__
+
+/* On-disk format of the journal, shared by the library and tcp-bus-replay
+ * Taps receive the same format, as a single segment.
+ *
+ * A journal is a series of segment files, named
+ * <start time>-<pid>-<sequence number>.journal, so the segments of a writer
+ * sort in the order they were written. Each segment starts with JOURNAL_MAGIC, followed
+ * by records: a struct journal_record and its data. A record with len 0, or
+ * the end of the file, ends the segment, so zero-length chunks are not
+ * journaled. Numbers are in host byte order.
+ */
+
+#include <stdint.h>
+
+#define JOURNAL_MAGIC "TcpBusJ1"
+#define JOURNAL_MAGIC_LEN 8
+
+struct journal_record {
+	uint32_t len;      // Of the data following this header
+	uint32_t reserved;
+	uint64_t origin;   // Connection the data came from, see TcpBus_connection_id()
+	double time;       // Unix time it was sent on the bus
+};
+
+#endif // __JOURNAL_H__
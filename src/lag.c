@@ -0,0 +1,196 @@
+/* Loop lag monitor and load shedding
+ *
+ * An ev_prepare watcher runs just before the loop blocks, and an ev_check
+ * watcher (at the highest priority) right after it wakes up. From check to
+ * prepare, the loop was busy handling events; from prepare to check, it was
+ * waiting for them.
+ *
+ * The lag is a moving average of the busy time per iteration. It decays while
+ * the loop waits, as an idle loop does not iterate to lower it otherwise. The
+ * grade of shedding follows from the lag in every prepare, and a timer keeps
+ * the loop waking up while shedding, so the lag can come down again even when
+ * the only thing that would wake it is a connection we stopped accepting.
+ */
+
+#include "internal.h"
+
+#include "../config.h"
+
+#include <errno.h>
+#include <string.h>
+
+#define LAG_WEIGHT 8          // Iterations in the moving average, about
+#define LAG_DECAY 0.01        // Seconds of waiting that halve the lag
+#define LAG_RECOVER 0.05      // Wakeups while shedding, in seconds
+#define LAG_EVICT_HOLDOFF 0.1 // Seconds between evictions, at least
+#define LAG_READ_BUDGET 1024  // Bytes read per wakeup, while shedding
+
+static unsigned int bucket(ev_tstamp t) {
+	uint64_t us = t * 1e6;
+	unsigned int b;
+
+	if( us == 0 ) return 0;
+	b = 64 - __builtin_clzll(us);
+	return b < TcpBus_LAG_BUCKETS ? b : TcpBus_LAG_BUCKETS - 1;
+}
+
+/* Drop the connection that has the most data waiting for it
+ */
+static void evict_slowest(struct TcpBus_bus *bus) {
+	struct TcpBus_connection *i, *slowest = NULL;
+	size_t most = 0;
+
+	list_for_each_entry(i, &bus->connections, list) {
+		// The Tx side may belong to a writer thread; a slightly stale view will do
+		size_t backlog = __atomic_load_n(&i->tx.len, __ATOMIC_RELAXED)
+		               + __atomic_load_n(&i->conflate_bytes, __ATOMIC_RELAXED)
+		               + __atomic_load_n(&i->lane_bytes, __ATOMIC_RELAXED);
+		if( backlog > most ) {
+			most = backlog;
+			slowest = i;
+		}
+	}
+	if( slowest == NULL ) return; // Nobody is behind; the lag is not theirs
+
+	bus->lag.evicted++;
+	connection_drop(slowest, ENOBUFS);
+}
+
+static void resume_accepting(struct TcpBus_bus *bus) {
+	if( !bus->lag_paused ) return;
+	accept_pause(bus, 0);
+	bus->lag_paused = 0;
+}
+
+static void shed(struct TcpBus_bus *bus, ev_tstamp now) {
+	ev_tstamp lag = bus->lag.lag;
+	int level = 0;
+
+	if( bus->lag_accept > 0 && lag > bus->lag_accept ) level = 1;
+	if( bus->lag_read > 0 && lag > bus->lag_read ) level = 2;
+	if( bus->lag_evict > 0 && lag > bus->lag_evict ) level = 3;
+
+	if( level >= 1 && bus->lag_accept > 0 ) {
+		if( !bus->lag_paused ) {
+			accept_pause(bus, 1);
+			bus->lag_paused = 1;
+			bus->lag.paused++;
+		}
+	} else {
+		resume_accepting(bus);
+	}
+
+	bus->read_budget = level >= 2 && bus->lag_read > 0 ? LAG_READ_BUDGET : CONNECTION_RX_MAX;
+
+	if( level >= 3 && now - bus->lag_last_evict >= LAG_EVICT_HOLDOFF ) {
+		bus->lag_last_evict = now;
+		evict_slowest(bus);
+	}
+
+	if( level > 0 && !ev_is_active(&bus->lag_recover) ) {
+		ev_timer_start(PBUS_EV_A_ &bus->lag_recover);
+	} else if( level == 0 && ev_is_active(&bus->lag_recover) ) {
+		ev_timer_stop(PBUS_EV_A_ &bus->lag_recover);
+	}
+	bus->lag.level = level;
+}
+
+static void lag_prepare(EV_P_ ev_prepare *w, int revents) {
+	struct TcpBus_bus *bus = w->data;
+	ev_tstamp now = ev_time();
+
+	if( bus->lag_checked > 0 ) {
+		ev_tstamp busy = now - bus->lag_checked;
+		bus->lag.iterations++;
+		bus->lag.busy += busy;
+		bus->lag.busy_hist[bucket(busy)]++;
+		bus->lag.iteration_hist[bucket(now - bus->lag_prepared)]++;
+		bus->lag.lag += ( busy - bus->lag.lag ) / LAG_WEIGHT;
+	}
+	bus->lag_prepared = now;
+
+	shed(bus, now);
+}
+
+static void lag_check(EV_P_ ev_check *w, int revents) {
+	struct TcpBus_bus *bus = w->data;
+	ev_tstamp now = ev_time();
+	ev_tstamp waited;
+
+	if( bus->lag_prepared == 0 ) return; // Started in between
+	waited = now - bus->lag_prepared;
+	bus->lag.waiting += waited;
+	bus->lag.lag -= bus->lag.lag * waited / ( waited + LAG_DECAY );
+	bus->lag_checked = now;
+}
+
+static void lag_recover(EV_P_ ev_timer *w, int revents) {
+	// Nothing to do: waking up is enough
+}
+
+static void lag_reset(struct TcpBus_bus *bus) {
+	bus->lag_prepared = bus->lag_checked = 0;
+	bus->lag_last_evict = 0;
+	bus->lag_paused = 0;
+	bus->read_budget = CONNECTION_RX_MAX;
+	memset(&bus->lag, 0, sizeof(bus->lag));
+}
+
+void lag_init(struct TcpBus_bus *bus) {
+	bus->lag_accept = bus->lag_read = bus->lag_evict = 0;
+	lag_reset(bus);
+
+	ev_prepare_init(&bus->lag_prepare, lag_prepare);
+	bus->lag_prepare.data = bus;
+	ev_check_init(&bus->lag_check, lag_check);
+	ev_set_priority(&bus->lag_check, EV_MAXPRI); // Before the events we measure
+	bus->lag_check.data = bus;
+	ev_timer_init(&bus->lag_recover, lag_recover, LAG_RECOVER, LAG_RECOVER);
+	bus->lag_recover.data = bus;
+}
+
+void lag_terminate(struct TcpBus_bus *bus) {
+	ev_prepare_stop(PBUS_EV_A_ &bus->lag_prepare);
+	ev_check_stop(PBUS_EV_A_ &bus->lag_check);
+	ev_timer_stop(PBUS_EV_A_ &bus->lag_recover);
+}
+
+int lag_stop(struct TcpBus_bus *bus) {
+	int running = ev_is_active(&bus->lag_prepare);
+
+	resume_accepting(bus);
+	lag_terminate(bus);
+	lag_reset(bus);
+	return running;
+}
+
+
+int TcpBus_lag_monitor(struct TcpBus_bus *bus, int enable) {
+	if( enable ) {
+		if( ev_is_active(&bus->lag_prepare) ) return 0;
+		lag_reset(bus);
+		ev_prepare_start(PBUS_EV_A_ &bus->lag_prepare);
+		ev_check_start(PBUS_EV_A_ &bus->lag_check);
+		return 0;
+	}
+
+	lag_stop(bus);
+	bus->lag_accept = bus->lag_read = bus->lag_evict = 0;
+	return 0;
+}
+
+int TcpBus_set_lag_shedding(struct TcpBus_bus *bus,
+                            ev_tstamp accept, ev_tstamp read, ev_tstamp evict) {
+	if( accept < 0 || read < 0 || evict < 0 ) {
+		errno = EINVAL;
+		return -1;
+	}
+	bus->lag_accept = accept;
+	bus->lag_read = read;
+	bus->lag_evict = evict;
+	return TcpBus_lag_monitor(bus, 1);
+}
+
+void TcpBus_get_lag_stats(const struct TcpBus_bus *bus, struct TcpBus_lag_stats *stats) {
+	*stats = bus->lag;
+}
@@ -0,0 +1,154 @@
+/* Priority lanes
+ *
+ * Without lanes, whatever a connection can't take right away queues up in its
+ * Tx buffer, in order, so a small control message waits behind all the bulk
+ * data queued before it. With lanes, data only goes into the Tx buffer while
+ * it holds less than a slice; the rest of the backlog waits in a queue per
+ * priority. Whenever the Tx buffer drains below the slice, it is refilled
+ * from the most urgent lane that has something. Bulk data is cut into pieces
+ * as it is moved, so anything more urgent waits for at most one slice.
+ *
+ * The send buffer of the kernel is a queue we can't reorder either, so
+ * connections get TCP_NOTSENT_LOWAT of one slice: their socket only takes
+ * more while less than that is waiting to be sent.
+ *
+ * Compressed connections receive a single deflate stream, which can't be
+ * reordered; all their data goes into the normal lane. Like conflation, the
+ * lanes belong to whoever owns the Tx side of the connection.
+ */
+
+#include "internal.h"
+
+#include "../config.h"
+
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+struct lane_entry {
+	struct list_head list; // In c->lanes[priority]
+	size_t off;            // Bytes already moved into tx
+	size_t len;
+	char data[];
+};
+
+int lane_queue(struct TcpBus_connection *c, const char *data, size_t len,
+               unsigned int priority) {
+	struct lane_entry *e;
+
+	if( c->tx.len + c->lane_bytes + len > connection_tx_max(c->bus) ) {
+		errno = ENOBUFS;
+		return -1;
+	}
+
+	e = malloc(sizeof(*e) + len); // free() is in lane_refill() and lanes_connection_free()
+	if( e == NULL ) {
+		errno = ENOMEM;
+		return -1;
+	}
+	e->off = 0;
+	e->len = len;
+	memcpy(e->data, data, len);
+	list_add_tail(&e->list, &c->lanes[priority]);
+	c->lane_bytes += len;
+	return 0;
+}
+
+int lane_refill(struct TcpBus_connection *c, size_t threshold) {
+	unsigned int p = 0;
+
+	while( c->lane_bytes > 0 && c->tx.len < threshold ) {
+		struct lane_entry *e;
+		size_t n;
+
+		while( list_empty(&c->lanes[p]) ) p++; // lane_bytes says one has data
+		e = list_entry(c->lanes[p].next, struct lane_entry, list);
+
+		n = e->len - e->off;
+		if( p == TcpBus_PRIORITY_BULK && n > threshold - c->tx.len ) {
+			n = threshold - c->tx.len;
+		}
+		if( buffer_append(&c->tx, e->data + e->off, n) == -1 ) {
+			errno = ENOMEM;
+			return -1;
+		}
+		e->off += n;
+		c->lane_bytes -= n;
+		if( e->off == e->len ) {
+			list_del(&e->list);
+			free(e);
+		}
+	}
+	return 0;
+}
+
+void lanes_socket(struct TcpBus_bus *bus, int socket) {
+	// Without lanes, back to what the profile says; 0 is the system default
+	int lowat = bus->lane_slice ? bus->lane_slice : bus->profile.notsent_lowat;
+
+	setsockopt(socket, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof(lowat));
+}
+
+void lanes_init(struct TcpBus_bus *bus) {
+	bus->lane_slice = 0;
+}
+
+void lanes_connection_init(struct TcpBus_connection *c) {
+	int p;
+
+	c->priority = TcpBus_PRIORITY_NORMAL;
+	for( p = 0; p < TcpBus_PRIORITIES; p++ ) INIT_LIST_HEAD(&c->lanes[p]);
+	c->lane_bytes = 0;
+}
+
+void lanes_connection_free(struct TcpBus_connection *c) {
+	int p;
+
+	for( p = 0; p < TcpBus_PRIORITIES; p++ ) {
+		while( !list_empty(&c->lanes[p]) ) {
+			struct lane_entry *e = list_entry(c->lanes[p].next, struct lane_entry, list);
+			list_del(&e->list);
+			free(e);
+		}
+	}
+	c->lane_bytes = 0;
+}
+
+
+int TcpBus_priority_lanes(struct TcpBus_bus *bus, size_t slice) {
+	struct TcpBus_connection *c, *tmp;
+
+	if( slice >= connection_tx_max(bus) ) {
+		errno = EINVAL;
+		return -1;
+	}
+	if( bus->writers || ( slice > 0 && bus->conflate_key != NULL ) ) {
+		errno = EBUSY; // Writers read this without locking; conflation has its own queue
+		return -1;
+	}
+	bus->lane_slice = slice;
+
+	list_for_each_entry_safe(c, tmp, &bus->connections, list) {
+		lanes_socket(bus, c->socket);
+		// Whatever is queued goes out in order of priority still
+		if( slice == 0 && lane_refill(c, (size_t)-1) == -1 ) connection_drop(c, errno);
+	}
+	return 0;
+}
+
+int TcpBus_connection_set_priority(struct TcpBus_connection *conn,
+                                   enum TcpBus_priority priority) {
+	if( (unsigned int)priority >= TcpBus_PRIORITIES ) {
+		errno = EINVAL;
+		return -1;
+	}
+	conn->priority = priority;
+	return 0;
+}
+
+enum TcpBus_priority TcpBus_connection_get_priority(const struct TcpBus_connection *conn) {
+	return conn->priority;
+}
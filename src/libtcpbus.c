@@ -1,8 +1,8 @@
-#include "../include/libtcpbus.h"
+#include "internal.h"
+#include "chunk.h"
 
 #include "../config.h"
 
-#include "list.h"
 #include <errno.h>
 #include <string.h>
 #include <fcntl.h>
@@ -11,45 +11,6 @@
 #include <signal.h>
 #include <unistd.h>
 
-struct connection {
-	struct TcpBus_bus *bus;
-	struct list_head list;
-	int socket;
-	struct sockaddr_storage addr;
-	socklen_t addr_len;
-	ev_io read_ready;
-};
-
-
-#define callback_list(type) \
-	struct callback_ ## type ## _t { \
-		struct list_head list; \
-		TcpBus_callback_ ## type ## _t f; \
-	};
-callback_list(rx);
-callback_list(newcon);
-callback_list(error);
-callback_list(disconnect);
-
-
-struct TcpBus_bus {
-	ev_io e_listen;
-	EV_P;
-	struct list_head connections;
-	struct list_head callback_rx;
-	struct list_head callback_newcon;
-	struct list_head callback_error;
-	struct list_head callback_disconnect;
-};
-#ifdef EV_MULTIPLICITY
-#define PBUS_EV_A bus->loop
-#define PBUS_EV_A_ PBUS_EV_A ,
-#else
-#define PBUS_EV_A
-#define PBUS_EV_A_
-#endif
-
-
 #define callback_add_remove(type) \
 	int TcpBus_callback_ ## type ## _add(struct TcpBus_bus *bus, \
 	                                     TcpBus_callback_ ## type ## _t f) { \
@@ -80,131 +41,250 @@ callback_add_remove(newcon)
 callback_add_remove(error)
 callback_add_remove(disconnect)
 
-static inline void callback_rx_call(const struct TcpBus_bus *bus,
-                                    const char *buf, size_t rx_len) {
-	struct callback_rx_t *i;
-	list_for_each_entry(i, &bus->callback_rx, list) {
-		i->f(bus, buf, rx_len);
+void kill_connection(struct TcpBus_connection *c) {
+	struct TcpBus_bus *bus = c->bus;
+	if( c->dead ) return;
+	c->dead = 1;
+	ev_io_stop(PBUS_EV_A_ &c->read_ready);
+	list_del(&c->idle_wheel);
+	tcpinfo_remove(c);
+	list_del(&c->list);
+	list_del(&c->group_list);
+	list_del(&c->compress_list);
+	if( c->writer ) {
+		fanout_remove(c); // The writer closes the socket when it's done with it
+	} else {
+		ev_io_stop(PBUS_EV_A_ &c->write_ready);
+		close(c->socket);
+		buffer_free(&c->tx);
+		conflate_connection_free(c);
+		lanes_connection_free(c);
 	}
+	connection_release(c); // The reference of the bus
 }
 
-static inline void callback_newcon_call(const struct TcpBus_bus *bus,
-                                        const struct sockaddr_storage *addr, socklen_t addr_len) {
-	struct callback_newcon_t *i;
-	list_for_each_entry(i, &bus->callback_newcon, list) {
-		i->f(bus, (struct sockaddr*)addr, addr_len);
+void accept_pause(struct TcpBus_bus *bus, int pause) {
+	if( pause ) {
+		if( bus->accept_pauses++ == 0 ) ev_io_stop(PBUS_EV_A_ &bus->e_listen);
+	} else if( --bus->accept_pauses == 0 ) {
+		ev_io_start(PBUS_EV_A_ &bus->e_listen);
 	}
 }
 
-static inline void callback_error_call(const struct TcpBus_bus *bus,
-                                       const struct sockaddr_storage *addr, socklen_t addr_len,
-                                       int err) {
-	struct callback_error_t *i;
-	list_for_each_entry(i, &bus->callback_error, list) {
-		i->f(bus, (struct sockaddr*)addr, addr_len, err);
+void connection_drop(struct TcpBus_connection *c, int err) {
+	if( c->dead ) return; // Already reported
+	connection_hold(c);
+	if( err != 0 ) {
+		tcpinfo_refresh(c); // So the callbacks see the state it failed in
+		callback_error_call(c->bus, c, &c->addr, c->addr_len, err);
+	} else {
+		callback_disconnect_call(c->bus, c, &c->addr, c->addr_len);
 	}
+	kill_connection(c);
+	connection_release(c);
 }
 
-static inline void callback_disconnect_call(const struct TcpBus_bus *bus,
-                                            const struct sockaddr_storage *addr, socklen_t addr_len) {
-	struct callback_disconnect_t *i;
-	list_for_each_entry(i, &bus->callback_disconnect, list) {
-		i->f(bus, (struct sockaddr*)addr, addr_len);
+
+int connection_send_lane(struct TcpBus_connection *c, const char *data, size_t len,
+                         unsigned int priority) {
+	struct TcpBus_bus *bus = c->bus;
+	ssize_t rv = 0;
+
+	if( c->writer ) return fanout_send_to(c, data, len, priority);
+	if( conflate_wanted(c, c->compress) ) return conflate_queue(c, data, len, !c->compress);
+
+	if( c->tx.len == 0 ) {
+		rv = send(c->socket, data, len, 0);
+		if( rv == -1 ) {
+			if( errno != EAGAIN && errno != EWOULDBLOCK ) return -1;
+			rv = 0;
+		}
+		if( (size_t)rv == len ) return 0;
 	}
-}
 
+	// Queue whatever the kernel did not take; beyond a slice, in its lane
+	if( bus->lane_slice > 0 && c->tx.len + len - rv > bus->lane_slice ) {
+		if( c->compress ) priority = TcpBus_PRIORITY_NORMAL; // One stream, in order
+		if( lane_queue(c, data + rv, len - rv, priority) == -1
+		 || lane_refill(c, bus->lane_slice) == -1 ) {
+			return -1;
+		}
+	} else if( c->tx.len + len - rv > connection_tx_max(bus) ) {
+		errno = ENOBUFS;
+		return -1;
+	} else if( buffer_append(&c->tx, data + rv, len - rv) == -1 ) {
+		errno = ENOMEM;
+		return -1;
+	}
+	if( !ev_is_active(&c->write_ready) ) {
+		ev_io_start(PBUS_EV_A_ &c->write_ready);
+	}
+	return 0;
+}
 
+void connection_ready_to_write(EV_P_ ev_io *w, int revents) {
+	struct TcpBus_connection *con = w->data;
+	ssize_t rv;
 
-static void kill_connection(struct connection *c) {
-	struct TcpBus_bus *bus = c->bus;
-	ev_io_stop(PBUS_EV_A_ &c->read_ready);
-	close(c->socket);
-	list_del(&c->list);
-	free(c);
+	rv = send(con->socket, buffer_head(&con->tx), con->tx.len, 0);
+	if( rv == -1 ) {
+		if( errno == EAGAIN || errno == EWOULDBLOCK ) return;
+		connection_drop(con, errno);
+		return;
+	}
+	buffer_consume(&con->tx, rv);
+	if( conflate_refill(con, con->bus->conflate_threshold) == -1
+	 || lane_refill(con, con->bus->lane_slice) == -1 ) {
+		connection_drop(con, errno);
+		return;
+	}
+	if( con->tx.len == 0 ) ev_io_stop(EV_A_ w);
 }
 
+void send_data(const struct TcpBus_bus *bus,
+               const char *data, size_t len,
+               const struct TcpBus_connection *skip, uint64_t groups,
+               unsigned int priority) {
+	struct TcpBus_connection *i, *tmp;
+	struct chunk *zchunk;
 
-static void send_data(const struct TcpBus_bus *bus,
-                      const char *data, size_t len, struct connection *skip) {
-	struct connection *i, *tmp;
-	list_for_each_entry_safe(i, tmp, &bus->connections, list) {
-		int rv;
+	// The bus is const to the caller, but remembers what went over it
+	history_record((struct TcpBus_bus*)bus, data, len);
+	journal_record((struct TcpBus_bus*)bus, data, len, skip);
+	tap_record((struct TcpBus_bus*)bus, data, len, skip);
 
-		if( i == skip ) continue; // Don't loop to self
+	// Compressed once, for all compressed connections
+	compress_data((struct TcpBus_bus*)bus, data, len, skip, groups, &zchunk);
 
-		rv = send(i->socket, data, len, 0);
-		if( rv == -1 ) {
-			callback_error_call(bus, &i->addr, i->addr_len, errno);
-			kill_connection(i); // Removes from list
+	if( bus->writers ) {
+		fanout_send(bus, data, len, zchunk, skip, groups, priority);
+		if( zchunk ) chunk_put(zchunk);
+		return;
+	}
+
+	// Only visit the groups that are routed to, one set bit at a time
+	while( groups != 0 ) {
+		unsigned int g = __builtin_ctzll(groups);
+		groups &= groups - 1;
+
+		list_for_each_entry_safe(i, tmp, &bus->groups[g], group_list) {
+			int rv;
+
+			if( i == skip ) continue; // Don't loop to self
+
+			if( i->compress ) {
+				rv = connection_send(i, zchunk->data, zchunk->len);
+			} else {
+				rv = connection_send_lane(i, data, len, priority);
+			}
+			if( rv == -1 ) {
+				connection_drop(i, errno); // Removes from list
+			}
 		}
 	}
+	if( zchunk ) chunk_put(zchunk);
 }
 
 static void ready_to_read(EV_P_ ev_io *w, int revents) {
-	struct connection *con = w->data;
+	struct TcpBus_connection *con = w->data;
 	struct TcpBus_bus *bus = con->bus;
-	char buf[4096];
+	char buf[CONNECTION_RX_MAX];
 	ssize_t rx_len;
 
-	rx_len = recv(con->socket, buf, sizeof(buf), 0);
+	rx_len = recv(con->socket, buf, bus->read_budget, 0);
 	if( rx_len == -1 ) {
-		callback_error_call(bus, &con->addr, con->addr_len, errno);
-		kill_connection(con);
+		connection_drop(con, errno);
 		return;
 	}
-	if( rx_len == 0 ) { // EOF
-		callback_disconnect_call(bus, &con->addr, con->addr_len);
-		kill_connection(con);
+	if( rx_len == 0 ) { // EOF, or our writer shut the socket down
+		connection_drop(con, __atomic_load_n(&con->tx_error, __ATOMIC_RELAXED));
 		return;
 	}
-
-	send_data(bus, buf, rx_len, con);
-	callback_rx_call(bus, buf, rx_len);
+	idle_refresh(con);
+	busy_poll_kick(bus);
+
+	connection_hold(con);
+	send_data(bus, buf, rx_len, con, bus->routes[con->group], con->priority);
+	link_publish(bus, buf, rx_len);
+	callback_rx_call(bus, con, buf, rx_len);
+	connection_release(con);
 }
 
-static void incomming_connection(EV_P_ ev_io *w, int revents) {
-	struct TcpBus_bus *bus = w->data;
-	struct connection *con;
+struct TcpBus_connection *connection_new(struct TcpBus_bus *bus, int socket,
+                                         const struct sockaddr_storage *addr, socklen_t addr_len) {
+	struct TcpBus_connection *con;
 	int flags, rv;
 
-	con = malloc(sizeof(struct connection)); // free() is in kill_connection()
-	if( con == NULL ) {
-		callback_error_call(bus, NULL, 0, ENOMEM);
-		return;
-	}
+	flags = fcntl(socket, F_GETFL);
+	if( flags == -1 ) return NULL;
+	rv = fcntl(socket, F_SETFL, flags | O_NONBLOCK);
+	if( rv == -1 ) return NULL;
+
+	con = malloc(sizeof(struct TcpBus_connection)); // free() is in kill_connection()
+	if( con == NULL ) return NULL;
 	con->bus = bus;
+	con->id = ++bus->connection_id;
 	INIT_LIST_HEAD(&con->list);
-	con->addr_len = sizeof(con->addr);
-
-	con->socket = accept(w->fd, (struct sockaddr*)&con->addr, &con->addr_len);
-	if( con->socket == -1 ) {
-		callback_error_call(bus, NULL, 0, errno);
-		return;
-	}
-
-	callback_newcon_call(bus, &con->addr, con->addr_len);
-
-	flags = fcntl(con->socket, F_GETFL);
-	if( flags == -1 ) {
-		callback_error_call(bus, &con->addr, con->addr_len, errno);
-		goto cleanup;
-	}
-	rv = fcntl(con->socket, F_SETFL, flags | O_NONBLOCK);
-	if( rv == -1 ) {
-		callback_error_call(bus, &con->addr, con->addr_len, errno);
-		goto cleanup;
-	}
+	INIT_LIST_HEAD(&con->idle_wheel);
+	con->socket = socket;
+	memcpy(&con->addr, addr, addr_len);
+	con->addr_len = addr_len;
+	buffer_init(&con->tx);
+	con->user_data = NULL;
+	con->group = 0;
+	con->refcnt = 1;
+	con->dead = 0;
+	con->writer = NULL;
+	INIT_LIST_HEAD(&con->fanout_list);
+	con->tx_error = 0;
+	con->tx_compress = 0;
+	con->compress = 0;
+	INIT_LIST_HEAD(&con->compress_list);
+	conflate_connection_init(con);
+	lanes_connection_init(con);
 
 	ev_io_init( &con->read_ready, ready_to_read, con->socket, EV_READ);
 	con->read_ready.data = con; // Could be replaced with offset_of magic
 	ev_io_start(PBUS_EV_A_ &con->read_ready);
+	ev_io_init( &con->write_ready, connection_ready_to_write, con->socket, EV_WRITE);
+	con->write_ready.data = con;
+
+	profile_socket(bus, socket);
+	busy_poll_socket(bus, socket);
+	if( bus->lane_slice > 0 ) lanes_socket(bus, socket);
 
 	list_add(&con->list, &bus->connections);
-	return;
+	list_add(&con->group_list, &bus->groups[0]);
+	idle_add(con);
+	tcpinfo_add(con);
+	if( bus->writers ) fanout_add(con);
+	return con;
+}
+
+static void incomming_connection(EV_P_ ev_io *w, int revents) {
+	struct TcpBus_bus *bus = w->data;
+	struct sockaddr_storage addr;
+	socklen_t addr_len = sizeof(addr);
+	struct TcpBus_connection *con;
+	int socket;
+
+	socket = accept(w->fd, (struct sockaddr*)&addr, &addr_len);
+	if( socket == -1 ) {
+		callback_error_call(bus, NULL, NULL, 0, errno);
+		return;
+	}
 
-cleanup:
-	close(con->socket);
-	free(con);
+	con = connection_new(bus, socket, &addr, addr_len);
+	if( con == NULL ) {
+		callback_error_call(bus, NULL, &addr, addr_len, errno);
+		close(socket);
+		return;
+	}
+
+	connection_hold(con);
+	callback_newcon_call(bus, con, &addr, addr_len);
+	if( history_replay(con) == -1 ) connection_drop(con, errno);
+	connection_release(con);
 }
 
 struct TcpBus_bus *TcpBus_init(
@@ -214,22 +294,52 @@ struct TcpBus_bus *TcpBus_init(
 		int socket) {
 	struct TcpBus_bus *bus;
 	struct sigaction act;
+	int g;
 
 	bus = malloc(sizeof(*bus)); // free() is in TcpBus_terminate()
 	if( bus == NULL ) return NULL;
 
 	ev_io_init(&bus->e_listen, incomming_connection, socket, EV_READ);
 	bus->e_listen.data = bus; // Could be replaced with offset_of magic
+	bus->accept_pauses = 0;
 
 #ifdef EV_MULTIPLICITY
 	bus->loop = init_loop;
 #endif
 
 	INIT_LIST_HEAD(&bus->connections);
+	bus->connection_id = 0;
+	bus->user_data = NULL;
 	INIT_LIST_HEAD(&bus->callback_rx);
 	INIT_LIST_HEAD(&bus->callback_newcon);
 	INIT_LIST_HEAD(&bus->callback_error);
 	INIT_LIST_HEAD(&bus->callback_disconnect);
+	INIT_LIST_HEAD(&bus->callback_rx_batch);
+
+	for( g = 0; g < TcpBus_GROUPS; g++ ) {
+		bus->routes[g] = GROUPS_ALL; // Everybody hears everybody
+		INIT_LIST_HEAD(&bus->groups[g]);
+	}
+
+	link_init(bus);
+	handover_init(bus);
+	idle_init(bus);
+	async_init(bus);
+	workers_init(bus);
+	fanout_init(bus);
+	history_init(bus);
+	journal_init(bus);
+	compress_init(bus);
+	conflate_init(bus);
+	lanes_init(bus);
+	profile_init(bus);
+	busy_poll_init(bus);
+	arena_init(bus);
+	sockmap_init(bus);
+	tcpinfo_init(bus);
+	lag_init(bus);
+	tap_init(bus);
+	batch_init(bus);
 
 	ev_io_start(PBUS_EV_A_ &bus->e_listen);
 
@@ -237,13 +347,30 @@ struct TcpBus_bus *TcpBus_init(
 }
 
 void TcpBus_terminate(struct TcpBus_bus *bus) {
-	struct connection *i, *tmp;
+	struct TcpBus_connection *i, *tmp;
 
 	ev_io_stop(PBUS_EV_A_ &bus->e_listen);
 
 	list_for_each_entry_safe(i, tmp, &bus->connections, list) {
 		kill_connection(i);
 	}
+	fanout_terminate(bus);
+
+	async_terminate(bus);
+	link_terminate(bus);
+	handover_terminate(bus);
+	idle_terminate(bus);
+	history_terminate(bus);
+	journal_terminate(bus);
+	compress_terminate(bus);
+	sockmap_terminate(bus);
+	tcpinfo_terminate(bus);
+	lag_terminate(bus);
+	tap_terminate(bus);
+	batch_terminate(bus);
+	busy_poll_terminate(bus);
+	workers_terminate(bus); // Runs the callbacks that are still queued
+	arena_terminate(bus);   // After everything that holds chunks
 
 	free(bus);
 }
@@ -252,6 +379,101 @@ void TcpBus_terminate(struct TcpBus_bus *bus) {
 
 
 int TcpBus_send(const struct TcpBus_bus *bus, const char *data, size_t len) {
-	send_data(bus, data, len, NULL);
+	return TcpBus_send_priority(bus, data, len, TcpBus_PRIORITY_NORMAL);
+}
+
+int TcpBus_send_priority(const struct TcpBus_bus *bus, const char *data, size_t len,
+                         enum TcpBus_priority priority) {
+	if( (unsigned int)priority >= TcpBus_PRIORITIES ) {
+		errno = EINVAL;
+		return -1;
+	}
+	send_data(bus, data, len, NULL, GROUPS_ALL, priority);
+	// The bus is const to the caller, but originating data advances its
+	// link sequence number
+	link_publish((struct TcpBus_bus*)bus, data, len);
+	return 0;
+}
+
+int TcpBus_send_except(const struct TcpBus_bus *bus,
+                       const struct TcpBus_connection *except,
+                       const char *data, size_t len) {
+	send_data(bus, data, len, except, GROUPS_ALL, TcpBus_PRIORITY_NORMAL);
+	link_publish((struct TcpBus_bus*)bus, data, len);
+	return 0;
+}
+
+int TcpBus_send_to(struct TcpBus_connection *conn, const char *data, size_t len) {
+	if( conn->dead ) {
+		errno = EPIPE;
+		return -1;
+	}
+	if( ( conn->compress ? compress_send_to(conn, data, len)
+	                     : connection_send(conn, data, len) ) == -1 ) {
+		int err = errno;
+		connection_drop(conn, err);
+		errno = err;
+		return -1;
+	}
+	return 0;
+}
+
+
+void *TcpBus_get_data(const struct TcpBus_bus *bus) {
+	return bus->user_data;
+}
+
+void TcpBus_set_data(struct TcpBus_bus *bus, void *data) {
+	bus->user_data = data;
+}
+
+void *TcpBus_connection_get_data(const struct TcpBus_connection *conn) {
+	return conn->user_data;
+}
+
+void TcpBus_connection_set_data(struct TcpBus_connection *conn, void *data) {
+	conn->user_data = data;
+}
+
+uint64_t TcpBus_connection_id(const struct TcpBus_connection *conn) {
+	return conn->id;
+}
+
+const struct sockaddr *TcpBus_connection_addr(const struct TcpBus_connection *conn,
+                                              socklen_t *addr_len) {
+	if( addr_len != NULL ) *addr_len = conn->addr_len;
+	return (const struct sockaddr*)&conn->addr;
+}
+
+int TcpBus_connection_set_group(struct TcpBus_connection *conn, unsigned int group) {
+	if( group >= TcpBus_GROUPS ) {
+		errno = EINVAL;
+		return -1;
+	}
+	if( conn->dead ) {
+		errno = EPIPE;
+		return -1;
+	}
+	list_move(&conn->group_list, &conn->bus->groups[group]);
+	// Writers of the fan-out threads read this on their own
+	__atomic_store_n(&conn->group, group, __ATOMIC_RELAXED);
+	return 0;
+}
+
+unsigned int TcpBus_connection_get_group(const struct TcpBus_connection *conn) {
+	return conn->group;
+}
+
+
+int TcpBus_route(struct TcpBus_bus *bus, unsigned int from, unsigned int to, int enable) {
+	if( from >= TcpBus_GROUPS || to >= TcpBus_GROUPS ) {
+		errno = EINVAL;
+		return -1;
+	}
+	if( enable ) {
+		bus->routes[from] |= (uint64_t)1 << to;
+	} else {
+		bus->routes[from] &= ~((uint64_t)1 << to);
+	}
 	return 0;
 }
@@ -0,0 +1,572 @@
+/* Bus links
+ *
+ * Links carry framed data between buses, so a set of buses can be connected
+ * in an arbitrary mesh and behave as a single bus.
+ *
+ * Every frame carries the id of the bus where the data entered the mesh (its
+ * origin), a sequence number per origin and a hop count. Links are TCP, so
+ * every path through the mesh delivers the frames of an origin in order. A
+ * frame is therefore only accepted if its sequence number is newer than the
+ * last one seen from that origin; this drops both loops and the duplicates
+ * that arrive over a second path. The hop count is a safety net on top.
+ *
+ * The last sequence number per origin is kept in a chained hash table, and in
+ * a list ordered by when the origin was last heard from. Every restart and
+ * handover in the mesh brings a new origin, so origins that were not heard
+ * from for LINK_ORIGIN_EXPIRE are forgotten. That is long enough for any copy
+ * of their last frames still underway to arrive first: links lagging that far
+ * behind are dropped long before.
+ *
+ * Frames are queued per link and written when the socket becomes writable, so
+ * all traffic of one loop iteration goes out in a single large write.
+ */
+
+#include "internal.h"
+
+#include "../config.h"
+
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+
+#define LINK_FRAME_HELLO 1
+#define LINK_FRAME_DATA  2
+
+#define LINK_HDR_LEN     24
+#define LINK_MAX_FRAME   (1024*1024)
+#define LINK_MAX_HOPS    16
+#define LINK_TX_MAX      (16*1024*1024) // Links that lag more are dropped
+#define LINK_BACKOFF_MIN 0.1
+#define LINK_BACKOFF_MAX 30.
+#define LINK_ORIGIN_EXPIRE 600. // Seconds an origin is remembered after its last frame
+#define LINK_ORIGIN_BUCKETS_MIN 16
+
+static const char link_magic[8] = { 'T','c','p','B','u','s','L','1' };
+
+enum link_state {
+	LINK_IDLE,        // Not connected, waiting to reconnect
+	LINK_CONNECTING,  // Non-blocking connect() in progress
+	LINK_HANDSHAKE,   // Connected, waiting for the HELLO of the peer
+	LINK_UP,
+};
+
+struct link {
+	struct TcpBus_bus *bus;
+	struct list_head list;
+	int socket;
+	enum link_state state;
+	int dialer; // Did we connect()? Then we reconnect when lost
+	int in_read; // Set while frames are being handled, see link_lost()
+	struct sockaddr_storage addr;
+	socklen_t addr_len;
+	ev_io read_ready;
+	ev_io write_ready;
+	ev_timer reconnect;
+	ev_tstamp backoff;
+	struct buffer rx;
+	struct buffer tx;
+};
+
+/* Highest sequence number seen per origin bus
+ */
+struct origin {
+	struct list_head list;  // In bus->origins, least recently seen first
+	struct list_head index; // In the bucket of its id
+	uint64_t id;
+	uint64_t last_seq;
+	ev_tstamp seen;
+};
+
+
+static void put_u64(unsigned char *p, uint64_t v) {
+	uint32_t hi = htonl(v >> 32), lo = htonl(v & 0xffffffff);
+	memcpy(p, &hi, 4);
+	memcpy(p+4, &lo, 4);
+}
+static uint64_t get_u64(const unsigned char *p) {
+	uint32_t hi, lo;
+	memcpy(&hi, p, 4);
+	memcpy(&lo, p+4, 4);
+	return ((uint64_t)ntohl(hi) << 32) | ntohl(lo);
+}
+
+/* Frame header (all in network byte order):
+ *   u32 payload length
+ *   u8  type
+ *   u8  hops
+ *   u16 reserved (0)
+ *   u64 origin
+ *   u64 sequence number
+ */
+static int link_queue(struct link *l, int type, uint8_t hops,
+                      uint64_t origin, uint64_t seq,
+                      const char *data, size_t len) {
+	unsigned char *p;
+	uint32_t n = htonl(len);
+
+	p = (unsigned char*)buffer_reserve(&l->tx, LINK_HDR_LEN + len);
+	if( p == NULL ) return -1;
+	memcpy(p, &n, 4);
+	p[4] = type;
+	p[5] = hops;
+	p[6] = p[7] = 0;
+	put_u64(p+8, origin);
+	put_u64(p+16, seq);
+	memcpy(p + LINK_HDR_LEN, data, len);
+	buffer_commit(&l->tx, LINK_HDR_LEN + len);
+
+	if( !ev_is_active(&l->write_ready) ) {
+		struct TcpBus_bus *bus = l->bus;
+		ev_io_start(PBUS_EV_A_ &l->write_ready);
+	}
+	return 0;
+}
+
+static size_t origin_bucket(uint64_t id, size_t buckets) {
+	// Ids are random, but only by convention; mix them anyway
+	return ( ( id * 0x9E3779B97F4A7C15ull ) >> 32 ) & ( buckets-1 );
+}
+
+static int origin_index_grow(struct TcpBus_bus *bus) {
+	size_t n = bus->origin_buckets ? bus->origin_buckets * 2 : LINK_ORIGIN_BUCKETS_MIN;
+	struct list_head *b;
+	struct origin *o;
+	size_t i;
+
+	b = malloc(n * sizeof(*b)); // free() is in link_terminate()
+	if( b == NULL ) return -1;
+	for( i = 0; i < n; i++ ) INIT_LIST_HEAD(&b[i]);
+
+	list_for_each_entry(o, &bus->origins, list) {
+		list_move_tail(&o->index, &b[origin_bucket(o->id, n)]);
+	}
+	free(bus->origin_index);
+	bus->origin_index = b;
+	bus->origin_buckets = n;
+	return 0;
+}
+
+static void origin_free(struct TcpBus_bus *bus, struct origin *o) {
+	list_del(&o->list);
+	list_del(&o->index);
+	bus->origin_count--;
+	free(o);
+}
+
+/* Find the origin @id, adding it if it is new
+ * Returns NULL if out of memory
+ */
+static struct origin *origin_get(struct TcpBus_bus *bus, uint64_t id) {
+	ev_tstamp now = ev_now(PBUS_EV_A);
+	struct origin *o;
+
+	// The least recently seen come first, so this stops at the first one kept
+	while( !list_empty(&bus->origins) ) {
+		o = list_entry(bus->origins.next, struct origin, list);
+		if( now - o->seen < LINK_ORIGIN_EXPIRE ) break;
+		origin_free(bus, o);
+	}
+
+	if( bus->origin_buckets > 0 ) {
+		list_for_each_entry(o, &bus->origin_index[origin_bucket(id, bus->origin_buckets)], index) {
+			if( o->id == id ) {
+				o->seen = now;
+				list_move_tail(&o->list, &bus->origins);
+				return o;
+			}
+		}
+	}
+
+	if( bus->origin_count >= bus->origin_buckets && origin_index_grow(bus) == -1 ) {
+		return NULL;
+	}
+	o = malloc(sizeof(*o)); // free() is in origin_free()
+	if( o == NULL ) return NULL;
+	o->id = id;
+	o->last_seq = 0;
+	o->seen = now;
+	list_add_tail(&o->list, &bus->origins);
+	list_add_tail(&o->index, &bus->origin_index[origin_bucket(id, bus->origin_buckets)]);
+	bus->origin_count++;
+	return o;
+}
+
+static void link_dial(struct link *l);
+
+static void link_free(struct link *l) {
+	list_del(&l->list);
+	buffer_free(&l->rx);
+	buffer_free(&l->tx);
+	free(l);
+}
+
+/* Release the resources of a lost link
+ * Dialed links are kept around to be retried later, accepted links are
+ * free()d.
+ */
+static void link_release(struct link *l) {
+	buffer_free(&l->rx);
+	if( !l->dialer ) link_free(l);
+}
+
+/* Tear down the connection of a link
+ * @err is the errno that caused it, or 0 for a normal disconnect
+ *
+ * When this happens while link_ready_to_read() is handling frames (e.g. from
+ * within a callback), the frame data must remain valid, so releasing is left
+ * to link_ready_to_read().
+ */
+static void link_lost(struct link *l, int err) {
+	struct TcpBus_bus *bus = l->bus;
+
+	if( err != 0 ) {
+		callback_error_call(bus, NULL, &l->addr, l->addr_len, err);
+	} else if( l->state == LINK_UP ) {
+		callback_disconnect_call(bus, NULL, &l->addr, l->addr_len);
+	}
+
+	ev_io_stop(PBUS_EV_A_ &l->read_ready);
+	ev_io_stop(PBUS_EV_A_ &l->write_ready);
+	if( l->socket != -1 ) close(l->socket);
+	l->socket = -1;
+	l->state = LINK_IDLE;
+	buffer_free(&l->tx);
+
+	if( l->dialer ) {
+		ev_timer_set(&l->reconnect, l->backoff, 0.);
+		ev_timer_start(PBUS_EV_A_ &l->reconnect);
+		l->backoff *= 2;
+		if( l->backoff > LINK_BACKOFF_MAX ) l->backoff = LINK_BACKOFF_MAX;
+	}
+
+	if( !l->in_read ) link_release(l);
+}
+
+static void link_handle_frame(struct link *l, int type, uint8_t hops,
+                              uint64_t origin, uint64_t seq,
+                              const char *data, size_t len) {
+	struct TcpBus_bus *bus = l->bus;
+	struct origin *o;
+	struct link *i, *tmp;
+
+	if( type == LINK_FRAME_HELLO ) {
+		if( l->state != LINK_HANDSHAKE
+		 || len != sizeof(link_magic) || memcmp(data, link_magic, len) != 0 ) {
+			link_lost(l, EPROTO);
+			return;
+		}
+		if( origin == bus->id ) { // Linked to ourself
+			l->dialer = 0; // Don't retry
+			link_lost(l, ELOOP);
+			return;
+		}
+		l->state = LINK_UP;
+		l->backoff = LINK_BACKOFF_MIN;
+		callback_newcon_call(bus, NULL, &l->addr, l->addr_len);
+		return;
+	}
+
+	if( l->state != LINK_UP || type != LINK_FRAME_DATA ) {
+		link_lost(l, EPROTO);
+		return;
+	}
+
+	if( origin == bus->id ) return; // Our own data came back
+
+	o = origin_get(bus, origin);
+	if( o == NULL ) {
+		callback_error_call(bus, NULL, &l->addr, l->addr_len, ENOMEM);
+		return;
+	}
+	if( seq <= o->last_seq ) return; // Already seen via another path
+	o->last_seq = seq;
+
+	send_data(bus, data, len, NULL, GROUPS_ALL, TcpBus_PRIORITY_NORMAL);
+
+	if( hops + 1 < LINK_MAX_HOPS ) {
+		list_for_each_entry_safe(i, tmp, &bus->links, list) {
+			if( i == l || i->state != LINK_UP ) continue;
+			if( i->tx.len > LINK_TX_MAX
+			 || link_queue(i, LINK_FRAME_DATA, hops+1, origin, seq, data, len) == -1 ) {
+				link_lost(i, ENOBUFS);
+			}
+		}
+	}
+
+	callback_rx_call(bus, NULL, data, len);
+}
+
+static void link_ready_to_read(EV_P_ ev_io *w, int revents) {
+	struct link *l = w->data;
+	ssize_t rx_len;
+	char *p;
+
+	p = buffer_reserve(&l->rx, 4096);
+	if( p == NULL ) {
+		link_lost(l, ENOMEM);
+		return;
+	}
+	rx_len = recv(l->socket, p, l->rx.alloc - l->rx.start - l->rx.len, 0);
+	if( rx_len == -1 ) {
+		if( errno == EAGAIN || errno == EINTR ) return;
+		link_lost(l, errno);
+		return;
+	}
+	if( rx_len == 0 ) { // EOF
+		link_lost(l, 0);
+		return;
+	}
+	buffer_commit(&l->rx, rx_len);
+	busy_poll_kick(l->bus);
+
+	l->in_read = 1;
+	while( l->state != LINK_IDLE && l->rx.len >= LINK_HDR_LEN ) {
+		const unsigned char *h = (const unsigned char*)buffer_head(&l->rx);
+		uint32_t n;
+		memcpy(&n, h, 4);
+		n = ntohl(n);
+		if( n > LINK_MAX_FRAME ) {
+			link_lost(l, EPROTO);
+			break;
+		}
+		if( l->rx.len < LINK_HDR_LEN + n ) break;
+
+		link_handle_frame(l, h[4], h[5], get_u64(h+8), get_u64(h+16),
+		                  (const char*)h + LINK_HDR_LEN, n);
+		buffer_consume(&l->rx, LINK_HDR_LEN + n);
+	}
+	l->in_read = 0;
+
+	if( l->state == LINK_IDLE ) link_release(l); // Lost while handling
+}
+
+static void link_established(struct link *l) {
+	struct TcpBus_bus *bus = l->bus;
+
+	l->state = LINK_HANDSHAKE;
+	ev_io_set(&l->read_ready, l->socket, EV_READ);
+	ev_io_start(PBUS_EV_A_ &l->read_ready);
+
+	if( link_queue(l, LINK_FRAME_HELLO, 0, bus->id, 0,
+	               link_magic, sizeof(link_magic)) == -1 ) {
+		link_lost(l, ENOMEM);
+	}
+}
+
+static void link_ready_to_write(EV_P_ ev_io *w, int revents) {
+	struct link *l = w->data;
+	ssize_t rv;
+
+	if( l->state == LINK_CONNECTING ) {
+		int err;
+		socklen_t err_len = sizeof(err);
+		if( getsockopt(l->socket, SOL_SOCKET, SO_ERROR, &err, &err_len) == -1 ) {
+			err = errno;
+		}
+		if( err != 0 ) {
+			link_lost(l, err);
+			return;
+		}
+		ev_io_stop(EV_A_ w);
+		link_established(l);
+		return;
+	}
+
+	rv = send(l->socket, buffer_head(&l->tx), l->tx.len, 0);
+	if( rv == -1 ) {
+		if( errno == EAGAIN || errno == EINTR ) return;
+		link_lost(l, errno);
+		return;
+	}
+	buffer_consume(&l->tx, rv);
+	if( l->tx.len == 0 ) ev_io_stop(EV_A_ w);
+}
+
+static void link_reconnect(EV_P_ ev_timer *w, int revents) {
+	link_dial(w->data);
+}
+
+static int set_non_blocking(int socket) {
+	int flags = fcntl(socket, F_GETFL);
+	if( flags == -1 ) return -1;
+	return fcntl(socket, F_SETFL, flags | O_NONBLOCK);
+}
+
+static void link_dial(struct link *l) {
+	struct TcpBus_bus *bus = l->bus;
+	int rv;
+
+	l->socket = socket(l->addr.ss_family, SOCK_STREAM, 0);
+	if( l->socket == -1 ) {
+		link_lost(l, errno);
+		return;
+	}
+	if( set_non_blocking(l->socket) == -1 ) {
+		link_lost(l, errno);
+		return;
+	}
+
+	rv = connect(l->socket, (struct sockaddr*)&l->addr, l->addr_len);
+	if( rv == -1 && errno != EINPROGRESS ) {
+		link_lost(l, errno);
+		return;
+	}
+
+	// Completion (or failure) of the connect() is signalled as writable
+	l->state = LINK_CONNECTING;
+	ev_io_set(&l->write_ready, l->socket, EV_WRITE);
+	ev_io_start(PBUS_EV_A_ &l->write_ready);
+}
+
+static struct link *link_new(struct TcpBus_bus *bus,
+                             const struct sockaddr *addr, socklen_t addr_len) {
+	struct link *l;
+
+	if( addr_len > sizeof(l->addr) ) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	l = malloc(sizeof(*l)); // free() is in link_free()
+	if( l == NULL ) return NULL;
+
+	l->bus = bus;
+	l->socket = -1;
+	l->state = LINK_IDLE;
+	l->dialer = 0;
+	l->in_read = 0;
+	memcpy(&l->addr, addr, addr_len);
+	l->addr_len = addr_len;
+	l->backoff = LINK_BACKOFF_MIN;
+	buffer_init(&l->rx);
+	buffer_init(&l->tx);
+
+	ev_init(&l->read_ready, link_ready_to_read);
+	l->read_ready.data = l;
+	ev_init(&l->write_ready, link_ready_to_write);
+	l->write_ready.data = l;
+	ev_init(&l->reconnect, link_reconnect);
+	l->reconnect.data = l;
+
+	list_add(&l->list, &bus->links);
+	return l;
+}
+
+static void incomming_link(EV_P_ ev_io *w, int revents) {
+	struct TcpBus_bus *bus = w->data;
+	struct sockaddr_storage addr;
+	socklen_t addr_len = sizeof(addr);
+	struct link *l;
+	int s;
+
+	s = accept(w->fd, (struct sockaddr*)&addr, &addr_len);
+	if( s == -1 ) {
+		callback_error_call(bus, NULL, NULL, 0, errno);
+		return;
+	}
+	if( set_non_blocking(s) == -1 ) {
+		callback_error_call(bus, NULL, &addr, addr_len, errno);
+		close(s);
+		return;
+	}
+
+	l = link_new(bus, (struct sockaddr*)&addr, addr_len);
+	if( l == NULL ) {
+		callback_error_call(bus, NULL, &addr, addr_len, ENOMEM);
+		close(s);
+		return;
+	}
+	l->socket = s;
+	ev_io_set(&l->write_ready, l->socket, EV_WRITE);
+	link_established(l);
+}
+
+
+void link_publish(struct TcpBus_bus *bus, const char *data, size_t len) {
+	struct link *i, *tmp;
+
+	if( list_empty(&bus->links) ) return;
+
+	bus->link_seq++;
+	list_for_each_entry_safe(i, tmp, &bus->links, list) {
+		if( i->state != LINK_UP ) continue;
+		if( i->tx.len > LINK_TX_MAX
+		 || link_queue(i, LINK_FRAME_DATA, 0, bus->id, bus->link_seq, data, len) == -1 ) {
+			link_lost(i, ENOBUFS);
+		}
+	}
+}
+
+void link_init(struct TcpBus_bus *bus) {
+	uint64_t id = 0;
+	int fd;
+
+	/* The id must be unique in the mesh, and must change when a bus
+	 * restarts, since its sequence numbers start over.
+	 */
+	fd = open("/dev/urandom", O_RDONLY);
+	if( fd != -1 ) {
+		if( read(fd, &id, sizeof(id)) != sizeof(id) ) id = 0;
+		close(fd);
+	}
+	if( id == 0 ) {
+		id = ((uint64_t)time(NULL) << 32) ^ ((uint64_t)getpid() << 16) ^ (uintptr_t)bus;
+	}
+	bus->id = id;
+	bus->link_seq = 0;
+
+	ev_init(&bus->e_link_listen, incomming_link);
+	bus->e_link_listen.data = bus;
+	bus->link_listening = 0;
+	INIT_LIST_HEAD(&bus->links);
+	INIT_LIST_HEAD(&bus->origins);
+	bus->origin_index = NULL;
+	bus->origin_buckets = bus->origin_count = 0;
+}
+
+void link_terminate(struct TcpBus_bus *bus) {
+	struct link *l, *ltmp;
+	struct origin *o, *otmp;
+
+	ev_io_stop(PBUS_EV_A_ &bus->e_link_listen);
+
+	list_for_each_entry_safe(l, ltmp, &bus->links, list) {
+		ev_io_stop(PBUS_EV_A_ &l->read_ready);
+		ev_io_stop(PBUS_EV_A_ &l->write_ready);
+		ev_timer_stop(PBUS_EV_A_ &l->reconnect);
+		if( l->socket != -1 ) close(l->socket);
+		link_free(l);
+	}
+
+	list_for_each_entry_safe(o, otmp, &bus->origins, list) {
+		origin_free(bus, o);
+	}
+	free(bus->origin_index);
+	bus->origin_index = NULL;
+	bus->origin_buckets = 0;
+}
+
+
+int TcpBus_link_listen(struct TcpBus_bus *bus, int socket) {
+	if( bus->link_listening ) {
+		errno = EBUSY;
+		return -1;
+	}
+	ev_io_set(&bus->e_link_listen, socket, EV_READ);
+	ev_io_start(PBUS_EV_A_ &bus->e_link_listen);
+	bus->link_listening = 1;
+	return 0;
+}
+
+int TcpBus_link_connect(struct TcpBus_bus *bus,
+                        const struct sockaddr *addr, socklen_t addr_len) {
+	struct link *l = link_new(bus, addr, addr_len);
+	if( l == NULL ) return -1;
+	l->dialer = 1;
+	link_dial(l);
+	return 0;
+}
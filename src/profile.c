@@ -0,0 +1,116 @@
+/* Socket profiles
+ *
+ * A profile is a set of socket options for the connections of the bus, and
+ * the backlog at which the bus gives up on a connection. Accepted sockets get
+ * all options in connection_new(), before the connection is seen by anyone.
+ * Options left at the system default are not touched, so a profile that sets
+ * them can't be undone on existing connections.
+ *
+ * With priority lanes, TCP_NOTSENT_LOWAT belongs to the lanes, see lanes.c.
+ */
+
+#include "internal.h"
+
+#include "../config.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+static void set_option(int socket, int level, int name, int value) {
+	// Best effort: the kernel may clamp or refuse, the bus works either way
+	setsockopt(socket, level, name, &value, sizeof(value));
+}
+
+void profile_socket(struct TcpBus_bus *bus, int socket) {
+	const struct TcpBus_socket_profile *p = &bus->profile;
+
+	if( p->nodelay >= 0 ) set_option(socket, IPPROTO_TCP, TCP_NODELAY, p->nodelay);
+	if( p->sndbuf > 0 ) set_option(socket, SOL_SOCKET, SO_SNDBUF, p->sndbuf);
+	if( p->rcvbuf > 0 ) set_option(socket, SOL_SOCKET, SO_RCVBUF, p->rcvbuf);
+	if( p->rcvlowat > 0 ) set_option(socket, SOL_SOCKET, SO_RCVLOWAT, p->rcvlowat);
+	if( p->notsent_lowat > 0 && bus->lane_slice == 0 ) {
+		set_option(socket, IPPROTO_TCP, TCP_NOTSENT_LOWAT, p->notsent_lowat);
+	}
+}
+
+void profile_init(struct TcpBus_bus *bus) {
+	TcpBus_socket_profile_preset(&bus->profile, TcpBus_PROFILE_DEFAULT);
+	bus->tx_max = CONNECTION_TX_MAX;
+}
+
+
+int TcpBus_socket_profile_preset(struct TcpBus_socket_profile *profile,
+                                 enum TcpBus_socket_preset preset) {
+	struct TcpBus_socket_profile p = {
+		/* nodelay = */ -1,
+		/* sndbuf = */ 0,
+		/* rcvbuf = */ 0,
+		/* notsent_lowat = */ 0,
+		/* rcvlowat = */ 0,
+		/* backlog = */ 0,
+	};
+
+	switch( preset ) {
+	case TcpBus_PROFILE_DEFAULT:
+		break;
+	case TcpBus_PROFILE_LATENCY:
+		// Send small messages right away, and keep the unsent part of the
+		// kernel's queue short, so new data does not wait behind much
+		p.nodelay = 1;
+		p.notsent_lowat = 16 * 1024;
+		break;
+	case TcpBus_PROFILE_THROUGHPUT:
+		// Let Nagle coalesce, and give the kernel room to keep the pipe full
+		p.nodelay = 0;
+		p.sndbuf = 4 * 1024 * 1024;
+		p.rcvbuf = 4 * 1024 * 1024;
+		p.backlog = 4 * 1024 * 1024;
+		break;
+	case TcpBus_PROFILE_LEAN:
+		// Small fixed buffers, and give up on lagging connections early
+		p.nodelay = 1;
+		p.sndbuf = 16 * 1024;
+		p.rcvbuf = 16 * 1024;
+		p.backlog = 64 * 1024;
+		break;
+	default:
+		errno = EINVAL;
+		return -1;
+	}
+	*profile = p;
+	return 0;
+}
+
+int TcpBus_set_socket_profile(struct TcpBus_bus *bus,
+                              const struct TcpBus_socket_profile *profile) {
+	size_t tx_max = profile->backlog ? profile->backlog : CONNECTION_TX_MAX;
+	struct TcpBus_connection *i;
+
+	if( profile->nodelay > 1 || profile->sndbuf < 0 || profile->rcvbuf < 0
+	 || profile->notsent_lowat < 0 || profile->rcvlowat < 0 ) {
+		errno = EINVAL;
+		return -1;
+	}
+	// The history, a slice or the conflation threshold must still fit
+	if( bus->history_max > tx_max || bus->lane_slice >= tx_max
+	 || ( bus->conflate_key != NULL && bus->conflate_threshold >= tx_max ) ) {
+		errno = EINVAL;
+		return -1;
+	}
+	bus->profile = *profile;
+	// Fan-out writers check it without locking
+	__atomic_store_n(&bus->tx_max, tx_max, __ATOMIC_RELAXED);
+
+	list_for_each_entry(i, &bus->connections, list) {
+		profile_socket(bus, i->socket);
+	}
+	return 0;
+}
+
+void TcpBus_get_socket_profile(const struct TcpBus_bus *bus,
+                               struct TcpBus_socket_profile *profile) {
+	*profile = bus->profile;
+}
@@ -0,0 +1,250 @@
+/* Kernel forwarding
+ *
+ * When the bus only forwards, data could go from one socket to the other
+ * without ever leaving the kernel, using an eBPF sk_skb program on a sockmap.
+ * Such a program can redirect data to a single socket only, so this only
+ * works when a bus has exactly two connections; it can't copy data to more.
+ *
+ * There are two sockmaps of one socket each. The program attached to one map
+ * redirects everything to the socket in the other map, so it doesn't need to
+ * know where the data came from. When the other map is empty (the connection
+ * is gone, or we're backing off), the data is passed to user space as usual.
+ *
+ * Before the loop blocks, an ev_prepare watcher checks whether the bus can
+ * still be forwarded in the kernel: exactly two connections that hear each
+ * other, nothing queued for them, and no feature that needs to see the data.
+ * The sockets are put in, or taken out of, the maps accordingly.
+ */
+
+#include "internal.h"
+
+#include "../config.h"
+
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#ifdef HAVE_LINUX_BPF_H
+#include <linux/bpf.h>
+#include <sys/syscall.h>
+
+struct sockmap {
+	int map[2];   // Of one socket each
+	int prog[2];  // prog[i] runs on the socket in map[i]
+	uint64_t active[2]; // Ids of the connections in the maps, or 0
+	uint64_t failed[2]; // Ids of a pair the kernel refused
+	ev_prepare check;
+};
+
+static int sys_bpf(int cmd, union bpf_attr *attr) {
+	return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+static int map_create(void) {
+	union bpf_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.map_type = BPF_MAP_TYPE_SOCKMAP;
+	attr.key_size = sizeof(uint32_t);
+	attr.value_size = sizeof(uint32_t); // A socket
+	attr.max_entries = 1;
+	return sys_bpf(BPF_MAP_CREATE, &attr);
+}
+
+/* Load the program that redirects to the socket in @target_map
+ */
+static int prog_load(int target_map) {
+	struct bpf_insn insns[] = {
+		// r2 = target_map (r1 is the skb already)
+		{ .code = BPF_LD | BPF_DW | BPF_IMM, .dst_reg = BPF_REG_2,
+		  .src_reg = BPF_PSEUDO_MAP_FD, .imm = target_map },
+		{ .code = 0 },
+		// r0 = bpf_sk_redirect_map(skb, r2, 0, 0), to the egress of the socket
+		{ .code = BPF_ALU64 | BPF_MOV | BPF_K, .dst_reg = BPF_REG_3, .imm = 0 },
+		{ .code = BPF_ALU64 | BPF_MOV | BPF_K, .dst_reg = BPF_REG_4, .imm = 0 },
+		{ .code = BPF_JMP | BPF_CALL, .imm = BPF_FUNC_sk_redirect_map },
+		// No socket there: pass it to user space, rather than dropping it
+		{ .code = BPF_JMP | BPF_JNE | BPF_K, .dst_reg = BPF_REG_0, .off = 1, .imm = SK_DROP },
+		{ .code = BPF_ALU64 | BPF_MOV | BPF_K, .dst_reg = BPF_REG_0, .imm = SK_PASS },
+		{ .code = BPF_JMP | BPF_EXIT },
+	};
+	union bpf_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.prog_type = BPF_PROG_TYPE_SK_SKB;
+	attr.insns = (uintptr_t)insns;
+	attr.insn_cnt = sizeof(insns) / sizeof(insns[0]);
+	attr.license = (uintptr_t)"GPL";
+	return sys_bpf(BPF_PROG_LOAD, &attr);
+}
+
+static int prog_attach(int prog, int map) {
+	union bpf_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.target_fd = map;
+	attr.attach_bpf_fd = prog;
+	attr.attach_type = BPF_SK_SKB_STREAM_VERDICT;
+	return sys_bpf(BPF_PROG_ATTACH, &attr);
+}
+
+static int map_set(int map, int socket) {
+	union bpf_attr attr;
+	uint32_t key = 0, value = socket;
+	memset(&attr, 0, sizeof(attr));
+	attr.map_fd = map;
+	attr.key = (uintptr_t)&key;
+	attr.value = (uintptr_t)&value;
+	attr.flags = BPF_ANY;
+	return sys_bpf(BPF_MAP_UPDATE_ELEM, &attr);
+}
+
+static void map_clear(int map) {
+	union bpf_attr attr;
+	uint32_t key = 0;
+	memset(&attr, 0, sizeof(attr));
+	attr.map_fd = map;
+	attr.key = (uintptr_t)&key;
+	sys_bpf(BPF_MAP_DELETE_ELEM, &attr); // ENOENT if the socket was closed
+}
+
+/* Whether the bus consists of @a and @b forwarding to each other, and nothing
+ * else
+ */
+static int forwarding_only(const struct TcpBus_bus *bus,
+                           struct TcpBus_connection **a, struct TcpBus_connection **b) {
+	const struct list_head *l = &bus->connections;
+
+	if( l->next == l || l->next->next == l || l->next->next->next != l ) return 0;
+	*a = list_entry(l->next, struct TcpBus_connection, list);
+	*b = list_entry(l->next->next, struct TcpBus_connection, list);
+
+	return list_empty(&bus->callback_rx)
+	    && list_empty(&bus->callback_rx_batch)
+	    && bus->history_max == 0
+	    && bus->journal == NULL
+	    && list_empty(&bus->links)
+	    && list_empty(&bus->taps)
+	    && list_empty(&bus->compressed)
+	    && bus->writers == NULL
+	    && bus->idle_timeout == 0
+	    && bus->keepalive_interval == 0 // Forwarded data would look idle
+	    && bus->lane_slice == 0
+	    && bus->conflate_key == NULL
+	    && ( bus->routes[(*a)->group] >> (*b)->group & 1 )
+	    && ( bus->routes[(*b)->group] >> (*a)->group & 1 )
+	    && (*a)->tx.len == 0 && (*b)->tx.len == 0;
+}
+
+static void deactivate(struct sockmap *s) {
+	if( s->active[0] == 0 ) return;
+	map_clear(s->map[0]);
+	map_clear(s->map[1]);
+	s->active[0] = s->active[1] = 0;
+}
+
+static void sockmap_check(EV_P_ ev_prepare *w, int revents) {
+	struct TcpBus_bus *bus = w->data;
+	struct sockmap *s = bus->sockmap;
+	struct TcpBus_connection *a, *b;
+
+	if( !forwarding_only(bus, &a, &b) ) {
+		deactivate(s);
+		return;
+	}
+	if( s->active[0] == a->id && s->active[1] == b->id ) return;
+	if( s->failed[0] == a->id && s->failed[1] == b->id ) return;
+
+	deactivate(s);
+	if( map_set(s->map[0], a->socket) == -1 || map_set(s->map[1], b->socket) == -1 ) {
+		map_clear(s->map[0]);
+		s->failed[0] = a->id;
+		s->failed[1] = b->id;
+		return;
+	}
+	s->active[0] = a->id;
+	s->active[1] = b->id;
+}
+
+static void sockmap_free(struct TcpBus_bus *bus) {
+	struct sockmap *s = bus->sockmap;
+	int i;
+
+	ev_prepare_stop(PBUS_EV_A_ &s->check);
+	deactivate(s);
+	for( i = 0; i < 2; i++ ) {
+		if( s->prog[i] != -1 ) close(s->prog[i]);
+		if( s->map[i] != -1 ) close(s->map[i]);
+	}
+	free(s);
+	bus->sockmap = NULL;
+}
+
+void sockmap_release(struct TcpBus_bus *bus) {
+	if( bus->sockmap ) deactivate(bus->sockmap);
+}
+
+void sockmap_init(struct TcpBus_bus *bus) {
+	bus->sockmap = NULL;
+}
+
+void sockmap_terminate(struct TcpBus_bus *bus) {
+	if( bus->sockmap ) sockmap_free(bus);
+}
+
+
+int TcpBus_kernel_forwarding(struct TcpBus_bus *bus, int enable) {
+	struct sockmap *s;
+	int i, err;
+
+	if( !enable ) {
+		if( bus->sockmap ) sockmap_free(bus);
+		return 0;
+	}
+	if( bus->sockmap ) return 0;
+
+	s = malloc(sizeof(*s)); // free() is in sockmap_free()
+	if( s == NULL ) return -1;
+	memset(s, 0, sizeof(*s));
+	s->map[0] = s->map[1] = s->prog[0] = s->prog[1] = -1;
+	ev_prepare_init(&s->check, sockmap_check);
+	s->check.data = bus;
+	bus->sockmap = s;
+
+	for( i = 0; i < 2; i++ ) {
+		s->map[i] = map_create();
+		if( s->map[i] == -1 ) goto fail;
+	}
+	for( i = 0; i < 2; i++ ) {
+		s->prog[i] = prog_load(s->map[!i]);
+		if( s->prog[i] == -1 || prog_attach(s->prog[i], s->map[i]) == -1 ) goto fail;
+	}
+
+	ev_prepare_start(PBUS_EV_A_ &s->check);
+	return 0;
+
+fail:
+	err = errno; // EPERM without CAP_BPF/CAP_NET_ADMIN, EINVAL on old kernels
+	sockmap_free(bus);
+	errno = err;
+	return -1;
+}
+
+#else // HAVE_LINUX_BPF_H
+
+void sockmap_release(struct TcpBus_bus *bus) {
+}
+
+void sockmap_init(struct TcpBus_bus *bus) {
+	bus->sockmap = NULL;
+}
+
+void sockmap_terminate(struct TcpBus_bus *bus) {
+}
+
+int TcpBus_kernel_forwarding(struct TcpBus_bus *bus, int enable) {
+	if( !enable ) return 0;
+	errno = ENOSYS;
+	return -1;
+}
+
+#endif // HAVE_LINUX_BPF_H
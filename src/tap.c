@@ -0,0 +1,221 @@
+/* Taps
+ *
+ * A tap is not a connection of the bus: it is not in any group, so send_data()
+ * never visits it, and what it sends is read and thrown away. Instead,
+ * send_data() hands every chunk to tap_record(), which picks every Nth one and
+ * offers it to all taps as a journal record.
+ *
+ * A record goes to a tap only if the socket takes all of it, or if the tap
+ * has nothing pending; the rest of a partly sent record is kept until the
+ * socket is writable, and new records are skipped meanwhile. So a tap that
+ * can't keep up costs at most one record of memory, and sees gaps.
+ *
+ * The rate limit is a token bucket per tap, of one second of data.
+ */
+
+#include "internal.h"
+#include "journal.h"
+
+#include "../config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+struct tap {
+	struct TcpBus_bus *bus;
+	struct list_head list;
+	int socket;
+	ev_io read_ready;
+	ev_io write_ready;
+	struct buffer tx;  // Rest of a record the socket did not take
+	double tokens;     // Bytes we may still send, with a rate limit
+	ev_tstamp refill;  // When tokens were last topped up
+};
+
+static void tap_free(struct tap *t) {
+	struct TcpBus_bus *bus = t->bus;
+
+	ev_io_stop(PBUS_EV_A_ &t->read_ready);
+	ev_io_stop(PBUS_EV_A_ &t->write_ready);
+	close(t->socket);
+	buffer_free(&t->tx);
+	list_del(&t->list);
+	free(t);
+}
+
+static void tap_ready_to_read(EV_P_ ev_io *w, int revents) {
+	struct tap *t = w->data;
+	char buf[1024];
+	ssize_t rv;
+
+	rv = recv(t->socket, buf, sizeof(buf), 0);
+	if( rv == 0 || ( rv == -1 && errno != EAGAIN && errno != EINTR ) ) {
+		tap_free(t);
+	} // else ignored: taps don't talk to the bus
+}
+
+static void tap_ready_to_write(EV_P_ ev_io *w, int revents) {
+	struct tap *t = w->data;
+	ssize_t rv;
+
+	rv = send(t->socket, buffer_head(&t->tx), t->tx.len, MSG_NOSIGNAL);
+	if( rv == -1 ) {
+		if( errno == EAGAIN || errno == EINTR ) return;
+		tap_free(t);
+		return;
+	}
+	buffer_consume(&t->tx, rv);
+	if( t->tx.len == 0 ) ev_io_stop(EV_A_ w);
+}
+
+/* Whether the rate limit lets @len more bytes through now
+ */
+static int tap_allowed(struct tap *t, size_t len) {
+	struct TcpBus_bus *bus = t->bus;
+	ev_tstamp now;
+
+	if( bus->tap_rate == 0 ) return 1;
+
+	now = ev_now(PBUS_EV_A);
+	t->tokens += ( now - t->refill ) * bus->tap_rate;
+	if( t->tokens > bus->tap_rate ) t->tokens = bus->tap_rate;
+	t->refill = now;
+
+	// A full bucket lets anything through, so big chunks are not starved
+	if( t->tokens < len && t->tokens < bus->tap_rate ) return 0;
+	t->tokens -= len;
+	return 1;
+}
+
+static void tap_send(struct tap *t, const struct journal_record *r, const char *data) {
+	struct TcpBus_bus *bus = t->bus;
+	struct iovec iov[2];
+	ssize_t rv;
+	size_t total = sizeof(*r) + r->len;
+
+	if( t->tx.len > 0 ) return;           // Still busy with the previous one
+	if( !tap_allowed(t, r->len) ) return;
+
+	iov[0].iov_base = (void*)r;
+	iov[0].iov_len = sizeof(*r);
+	iov[1].iov_base = (void*)data;
+	iov[1].iov_len = r->len;
+	rv = writev(t->socket, iov, 2);
+	if( rv == -1 ) {
+		if( errno != EAGAIN && errno != EINTR ) tap_free(t);
+		return;
+	}
+	if( (size_t)rv == total ) return;
+
+	// Keep the rest, so the stream stays in one piece
+	if( (size_t)rv < sizeof(*r) ) {
+		if( buffer_append(&t->tx, (const char*)r + rv, sizeof(*r) - rv) == -1
+		 || buffer_append(&t->tx, data, r->len) == -1 ) {
+			tap_free(t);
+			return;
+		}
+	} else if( buffer_append(&t->tx, data + ( rv - sizeof(*r) ), total - rv) == -1 ) {
+		tap_free(t);
+		return;
+	}
+	ev_io_start(PBUS_EV_A_ &t->write_ready);
+}
+
+void tap_record(struct TcpBus_bus *bus, const char *data, size_t len,
+                const struct TcpBus_connection *origin) {
+	struct journal_record r;
+	struct tap *t, *tmp;
+
+	if( list_empty(&bus->taps) ) return;
+	if( len == 0 ) return; // A record with len 0 ends the stream
+	if( ++bus->tap_count < bus->tap_every ) return;
+	bus->tap_count = 0;
+
+	memset(&r, 0, sizeof(r));
+	r.len = len;
+	r.origin = origin ? origin->id : 0;
+	r.time = ev_now(PBUS_EV_A);
+
+	list_for_each_entry_safe(t, tmp, &bus->taps, list) {
+		tap_send(t, &r, data);
+	}
+}
+
+static void incomming_tap(EV_P_ ev_io *w, int revents) {
+	struct TcpBus_bus *bus = w->data;
+	struct tap *t;
+	int socket, flags;
+
+	socket = accept(w->fd, NULL, NULL);
+	if( socket == -1 ) {
+		callback_error_call(bus, NULL, NULL, 0, errno);
+		return;
+	}
+	flags = fcntl(socket, F_GETFL);
+	if( flags == -1 || fcntl(socket, F_SETFL, flags | O_NONBLOCK) == -1
+	 || send(socket, JOURNAL_MAGIC, JOURNAL_MAGIC_LEN, MSG_NOSIGNAL) != JOURNAL_MAGIC_LEN ) {
+		callback_error_call(bus, NULL, NULL, 0, errno);
+		close(socket);
+		return;
+	}
+
+	t = malloc(sizeof(*t)); // free() is in tap_free()
+	if( t == NULL ) {
+		callback_error_call(bus, NULL, NULL, 0, errno);
+		close(socket);
+		return;
+	}
+	t->bus = bus;
+	t->socket = socket;
+	buffer_init(&t->tx);
+	t->tokens = bus->tap_rate;
+	t->refill = ev_now(EV_A);
+	ev_io_init(&t->read_ready, tap_ready_to_read, socket, EV_READ);
+	t->read_ready.data = t;
+	ev_io_init(&t->write_ready, tap_ready_to_write, socket, EV_WRITE);
+	t->write_ready.data = t;
+	ev_io_start(EV_A_ &t->read_ready);
+	list_add_tail(&t->list, &bus->taps);
+}
+
+void tap_init(struct TcpBus_bus *bus) {
+	INIT_LIST_HEAD(&bus->taps);
+	bus->tap_listening = 0;
+	bus->tap_every = 1;
+	bus->tap_count = 0;
+	bus->tap_rate = 0;
+	ev_init(&bus->e_tap_listen, incomming_tap);
+	bus->e_tap_listen.data = bus;
+}
+
+void tap_terminate(struct TcpBus_bus *bus) {
+	struct tap *t, *tmp;
+
+	ev_io_stop(PBUS_EV_A_ &bus->e_tap_listen);
+	list_for_each_entry_safe(t, tmp, &bus->taps, list) {
+		tap_free(t);
+	}
+}
+
+
+int TcpBus_tap_listen(struct TcpBus_bus *bus, int socket, unsigned int every, size_t rate) {
+	if( every == 0 ) {
+		errno = EINVAL;
+		return -1;
+	}
+	if( bus->tap_listening ) {
+		errno = EBUSY;
+		return -1;
+	}
+	bus->tap_every = every;
+	bus->tap_rate = rate;
+	ev_io_set(&bus->e_tap_listen, socket, EV_READ);
+	ev_io_start(PBUS_EV_A_ &bus->e_tap_listen);
+	bus->tap_listening = 1;
+	return 0;
+}
@@ -0,0 +1,174 @@
+/* Measure the round-trip time over a bus
+ *
+ * Two connections are made to the bus. A message sent on the first one is
+ * received on the second, and sent back, so every sample is two hops through
+ * the bus. Any other clients on the bus get the messages too.
+ */
+
+#include "../config.h"
+
+#include <errno.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+static int connect_to(const char *host, const char *port) {
+	struct addrinfo hints, *res, *i;
+	int s = -1, rv, one = 1;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	rv = getaddrinfo(host, port, &hints, &res);
+	if( rv != 0 ) {
+		fprintf(stderr, "Can not resolve \"%s\": %s\n", host, gai_strerror(rv));
+		return -1;
+	}
+	for( i = res; i != NULL; i = i->ai_next ) {
+		s = socket(i->ai_family, i->ai_socktype, i->ai_protocol);
+		if( s == -1 ) continue;
+		if( connect(s, i->ai_addr, i->ai_addrlen) == 0 ) break;
+		close(s);
+		s = -1;
+	}
+	if( s == -1 ) {
+		fprintf(stderr, "Can not connect to %s:%s: %s\n", host, port, strerror(errno));
+	} else {
+		setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	}
+	freeaddrinfo(res);
+	return s;
+}
+
+static int send_all(int s, const char *data, size_t len) {
+	while( len > 0 ) {
+		ssize_t rv = send(s, data, len, MSG_NOSIGNAL);
+		if( rv == -1 ) {
+			if( errno == EINTR ) continue;
+			return -1;
+		}
+		data += rv;
+		len -= rv;
+	}
+	return 0;
+}
+
+static int recv_all(int s, char *data, size_t len) {
+	while( len > 0 ) {
+		ssize_t rv = recv(s, data, len, 0);
+		if( rv == 0 ) errno = ECONNRESET;
+		if( rv <= 0 ) {
+			if( rv == -1 && errno == EINTR ) continue;
+			return -1;
+		}
+		data += rv;
+		len -= rv;
+	}
+	return 0;
+}
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int compare(const void *a, const void *b) {
+	double x = *(const double*)a, y = *(const double*)b;
+	return x < y ? -1 : x > y;
+}
+
+int main(int argc, char *argv[]) {
+	static const struct option longopts[] = {
+		{"help",    no_argument,       NULL, 'h'},
+		{"version", no_argument,       NULL, 'V'},
+		{"count",   required_argument, NULL, 'n'},
+		{"size",    required_argument, NULL, 's'},
+		{NULL, 0, 0, 0}
+	};
+	int opt, a, b, n;
+	int count = 10000;
+	size_t size = 64;
+	double *rtt;
+	char *msg;
+
+	while( (opt = getopt_long(argc, argv, "hVn:s:", longopts, NULL)) != -1 ) {
+		switch( opt ) {
+		case 'h':
+		case '?':
+			fprintf(stderr,
+			//	>---------------------- Standard terminal width ---------------------------------<
+				"Usage: %s [options] host port\n"
+				"Options:\n"
+				"  -h --help                       Displays this help message and exits\n"
+				"  -V --version                    Displays the version and exits\n"
+				"  --count -n samples              Number of round trips (default 10000)\n"
+				"  --size -s bytes                 Size of the messages (default 64)\n"
+				, argv[0]);
+			exit(opt == '?' ? EX_USAGE : EX_OK);
+		case 'V':
+			printf("%s version %s\n", PACKAGE_NAME, PACKAGE_VERSION " (" PACKAGE_GITREVISION ")");
+			exit(EX_OK);
+		case 'n':
+			count = atoi(optarg);
+			break;
+		case 's':
+			size = strtoul(optarg, NULL, 10);
+			break;
+		}
+	}
+	if( argc - optind != 2 ) {
+		fprintf(stderr, "Need a host and a port\n");
+		exit(EX_USAGE);
+	}
+	if( count < 1 || size < 1 ) {
+		fprintf(stderr, "Need at least one sample of at least one byte\n");
+		exit(EX_USAGE);
+	}
+
+	rtt = malloc(count * sizeof(*rtt));
+	msg = malloc(size);
+	if( rtt == NULL || msg == NULL ) {
+		fprintf(stderr, "Out of memory\n");
+		exit(EX_OSERR);
+	}
+	memset(msg, 'x', size);
+
+	a = connect_to(argv[optind], argv[optind+1]);
+	b = connect_to(argv[optind], argv[optind+1]);
+	if( a == -1 || b == -1 ) exit(EX_UNAVAILABLE);
+	usleep(100000); // Let the bus set up both connections
+
+	for( n = 0; n < count; n++ ) {
+		double start = now();
+		if( send_all(a, msg, size) == -1
+		 || recv_all(b, msg, size) == -1
+		 || send_all(b, msg, size) == -1
+		 || recv_all(a, msg, size) == -1 ) {
+			fprintf(stderr, "Round trip %d failed: %s\n", n, strerror(errno));
+			exit(EX_IOERR);
+		}
+		rtt[n] = now() - start;
+	}
+
+	qsort(rtt, count, sizeof(*rtt), compare);
+	printf("%d round trips of %lu bytes, in microseconds:\n"
+	       "min %.1f  median %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n",
+	       count, (unsigned long)size,
+	       rtt[0] * 1e6, rtt[count / 2] * 1e6, rtt[count * 99 / 100] * 1e6,
+	       rtt[count * 999 / 1000] * 1e6, rtt[count - 1] * 1e6);
+
+	close(a);
+	close(b);
+	free(msg);
+	free(rtt);
+	return EX_OK;
+}
@@ -0,0 +1,217 @@
+/* Replay a journal, recorded with TcpBus_journal(), onto a bus
+ *
+ * The segments are mmap()ed and sent over a single connection, either at the
+ * pace they were recorded at or as fast as possible. With --dump, the records
+ * are listed instead.
+ */
+
+#include "journal.h"
+
+#include "../config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+static struct {
+	int fast;
+	int dump;
+	int sock;
+	double first;  // Time of the first record
+	double start;  // Our time when we sent it
+} replay = { 0, 0, -1, -1, 0 };
+
+static double now(void) {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static int connect_to(const char *host, const char *port) {
+	struct addrinfo hints, *res, *i;
+	int s = -1, rv;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	rv = getaddrinfo(host, port, &hints, &res);
+	if( rv != 0 ) {
+		fprintf(stderr, "Can not resolve \"%s\": %s\n", host, gai_strerror(rv));
+		return -1;
+	}
+	for( i = res; i != NULL; i = i->ai_next ) {
+		s = socket(i->ai_family, i->ai_socktype, i->ai_protocol);
+		if( s == -1 ) continue;
+		if( connect(s, i->ai_addr, i->ai_addrlen) == 0 ) break;
+		close(s);
+		s = -1;
+	}
+	if( s == -1 ) fprintf(stderr, "Can not connect to %s:%s: %s\n", host, port, strerror(errno));
+	freeaddrinfo(res);
+	return s;
+}
+
+static int send_all(int s, const char *data, size_t len) {
+	while( len > 0 ) {
+		ssize_t rv = send(s, data, len, MSG_NOSIGNAL);
+		if( rv == -1 ) {
+			if( errno == EINTR ) continue;
+			return -1;
+		}
+		data += rv;
+		len -= rv;
+	}
+	return 0;
+}
+
+/* Wait until @time, relative to the first record
+ */
+static void pace(double time) {
+	double delay;
+
+	if( replay.first < 0 ) {
+		replay.first = time;
+		replay.start = now();
+		return;
+	}
+	delay = replay.start + (time - replay.first) - now();
+	if( delay > 0 ) {
+		struct timespec ts;
+		ts.tv_sec = (time_t)delay;
+		ts.tv_nsec = (long)((delay - ts.tv_sec) * 1e9);
+		while( nanosleep(&ts, &ts) == -1 && errno == EINTR );
+	}
+}
+
+static int replay_segment(const char *path) {
+	struct stat st;
+	const char *map, *p, *end;
+	int fd, rv = 0;
+
+	fd = open(path, O_RDONLY);
+	if( fd == -1 || fstat(fd, &st) == -1 ) {
+		fprintf(stderr, "Can not open \"%s\": %s\n", path, strerror(errno));
+		if( fd != -1 ) close(fd);
+		return -1;
+	}
+	if( st.st_size < JOURNAL_MAGIC_LEN ) {
+		fprintf(stderr, "\"%s\" is not a journal segment\n", path);
+		close(fd);
+		return -1;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if( map == MAP_FAILED ) {
+		fprintf(stderr, "Can not map \"%s\": %s\n", path, strerror(errno));
+		return -1;
+	}
+	madvise((void*)map, st.st_size, MADV_SEQUENTIAL);
+
+	if( memcmp(map, JOURNAL_MAGIC, JOURNAL_MAGIC_LEN) != 0 ) {
+		fprintf(stderr, "\"%s\" is not a journal segment\n", path);
+		rv = -1;
+		goto out;
+	}
+
+	p = map + JOURNAL_MAGIC_LEN;
+	end = map + st.st_size;
+	while( p + sizeof(struct journal_record) <= end ) {
+		struct journal_record r;
+		memcpy(&r, p, sizeof(r));
+		p += sizeof(r);
+		if( r.len == 0 ) break; // Preallocated, but never written
+		if( r.len > (size_t)(end - p) ) {
+			fprintf(stderr, "\"%s\" is truncated\n", path);
+			rv = -1;
+			break;
+		}
+
+		if( replay.dump ) {
+			printf("%.6f %llu %u\n", r.time, (unsigned long long)r.origin, r.len);
+		} else {
+			if( !replay.fast ) pace(r.time);
+			if( send_all(replay.sock, p, r.len) == -1 ) {
+				fprintf(stderr, "Can not send: %s\n", strerror(errno));
+				rv = -1;
+				break;
+			}
+		}
+		p += r.len;
+	}
+
+out:
+	munmap((void*)map, st.st_size);
+	return rv;
+}
+
+int main(int argc, char *argv[]) {
+	static const struct option longopts[] = {
+		{"help",    no_argument, NULL, 'h'},
+		{"version", no_argument, NULL, 'V'},
+		{"fast",    no_argument, NULL, 'f'},
+		{"dump",    no_argument, NULL, 'd'},
+		{NULL, 0, 0, 0}
+	};
+	int opt, i;
+
+	while( (opt = getopt_long(argc, argv, "hVfd", longopts, NULL)) != -1 ) {
+		switch( opt ) {
+		case 'h':
+		case '?':
+			fprintf(stderr,
+			//	>---------------------- Standard terminal width ---------------------------------<
+				"Usage: %s [options] host port segment...\n"
+				"       %s --dump segment...\n"
+				"Options:\n"
+				"  -h --help                       Displays this help message and exits\n"
+				"  -V --version                    Displays the version and exits\n"
+				"  --fast -f                       Send as fast as possible, instead of at the\n"
+				"                                  recorded pace.\n"
+				"  --dump -d                       List the time, origin and length of all\n"
+				"                                  records, instead of sending them.\n"
+				, argv[0], argv[0]);
+			exit(opt == '?' ? EX_USAGE : EX_OK);
+		case 'V':
+			printf("%s version %s\n", PACKAGE_NAME, PACKAGE_VERSION " (" PACKAGE_GITREVISION ")");
+			exit(EX_OK);
+		case 'f':
+			replay.fast = 1;
+			break;
+		case 'd':
+			replay.dump = 1;
+			break;
+		}
+	}
+
+	if( !replay.dump ) {
+		if( argc - optind < 3 ) {
+			fprintf(stderr, "Need a host, a port and at least one segment\n");
+			exit(EX_USAGE);
+		}
+		replay.sock = connect_to(argv[optind], argv[optind+1]);
+		if( replay.sock == -1 ) exit(EX_UNAVAILABLE);
+		optind += 2;
+	} else if( argc - optind < 1 ) {
+		fprintf(stderr, "Need at least one segment\n");
+		exit(EX_USAGE);
+	}
+
+	// Segments sort in the order they were written
+	for( i = optind; i < argc; i++ ) {
+		if( replay_segment(argv[i]) == -1 ) exit(EX_DATAERR);
+	}
+
+	if( replay.sock != -1 ) close(replay.sock);
+	return EX_OK;
+}
@@ -0,0 +1,154 @@
+/* TCP statistics
+ *
+ * Sampling a connection takes two system calls: getsockopt(TCP_INFO) for the
+ * round trip time, congestion window, retransmits and unacknowledged
+ * segments, and ioctl(SIOCOUTQ) for what is left in the send queue of the
+ * kernel. Rather than doing that for all connections at once, a single timer
+ * samples a slice of them every 1/TCPINFO_SLICES of the interval.
+ *
+ * The connections are kept in a ring, in the order in which they are due:
+ * every tick samples the ones at the front whose time has come, and moves
+ * them to the back. New connections join at the front, so they are sampled
+ * soon. A tick samples at most 1/TCPINFO_SLICES of the ring, rounded up, so
+ * a round takes one interval however many connections there are; when more
+ * are due, they wait for the next tick.
+ *
+ * A connection that fails is sampled once more before it is reported, so
+ * the error callbacks see the state it failed in, even if it never had a
+ * sample. It is not sampled again after that.
+ */
+
+#include "internal.h"
+
+#include "../config.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/sockios.h>
+
+#define TCPINFO_SLICES 16       // Ticks per interval
+#define TCPINFO_TICK_MIN 0.01   // Seconds
+#define TCPINFO_EVICT_SAMPLES 3 // Samples of growth before dropping
+
+/* Take a sample
+ * Returns -1 if the socket can't tell
+ */
+static int measure(struct TcpBus_connection *c) {
+	struct TcpBus_bus *bus = c->bus;
+	struct TcpBus_connection_stats *s = &c->stats;
+	struct tcp_info info;
+	socklen_t info_len = sizeof(info);
+	int outq;
+
+	if( getsockopt(c->socket, IPPROTO_TCP, TCP_INFO, &info, &info_len) == -1 ) return -1;
+	if( ioctl(c->socket, SIOCOUTQ, &outq) == -1 ) outq = 0;
+
+	s->sampled = ev_now(PBUS_EV_A);
+	s->rtt = info.tcpi_rtt;
+	s->rtt_var = info.tcpi_rttvar;
+	s->cwnd = info.tcpi_snd_cwnd;
+	s->retransmits = info.tcpi_total_retrans;
+	s->unacked = info.tcpi_unacked;
+	s->outq = outq;
+	// The Tx side may belong to a writer thread; a slightly stale view will do
+	s->backlog = __atomic_load_n(&c->tx.len, __ATOMIC_RELAXED)
+	           + __atomic_load_n(&c->conflate_bytes, __ATOMIC_RELAXED)
+	           + __atomic_load_n(&c->lane_bytes, __ATOMIC_RELAXED);
+	return 0;
+}
+
+static void sample(struct TcpBus_connection *c) {
+	struct TcpBus_bus *bus = c->bus;
+	struct TcpBus_connection_stats *s = &c->stats;
+	size_t queue;
+
+	if( measure(c) == -1 ) return;
+
+	queue = s->outq + s->backlog;
+	if( queue > c->tcpinfo_queue ) s->growing++;
+	else s->growing = 0;
+	c->tcpinfo_queue = queue;
+
+	if( bus->tcpinfo_evict && queue > bus->tcpinfo_evict
+	 && s->growing >= TCPINFO_EVICT_SAMPLES ) {
+		connection_drop(c, ENOBUFS);
+	}
+}
+
+static void tcpinfo_tick(EV_P_ ev_timer *w, int revents) {
+	struct TcpBus_bus *bus = w->data;
+	ev_tstamp now = ev_now(EV_A);
+	size_t batch = ( bus->tcpinfo_count + TCPINFO_SLICES - 1 ) / TCPINFO_SLICES;
+	size_t n;
+
+	for( n = 0; n < batch && !list_empty(&bus->tcpinfo_ring); n++ ) {
+		struct TcpBus_connection *c =
+			list_entry(bus->tcpinfo_ring.next, struct TcpBus_connection, tcpinfo_ring);
+		if( c->tcpinfo_due > now ) break; // And so are the ones after it
+		c->tcpinfo_due = now + bus->tcpinfo_interval;
+		list_move_tail(&c->tcpinfo_ring, &bus->tcpinfo_ring);
+		sample(c); // May drop it
+	}
+}
+
+void tcpinfo_add(struct TcpBus_connection *c) {
+	struct TcpBus_bus *bus = c->bus;
+
+	memset(&c->stats, 0, sizeof(c->stats));
+	c->tcpinfo_queue = 0;
+	c->tcpinfo_due = 0;
+	list_add(&c->tcpinfo_ring, &bus->tcpinfo_ring);
+	bus->tcpinfo_count++;
+}
+
+void tcpinfo_refresh(struct TcpBus_connection *c) {
+	if( c->bus->tcpinfo_interval > 0 ) measure(c);
+}
+
+void tcpinfo_remove(struct TcpBus_connection *c) {
+	list_del(&c->tcpinfo_ring);
+	c->bus->tcpinfo_count--;
+}
+
+void tcpinfo_init(struct TcpBus_bus *bus) {
+	bus->tcpinfo_interval = 0;
+	bus->tcpinfo_evict = 0;
+	INIT_LIST_HEAD(&bus->tcpinfo_ring);
+	bus->tcpinfo_count = 0;
+	ev_init(&bus->tcpinfo_tick, tcpinfo_tick);
+	bus->tcpinfo_tick.data = bus;
+}
+
+void tcpinfo_terminate(struct TcpBus_bus *bus) {
+	ev_timer_stop(PBUS_EV_A_ &bus->tcpinfo_tick);
+}
+
+
+int TcpBus_set_tcp_sampling(struct TcpBus_bus *bus, ev_tstamp interval, size_t evict) {
+	ev_tstamp tick;
+
+	if( interval < 0 ) {
+		errno = EINVAL;
+		return -1;
+	}
+	bus->tcpinfo_interval = interval;
+	bus->tcpinfo_evict = evict;
+
+	ev_timer_stop(PBUS_EV_A_ &bus->tcpinfo_tick);
+	if( interval == 0 ) return 0;
+
+	tick = interval / TCPINFO_SLICES;
+	if( tick < TCPINFO_TICK_MIN ) tick = TCPINFO_TICK_MIN;
+	ev_timer_set(&bus->tcpinfo_tick, tick, tick);
+	ev_timer_start(PBUS_EV_A_ &bus->tcpinfo_tick);
+	return 0;
+}
+
+void TcpBus_connection_get_stats(const struct TcpBus_connection *conn,
+                                 struct TcpBus_connection_stats *stats) {
+	*stats = conn->stats;
+}
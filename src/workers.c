@@ -0,0 +1,257 @@
+/* Callback workers
+ *
+ * When enabled, the callbacks are not called from the loop thread, but handed
+ * to a pool of worker threads through bounded rings. Each connection is bound
+ * to a single worker (by hashing its pointer), so its events are seen in
+ * order. Events not about a connection (links, failed accept()s) all go to
+ * worker 0.
+ *
+ * Received data is copied once into a refcounted chunk; the event holds a
+ * reference to it, and to the connection, until the callbacks have returned.
+ */
+
+#include "internal.h"
+#include "chunk.h"
+
+#include "../config.h"
+
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <pthread.h>
+
+enum worker_event_type {
+	WORKER_RX,
+	WORKER_NEWCON,
+	WORKER_ERROR,
+	WORKER_DISCONNECT,
+};
+
+struct worker_event {
+	enum worker_event_type type;
+	struct TcpBus_connection *conn; // Held, or NULL
+	struct chunk *chunk;            // WORKER_RX only
+	struct sockaddr_storage addr;
+	socklen_t addr_len;             // 0 if there is no address
+	int err;
+};
+
+struct worker {
+	const struct TcpBus_bus *bus;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+	struct worker_event *ring;
+	size_t head, tail; // Free-running, the slot is (x % queue_len)
+	int stop;
+};
+
+static void event_run(const struct TcpBus_bus *bus, struct worker_event *e) {
+	const struct sockaddr_storage *addr = e->addr_len > 0 ? &e->addr : NULL;
+
+	switch( e->type ) {
+	case WORKER_RX:
+		callback_rx_run(bus, e->conn, e->chunk->data, e->chunk->len);
+		chunk_put(e->chunk);
+		break;
+	case WORKER_NEWCON:
+		callback_newcon_run(bus, e->conn, addr, e->addr_len);
+		break;
+	case WORKER_ERROR:
+		callback_error_run(bus, e->conn, addr, e->addr_len, e->err);
+		break;
+	case WORKER_DISCONNECT:
+		callback_disconnect_run(bus, e->conn, addr, e->addr_len);
+		break;
+	}
+	if( e->conn != NULL ) connection_release(e->conn);
+}
+
+static void *worker_main(void *arg) {
+	struct worker *w = arg;
+	size_t queue_len = w->bus->worker_queue_len;
+	struct worker_event e;
+
+	pthread_mutex_lock(&w->lock);
+	for(;;) {
+		while( w->head == w->tail && !w->stop ) {
+			pthread_cond_wait(&w->not_empty, &w->lock);
+		}
+		if( w->head == w->tail ) break; // Stopped, and drained
+		e = w->ring[w->tail % queue_len];
+		w->tail++;
+		pthread_cond_signal(&w->not_full);
+		pthread_mutex_unlock(&w->lock);
+
+		event_run(w->bus, &e);
+
+		pthread_mutex_lock(&w->lock);
+	}
+	pthread_mutex_unlock(&w->lock);
+	return NULL;
+}
+
+/* Queue an event on the worker of its connection
+ * Takes over the chunk reference; takes a new reference to the connection
+ */
+static void worker_queue(const struct TcpBus_bus *bus, struct worker_event *e) {
+	struct worker *w = &bus->workers[
+		e->conn ? ((uintptr_t)e->conn / sizeof(*e->conn)) % bus->n_workers : 0 ];
+	size_t queue_len = bus->worker_queue_len;
+
+	pthread_mutex_lock(&w->lock);
+	while( w->head - w->tail == queue_len ) {
+		if( e->type == WORKER_RX && bus->worker_policy == TcpBus_WORKER_DROP ) {
+			pthread_mutex_unlock(&w->lock);
+			chunk_put(e->chunk);
+			return;
+		}
+		pthread_cond_wait(&w->not_full, &w->lock);
+	}
+	if( e->conn != NULL ) connection_hold(e->conn);
+	w->ring[w->head % queue_len] = *e;
+	w->head++;
+	pthread_cond_signal(&w->not_empty);
+	pthread_mutex_unlock(&w->lock);
+}
+
+static void event_init(struct worker_event *e, enum worker_event_type type,
+                       struct TcpBus_connection *conn,
+                       const struct sockaddr_storage *addr, socklen_t addr_len) {
+	e->type = type;
+	e->conn = conn;
+	e->chunk = NULL;
+	e->addr_len = addr ? addr_len : 0;
+	if( addr ) memcpy(&e->addr, addr, addr_len);
+	e->err = 0;
+}
+
+void worker_rx(const struct TcpBus_bus *bus, struct TcpBus_connection *conn,
+               const char *data, size_t len) {
+	struct worker_event e;
+
+	event_init(&e, WORKER_RX, conn, NULL, 0);
+	e.chunk = chunk_new(bus->arena, data, len);
+	if( e.chunk == NULL ) return; // Dropped, as if the queue was full
+	worker_queue(bus, &e);
+}
+
+void worker_newcon(const struct TcpBus_bus *bus, struct TcpBus_connection *conn,
+                   const struct sockaddr_storage *addr, socklen_t addr_len) {
+	struct worker_event e;
+	event_init(&e, WORKER_NEWCON, conn, addr, addr_len);
+	worker_queue(bus, &e);
+}
+
+void worker_error(const struct TcpBus_bus *bus, struct TcpBus_connection *conn,
+                  const struct sockaddr_storage *addr, socklen_t addr_len,
+                  int err) {
+	struct worker_event e;
+	event_init(&e, WORKER_ERROR, conn, addr, addr_len);
+	e.err = err;
+	worker_queue(bus, &e);
+}
+
+void worker_disconnect(const struct TcpBus_bus *bus, struct TcpBus_connection *conn,
+                       const struct sockaddr_storage *addr, socklen_t addr_len) {
+	struct worker_event e;
+	event_init(&e, WORKER_DISCONNECT, conn, addr, addr_len);
+	worker_queue(bus, &e);
+}
+
+
+/* Stop all workers, after they handled everything that was queued
+ */
+static void workers_stop(struct TcpBus_bus *bus) {
+	int i;
+
+	for( i = 0; i < bus->n_workers; i++ ) {
+		struct worker *w = &bus->workers[i];
+		pthread_mutex_lock(&w->lock);
+		w->stop = 1;
+		pthread_cond_signal(&w->not_empty);
+		pthread_mutex_unlock(&w->lock);
+	}
+	for( i = 0; i < bus->n_workers; i++ ) {
+		struct worker *w = &bus->workers[i];
+		pthread_join(w->thread, NULL);
+		pthread_cond_destroy(&w->not_full);
+		pthread_cond_destroy(&w->not_empty);
+		pthread_mutex_destroy(&w->lock);
+		free(w->ring);
+	}
+	free(bus->workers);
+	bus->workers = NULL;
+	bus->n_workers = 0;
+}
+
+void workers_init(struct TcpBus_bus *bus) {
+	bus->workers = NULL;
+	bus->n_workers = 0;
+	bus->worker_queue_len = 0;
+	bus->worker_policy = TcpBus_WORKER_BLOCK;
+}
+
+void workers_terminate(struct TcpBus_bus *bus) {
+	workers_stop(bus);
+}
+
+
+int TcpBus_callback_workers(struct TcpBus_bus *bus, int threads, size_t queue_len,
+                            enum TcpBus_worker_policy policy) {
+	struct worker *workers;
+	sigset_t all, old;
+	int i, err = 0;
+
+	if( threads < 0 || ( threads > 0 && queue_len == 0 ) ) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	workers_stop(bus);
+	if( threads == 0 ) return 0;
+
+	workers = calloc(threads, sizeof(*workers)); // free() is in workers_stop()
+	if( workers == NULL ) return -1;
+
+	bus->workers = workers;
+	bus->worker_queue_len = queue_len;
+	bus->worker_policy = policy;
+
+	// Signals are for the loop thread
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+
+	for( i = 0; i < threads; i++ ) {
+		struct worker *w = &workers[i];
+		w->bus = bus;
+		w->ring = malloc(queue_len * sizeof(*w->ring)); // free() is in workers_stop()
+		if( w->ring == NULL ) {
+			err = ENOMEM;
+			break;
+		}
+		pthread_mutex_init(&w->lock, NULL);
+		pthread_cond_init(&w->not_empty, NULL);
+		pthread_cond_init(&w->not_full, NULL);
+		err = pthread_create(&w->thread, NULL, worker_main, w);
+		if( err != 0 ) {
+			pthread_cond_destroy(&w->not_full);
+			pthread_cond_destroy(&w->not_empty);
+			pthread_mutex_destroy(&w->lock);
+			free(w->ring);
+			break;
+		}
+		bus->n_workers++;
+	}
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if( err != 0 ) {
+		workers_stop(bus);
+		errno = err;
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,36 @@
+#!/bin/bash
+
+# Check that data received in one iteration of the loop arrives in one batch.
+
+. $(dirname $0)/common.sh
+
+start_bus bus -G
+PORT=$(port bus)
+
+exec 3<>/dev/tcp/127.0.0.1/$PORT
+exec 4<>/dev/tcp/127.0.0.1/$PORT
+exec 5<>/dev/tcp/127.0.0.1/$PORT
+sleep 0.2
+
+echo "alone" >&3
+wait_for batch-bus.log "^batch: 1 chunks, 6 bytes$"
+
+# Both are readable by the time the loop wakes up again
+kill -STOP $BUS
+echo "one" >&3
+echo "two" >&4
+sleep 0.1
+kill -CONT $BUS
+wait_for batch-bus.log "^batch: 2 chunks, 8 bytes$"
+
+# Forwarding is not affected; the last two may come in either order
+GOT=""
+for i in 1 2 3; do
+	read -t 2 -u 5 line || fail "only \"$GOT\" was forwarded"
+	GOT="$GOT $line"
+done
+case "$GOT" in
+	" alone one two"|" alone two one") ;;
+	*) fail "forwarded \"$GOT\"" ;;
+esac
+exit 0
@@ -0,0 +1,47 @@
+# Sourced by the test scripts
+#
+# Buses started with start_bus are stopped on exit, together with anything
+# the script adds to PIDS, and their logs (<script>-<name>.log) and whatever
+# is listed in CLEANUP are removed.
+
+NAME=$(basename $0 .sh)
+PIDS=""
+CLEANUP=""
+cleanup() {
+	kill -CONT $PIDS 2>/dev/null # In case a test stopped one
+	kill -INT $PIDS 2>/dev/null
+	wait
+	rm -rf $NAME-*.log $CLEANUP
+}
+trap cleanup EXIT
+
+fail() {
+	echo "FAIL: $*" >&2
+	exit 1
+}
+
+# wait_for <log> <text>
+wait_for() {
+	for i in $(seq 50); do
+		grep -q "$2" $1 && return
+		sleep 0.1
+	done
+	fail "\"$2\" did not appear in $1"
+}
+
+# start_bus <name> <options>
+# Starts tcp-bus, logging to $NAME-<name>.log, and waits until it is set up.
+# BUS is its pid.
+start_bus() {
+	local name=$1; shift
+	./tcp-bus "$@" 2>$NAME-$name.log &
+	BUS=$!
+	PIDS="$PIDS $BUS"
+	wait_for $NAME-$name.log "Setup done"
+}
+
+# port <name> [<log prefix>]
+# The port a bus logged after "Listening on", or after another prefix
+port() {
+	sed -n "s/^${2:-Listening on} .*\]:\([0-9]*\)$/\1/p" $NAME-$1.log
+}
@@ -0,0 +1,49 @@
+#!/bin/bash
+
+# Check that a client that does not keep up gets the latest value of every
+# key, in the order the keys were first queued, while a client that keeps up
+# gets every update; with and without writer threads.
+
+. $(dirname $0)/common.sh
+CLEANUP="$NAME-*.out"
+
+for writers in 0 1; do
+	OPTS="-Y default,sndbuf=16384 -c 50000"
+	[ $writers = 0 ] || OPTS="$OPTS -F $writers"
+	start_bus $writers $OPTS
+	PORT=$(port $writers)
+
+	exec 3<>/dev/tcp/127.0.0.1/$PORT # Sends
+	exec 4<>/dev/tcp/127.0.0.1/$PORT # Reads only at the end
+	exec 5<>/dev/tcp/127.0.0.1/$PORT
+	cat <&5 >$NAME-fast-$writers.out &
+	sleep 0.2
+
+	# 400 kB of unique lines, so the backlog of fd 4 passes the threshold; the
+	# bus reads them one at a time, or in pieces that start with a space,
+	# which have no key
+	for i in $(seq 100); do
+		printf 'f%d %*s\n' $i 4000 '' >&3
+		sleep 0.01
+	done
+	sleep 0.2
+	for update in "a 1" "b 1" "a 2" "c 1" "b 2" "a 3"; do
+		echo "$update" >&3
+		sleep 0.05
+	done
+
+	timeout 2 cat <&4 >$NAME-slow-$writers.out
+	exec 3>&- 4>&- 5>&-
+	kill -INT $BUS
+	wait $BUS
+	PIDS=""
+
+	grep -q "^error in" $NAME-$writers.log && fail "$writers writers: a client was dropped"
+	[ "$(grep -c '^f' $NAME-slow-$writers.out)" = 100 ] \
+		|| fail "$writers writers: the slow client did not get all unique lines"
+	[ "$(grep '^[abc] ' $NAME-slow-$writers.out | tr '\n' ,)" = "a 3,b 2,c 1," ] \
+		|| fail "$writers writers: the slow client got $(grep '^[abc] ' $NAME-slow-$writers.out | tr '\n' ,)"
+	[ "$(grep '^[abc] ' $NAME-fast-$writers.out | tr '\n' ,)" = "a 1,b 1,a 2,c 1,b 2,a 3," ] \
+		|| fail "$writers writers: the fast client did not get every update"
+done
+exit 0
@@ -0,0 +1,37 @@
+#!/bin/bash
+
+# Check that a writer thread drops a client that does not read, and that the
+# clients of both writers keep receiving everything, in order.
+
+. $(dirname $0)/common.sh
+CLEANUP="$NAME-*.out"
+
+start_bus bus -F 2
+PORT=$(port bus)
+
+exec 3<>/dev/tcp/127.0.0.1/$PORT # Sends
+exec 4<>/dev/tcp/127.0.0.1/$PORT # Never reads
+exec 5<>/dev/tcp/127.0.0.1/$PORT
+exec 6<>/dev/tcp/127.0.0.1/$PORT
+cat <&5 >$NAME-5.out &
+cat <&6 >$NAME-6.out &
+sleep 0.2
+
+# 12 MB: far more than the bus and the kernel hold for the lagging client
+LINES=600
+for i in $(seq $LINES); do
+	printf '%d %*s\n' $i 20000 '' >&3
+done
+
+for fd in 5 6; do
+	for i in $(seq 50); do
+		[ "$(wc -l <$NAME-$fd.out)" -ge $LINES ] && break
+		sleep 0.1
+	done
+	cut -d ' ' -f 1 $NAME-$fd.out | cmp -s - <(seq $LINES) \
+		|| fail "client on fd $fd did not receive all lines in order"
+done
+
+wait_for $NAME-bus.log "^error in .*No buffer space available"
+[ $(grep -c "^error in" $NAME-bus.log) = 1 ] || fail "more than the lagging client was dropped"
+exit 0
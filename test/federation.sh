@@ -0,0 +1,44 @@
+#!/bin/bash
+
+# Link three buses in a full mesh and check that data entering any of them
+# reaches the clients of the others exactly once.
+
+. $(dirname $0)/common.sh
+
+start_bus a -l "[127.0.0.1]:[0]"
+A_LINK=$(port a "Accepting bus links on")
+start_bus b -F 2 -A 4194304 -l "[127.0.0.1]:[0]" -p "[127.0.0.1]:[$A_LINK]"
+B_LINK=$(port b "Accepting bus links on")
+start_bus c -w 2 -A 4194304 -p "[127.0.0.1]:[$A_LINK]" -p "[127.0.0.1]:[$B_LINK]"
+
+exec 3<>/dev/tcp/127.0.0.1/$(port a)
+exec 4<>/dev/tcp/127.0.0.1/$(port b)
+exec 5<>/dev/tcp/127.0.0.1/$(port c)
+
+sleep 1 # Let the links come up
+
+# expect_once <fd> <line>
+expect_once() {
+	local line
+	read -t 2 -u $1 line || fail "nothing received on fd $1"
+	[ "$line" = "$2" ] || fail "fd $1 received \"$line\" instead of \"$2\""
+	read -t 0.5 -u $1 line && fail "fd $1 received a duplicate: \"$line\""
+	return 0
+}
+expect_none() {
+	local line
+	read -t 0.5 -u $1 line && fail "fd $1 received its own data: \"$line\""
+	return 0
+}
+
+echo "from a" >&3
+expect_once 4 "from a"
+expect_once 5 "from a"
+expect_none 3
+
+echo "from c" >&5
+expect_once 3 "from c"
+expect_once 4 "from c"
+expect_none 5
+
+exit 0
@@ -0,0 +1,39 @@
+#!/bin/bash
+
+# Put clients in two groups, A and B, where B does not send to A, and check
+# what reaches whom.
+
+. $(dirname $0)/common.sh
+
+# Clients 1 and 2 are in group A (1), clients 3 and 4 in group B (2)
+start_bus bus -g 1,1 -g 2,1 -g 3,2 -g 4,2 -x 2,1
+PORT=$(port bus)
+
+# Connect in order
+exec 3<>/dev/tcp/127.0.0.1/$PORT; sleep 0.1
+exec 4<>/dev/tcp/127.0.0.1/$PORT; sleep 0.1
+exec 5<>/dev/tcp/127.0.0.1/$PORT; sleep 0.1
+exec 6<>/dev/tcp/127.0.0.1/$PORT; sleep 0.1
+
+# expect <fd> <line>
+expect() {
+	local line
+	read -t 2 -u $1 line || fail "nothing received on fd $1"
+	[ "$line" = "$2" ] || fail "fd $1 received \"$line\" instead of \"$2\""
+}
+expect_none() {
+	local line
+	read -t 0.5 -u $1 line && fail "fd $1 received \"$line\""
+	return 0
+}
+
+echo "from a" >&3
+expect 4 "from a"
+expect 5 "from a"
+expect 6 "from a"
+
+echo "from b" >&5
+expect 6 "from b"
+expect_none 3
+expect_none 4
+exit 0
@@ -0,0 +1,66 @@
+#!/bin/bash
+
+# Hand a bus with two connected clients over to a new process, and check that
+# the clients stay connected and keep talking to each other; with compressed
+# clients too.
+
+. $(dirname $0)/common.sh
+SOCK=handover-$$.sock
+CLEANUP="$SOCK $SOCK.z $NAME-*.out"
+
+start_bus old -H $SOCK
+OLD=$BUS
+PORT=$(port old)
+
+exec 3<>/dev/tcp/127.0.0.1/$PORT
+exec 4<>/dev/tcp/127.0.0.1/$PORT
+sleep 0.2
+
+echo "before" >&3
+read -t 2 -u 4 line || fail "nothing received before handover"
+[ "$line" = "before" ] || fail "received \"$line\" before handover"
+
+start_bus new -T $SOCK -H $SOCK
+wait $OLD || fail "old process did not exit cleanly"
+grep -q "Handed over" handover-old.log || fail "old process did not hand over"
+wait_for handover-new.log "^new connection"
+[ $(grep -c "^new connection" handover-new.log) = 2 ] \
+	|| fail "the new process did not report the connections it took over"
+
+echo "after" >&4
+read -t 2 -u 3 line || fail "nothing received after handover"
+[ "$line" = "after" ] || fail "received \"$line\" after handover"
+
+# New clients are accepted on the same port
+exec 5<>/dev/tcp/127.0.0.1/$PORT || fail "listening socket was not handed over"
+sleep 0.2
+echo "new" >&5
+read -t 2 -u 3 line || fail "nothing received from new client"
+[ "$line" = "new" ] || fail "received \"$line\" from new client"
+
+# A compressed client can inflate what it got from both processes as one
+# stream
+command -v python3 >/dev/null || exit 0
+start_bus zold -z -H $SOCK.z
+OLD=$BUS
+PORT=$(port zold)
+
+exec 6<>/dev/tcp/127.0.0.1/$PORT
+exec 7<>/dev/tcp/127.0.0.1/$PORT
+cat <&6 >$NAME-z.out &
+sleep 0.2
+
+echo "compressed before" >&7
+sleep 0.2
+start_bus znew -z -T $SOCK.z
+wait $OLD || fail "old compressing process did not exit cleanly"
+echo "compressed after" >&7
+sleep 0.2
+
+RX=$(python3 -c 'import sys, zlib
+sys.stdout.write(zlib.decompressobj(-15).decompress(open(sys.argv[1], "rb").read()).decode())' \
+	$NAME-z.out) || fail "the compressed stream broke at the handover"
+[ "$RX" = "compressed before
+compressed after" ] || fail "the compressed client received \"$RX\""
+
+exit 0
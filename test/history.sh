@@ -0,0 +1,29 @@
+#!/bin/bash
+
+# Check that a new client gets the recent history of the bus, cut at the start
+# of a chunk.
+
+. $(dirname $0)/common.sh
+
+start_bus bus -r 12
+PORT=$(port bus)
+
+exec 3<>/dev/tcp/127.0.0.1/$PORT
+sleep 0.2
+for l in one two three; do
+	echo $l >&3
+	sleep 0.2 # Separate chunks
+done
+
+# "one" no longer fits in 12 bytes, next to "two" and "three"
+exec 4<>/dev/tcp/127.0.0.1/$PORT
+read -t 2 -u 4 line || fail "nothing replayed"
+[ "$line" = "two" ] || fail "replay started with \"$line\""
+read -t 2 -u 4 line || fail "replay stopped early"
+[ "$line" = "three" ] || fail "replay continued with \"$line\""
+read -t 0.5 -u 4 line && fail "replayed too much: \"$line\""
+
+echo "live" >&3
+read -t 2 -u 4 line || fail "nothing received after replay"
+[ "$line" = "live" ] || fail "received \"$line\" after replay"
+exit 0
@@ -0,0 +1,39 @@
+#!/bin/bash
+
+# Check that a silent client gets keepalives and is dropped after the idle
+# timeout, while a client that talks gets neither.
+
+. $(dirname $0)/common.sh
+
+start_bus bus -t 1 -k 0.3
+PORT=$(port bus)
+
+exec 3<>/dev/tcp/127.0.0.1/$PORT # Silent
+exec 4<>/dev/tcp/127.0.0.1/$PORT # Talks every 0.2 s
+START=$(date +%s%N)
+(
+	for i in $(seq 20); do # Bounded, as cleanup can't interrupt it
+		echo "tick" >&4
+		sleep 0.2
+	done
+) &
+TALKER=$!
+
+KEEPALIVES=0
+while true; do
+	read -t 3 -u 3 line
+	rv=$?
+	[ $rv -gt 128 ] && fail "the silent client was not dropped"
+	[ $rv != 0 ] && break # EOF
+	[ -z "$line" ] && KEEPALIVES=$((KEEPALIVES + 1))
+done
+ELAPSED=$(( ( $(date +%s%N) - START ) / 1000000 ))
+[ $ELAPSED -ge 900 ] || fail "the silent client was dropped after $ELAPSED ms"
+[ $ELAPSED -le 1600 ] || fail "the silent client was dropped after $ELAPSED ms"
+# At 0.3, 0.6 and 0.9 s; the wheel may be a tick late for the last one
+[ $KEEPALIVES -ge 2 -a $KEEPALIVES -le 3 ] || fail "$KEEPALIVES keepalives before the drop"
+
+read -t 0.5 -u 4 line && fail "the talking client received \"$line\""
+kill $TALKER
+[ $(grep -c "^disconnect" $NAME-bus.log) = 1 ] || fail "the talking client was dropped too"
+exit 0
@@ -0,0 +1,44 @@
+#!/bin/bash
+
+# Record a journal, and replay it onto a second bus.
+
+. $(dirname $0)/common.sh
+DIR=journal-$$
+CLEANUP=$DIR
+
+mkdir $DIR
+./tcp-bus -j $DIR/missing 2>$NAME-missing.log && fail "recording into a missing directory"
+grep -q "Can not record a journal" $NAME-missing.log || fail "a missing directory was not reported"
+
+# A second bus records in the same directory, in the same second
+start_bus rec -j $DIR
+REC=$BUS
+start_bus other -j $DIR
+OTHER=$BUS
+PORT=$(port rec)
+
+exec 3<>/dev/tcp/127.0.0.1/$PORT
+sleep 0.2
+for l in one two three; do
+	echo $l >&3
+	sleep 0.2 # Separate chunks
+done
+exec 3>&-
+kill -INT $REC $OTHER
+wait $REC || fail "recording bus did not exit cleanly"
+wait $OTHER || fail "second recording bus did not exit cleanly"
+[ $(ls $DIR | wc -l) = 2 ] || fail "the buses did not record a segment each"
+
+[ "$(../src/tcp-bus-replay -d $DIR/*.journal | wc -l)" = 3 ] || fail "journal does not hold 3 records"
+
+start_bus play
+PORT=$(port play)
+exec 4<>/dev/tcp/127.0.0.1/$PORT
+sleep 0.2
+
+../src/tcp-bus-replay -f 127.0.0.1 $PORT $DIR/*.journal || fail "replay failed"
+for l in one two three; do
+	read -t 2 -u 4 line || fail "nothing replayed"
+	[ "$line" = "$l" ] || fail "replayed \"$line\" instead of \"$l\""
+done
+exit 0
@@ -0,0 +1,35 @@
+#!/bin/bash
+
+# Check that the loop lag is measured, that a lagging bus stops accepting
+# clients, and that it accepts them again once the load is gone.
+
+. $(dirname $0)/common.sh
+
+# Any work at all is lag here: 1 µs
+start_bus bus -S 0.001,0,0
+PORT=$(port bus)
+
+exec 3<>/dev/tcp/127.0.0.1/$PORT
+exec 4<>/dev/tcp/127.0.0.1/$PORT
+sleep 0.2
+for i in $(seq 20); do
+	echo "line $i" >&3
+done
+for i in $(seq 20); do
+	read -t 2 -u 4 line || fail "line $i was not received"
+done
+
+# Idle again: a new client gets in
+sleep 0.5
+exec 5<>/dev/tcp/127.0.0.1/$PORT
+sleep 0.2
+echo "late" >&3
+read -t 2 -u 5 line || fail "no data after the load was gone"
+[ "$line" = "late" ] || fail "received \"$line\""
+
+kill -USR1 $BUS
+wait_for lag-bus.log "^Loop: "
+grep -q "^Loop: [1-9][0-9]* iterations" lag-bus.log || fail "no iterations measured"
+grep -q "accepting paused [1-9][0-9]* times" lag-bus.log || fail "accepting was never paused"
+grep -q "Busy time per iteration:" lag-bus.log || fail "no histogram"
+exit 0
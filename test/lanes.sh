@@ -0,0 +1,33 @@
+#!/bin/bash
+
+# Check that control messages overtake the bulk backlog of a lagging client.
+
+. $(dirname $0)/common.sh
+
+# Client 1 sends bulk, client 2 lags, client 3 sends control messages
+start_bus bus -Q 16384 -U 1 -u 3
+PORT=$(port bus)
+
+exec 3<>/dev/tcp/127.0.0.1/$PORT
+sleep 0.1
+exec 4<>/dev/tcp/127.0.0.1/$PORT
+sleep 0.1
+exec 5<>/dev/tcp/127.0.0.1/$PORT
+sleep 0.2
+
+# 600 kB, far more than client 2 takes without reading
+for i in $(seq 30); do
+	printf '%*s\n' 20000 '' >&3
+done
+sleep 0.5
+echo "failover" >&5
+sleep 0.2
+
+for i in $(seq 31); do
+	read -t 2 -u 4 line || fail "line $i was not received"
+	[ "$line" = "failover" ] && break
+done
+[ "$line" = "failover" ] || fail "the control message never arrived"
+[ $i -lt 20 ] || fail "the control message came after $((i-1)) bulk lines"
+grep -q "^error" lanes-bus.log && fail "a client was dropped"
+exit 0
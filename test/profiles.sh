@@ -0,0 +1,44 @@
+#!/bin/bash
+
+# Benchmark the socket profiles: the round-trip time through the bus, and
+# how much a client that stops reading holds when it is dropped.
+
+. $(dirname $0)/common.sh
+
+# The history must fit in the backlog of the profile, or new clients are dropped
+./tcp-bus -Y lean -r 1000000 2>$NAME-refused.log && fail "lean accepted a history above its backlog"
+grep -q "Can not keep history" $NAME-refused.log || fail "a history above the backlog was not reported"
+
+declare -A HELD
+for profile in default latency throughput lean; do
+	LOG=profiles-$profile.log
+	start_bus $profile -Y $profile -I 0.05
+	PORT=$(port $profile)
+
+	LATENCY=$(../src/tcp-bus-latency -n 500 127.0.0.1 $PORT | tail -n 1) \
+		|| fail "$profile: could not measure the latency"
+
+	exec 3<>/dev/tcp/127.0.0.1/$PORT
+	exec 4<>/dev/tcp/127.0.0.1/$PORT # Never reads
+	sleep 0.2
+	for i in $(seq 300); do
+		printf '%*s\n' 100000 '' >&3
+		sleep 0.005
+		[ $((i % 10)) = 0 ] && grep -q "^error in" $LOG && break
+	done
+	wait_for $LOG "^error in .*queued"
+	QUEUED=$(sed -n 's/^error in .*queued \([0-9]*\)+\([0-9]*\) bytes)$/\1 \2/p' $LOG)
+	exec 3>&- 4>&-
+	kill -INT $BUS
+	wait $BUS
+	PIDS=""
+
+	set -- $QUEUED
+	HELD[$profile]=$(($1 + $2))
+	printf '%-10s  %s\n%-10s  dropped a lagging client holding %d bytes in the kernel, %d in the bus\n' \
+		$profile "$LATENCY" "" $1 $2
+done
+
+[ ${HELD[lean]} -lt ${HELD[default]} ] || fail "lean holds no less than the default"
+[ ${HELD[default]} -lt ${HELD[throughput]} ] || fail "throughput holds no more than the default"
+exit 0
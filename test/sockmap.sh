@@ -0,0 +1,45 @@
+#!/bin/bash
+
+# Check that two clients are forwarded in the kernel, even while the bus
+# process is stopped, and that a third client brings the bus back to user
+# space. Skipped when the kernel or our privileges don't allow eBPF.
+
+. $(dirname $0)/common.sh
+
+start_bus bus -K
+if grep -q "Kernel forwarding not available" sockmap-bus.log; then
+	exit 77 # Skip
+fi
+PORT=$(port bus)
+
+exec 3<>/dev/tcp/127.0.0.1/$PORT
+exec 4<>/dev/tcp/127.0.0.1/$PORT
+sleep 0.2
+
+kill -STOP $BUS
+echo "ping" >&3
+read -t 2 -u 4 line || fail "nothing forwarded while the bus was stopped"
+[ "$line" = "ping" ] || fail "forwarded \"$line\""
+echo "pong" >&4
+read -t 2 -u 3 line || fail "nothing forwarded back while the bus was stopped"
+[ "$line" = "pong" ] || fail "forwarded back \"$line\""
+kill -CONT $BUS
+
+# A third client can't be served by the kernel
+exec 5<>/dev/tcp/127.0.0.1/$PORT
+sleep 0.2
+echo "all" >&3
+read -t 2 -u 4 line || fail "nothing received by the second client"
+[ "$line" = "all" ] || fail "second client received \"$line\""
+read -t 2 -u 5 line || fail "nothing received by the third client"
+[ "$line" = "all" ] || fail "third client received \"$line\""
+
+# And back to two
+exec 5>&-
+sleep 0.2
+kill -STOP $BUS
+echo "again" >&4
+read -t 2 -u 3 line || fail "nothing forwarded after the third client left"
+[ "$line" = "again" ] || fail "forwarded \"$line\" after the third client left"
+kill -CONT $BUS
+exit 0
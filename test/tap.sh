@@ -0,0 +1,39 @@
+#!/bin/bash
+
+# Tap a bus that samples one in two messages, and check what the tap records.
+
+. $(dirname $0)/common.sh
+DIR=tap-$$
+CLEANUP=$DIR
+
+mkdir $DIR
+start_bus bus -a "[127.0.0.1]:[0]" -s 2
+PORT=$(port bus)
+TAP_PORT=$(port bus "Accepting taps on")
+
+exec 5<>/dev/tcp/127.0.0.1/$TAP_PORT
+cat <&5 >$DIR/tap.journal &
+CAT=$!
+exec 3<>/dev/tcp/127.0.0.1/$PORT
+exec 4<>/dev/tcp/127.0.0.1/$PORT
+sleep 0.2
+
+echo "not for the bus" >&5
+for i in $(seq 10); do
+	echo "line $i" >&3
+	sleep 0.1 # Separate chunks
+done
+for i in $(seq 10); do
+	read -t 2 -u 4 line || fail "line $i was not received"
+	[ "$line" = "line $i" ] || fail "received \"$line\" instead of \"line $i\""
+done
+read -t 0.5 -u 4 line && fail "the tap reached a client: \"$line\""
+
+kill -INT $BUS
+wait $BUS || fail "bus did not exit cleanly"
+wait $CAT
+
+../src/tcp-bus-replay -d $DIR/tap.journal >tap-dump.log || fail "tap did not record a journal"
+[ "$(wc -l <tap-dump.log)" = 5 ] || fail "tap holds $(wc -l <tap-dump.log) records instead of 5"
+grep -q " 0 " tap-dump.log && fail "records without an origin"
+exit 0
@@ -2,19 +2,34 @@
 #include "../include/libtcpbus.h"
 
 #include <netinet/in.h>
+#include <sys/un.h>
 #include <arpa/inet.h>
 #include <ev.h>
 #include <stdio.h>
 #include <errno.h>
 #include <string.h>
+#include <stdlib.h>
 #include <sysexits.h>
 #include <getopt.h>
+#include <netdb.h>
+#include <iostream>
+#include <vector>
+#include <map>
+#include <utility>
+#include <algorithm>
 
 #include "../Socket/Socket.hxx"
+#include "../Socket/Resolver.hxx"
 
 static const int MAX_CONN_BACKLOG = 32;
 
 Socket s_listen;
+Socket s_link_listen;
+Socket s_tap_listen;
+
+std::vector<uint64_t> s_control_ids, s_bulk_ids; // Connections with a priority
+std::map<uint64_t, unsigned int> s_groups; // Group of connections, by id
+Socket s_handover;
 
 
 void received_sigint(EV_P_ ev_signal *w, int revents) {
@@ -26,31 +41,260 @@ void received_sigterm(EV_P_ ev_signal *w, int revents) {
 	ev_break(EV_A_ EVUNLOOP_ALL);
 }
 
-void received_newcon(const struct TcpBus_bus *bus,
+void print_histogram(const char *title, const uint64_t *hist) {
+	fprintf(stderr, "  %s:\n", title);
+	for( int i = 0; i < TcpBus_LAG_BUCKETS; i++ ) {
+		if( hist[i] == 0 ) continue;
+		if( i == TcpBus_LAG_BUCKETS - 1 ) {
+			fprintf(stderr, "    >= %8llu us: %llu\n", 1ULL << (i-1), (unsigned long long)hist[i]);
+		} else {
+			fprintf(stderr, "     < %8llu us: %llu\n", 1ULL << i, (unsigned long long)hist[i]);
+		}
+	}
+}
+
+void received_sigusr1(EV_P_ ev_signal *w, int revents) {
+	struct TcpBus_bus *bus = static_cast<struct TcpBus_bus*>(w->data);
+	struct TcpBus_lag_stats st;
+
+	TcpBus_get_lag_stats(bus, &st);
+	fprintf(stderr, "Loop: %llu iterations, %.3f s busy, %.3f s waiting, lag %.1f us, "
+	                "shedding level %d, accepting paused %llu times, %llu evicted\n",
+	        (unsigned long long)st.iterations, st.busy, st.waiting, st.lag * 1e6,
+	        st.level, (unsigned long long)st.paused, (unsigned long long)st.evicted);
+	print_histogram("Busy time per iteration", st.busy_hist);
+	print_histogram("Time per iteration", st.iteration_hist);
+}
+
+void received_newcon(const struct TcpBus_bus *bus, struct TcpBus_connection *conn,
+                     const struct sockaddr *addr, socklen_t addr_len) {
+	char a[SockAddr::SockAddr::string_max];
+	SockAddr::create(addr).format(a, sizeof(a));
+
+	fprintf(stderr, "new connection: %s\n", a);
+}
+
+void compress_newcon(const struct TcpBus_bus *bus, struct TcpBus_connection *conn,
                      const struct sockaddr *addr, socklen_t addr_len) {
-	std::auto_ptr<SockAddr::SockAddr> a(
-		SockAddr::create(reinterpret_cast<const struct sockaddr_storage*>(addr))
-	);
+	if( conn == NULL ) return; // A bus link
+	if( TcpBus_connection_set_compression(conn, 1) == -1 ) {
+		fprintf(stderr, "Can not compress: %s\n", strerror(errno));
+	}
+}
+
+void priority_newcon(const struct TcpBus_bus *bus, struct TcpBus_connection *conn,
+                     const struct sockaddr *addr, socklen_t addr_len) {
+	if( conn == NULL ) return; // A bus link
+	uint64_t id = TcpBus_connection_id(conn);
+	if( std::find(s_control_ids.begin(), s_control_ids.end(), id) != s_control_ids.end() ) {
+		TcpBus_connection_set_priority(conn, TcpBus_PRIORITY_CONTROL);
+	} else if( std::find(s_bulk_ids.begin(), s_bulk_ids.end(), id) != s_bulk_ids.end() ) {
+		TcpBus_connection_set_priority(conn, TcpBus_PRIORITY_BULK);
+	}
+}
 
-	fprintf(stderr, "new connection: %s\n", a->string().c_str());
+void group_newcon(const struct TcpBus_bus *bus, struct TcpBus_connection *conn,
+                  const struct sockaddr *addr, socklen_t addr_len) {
+	if( conn == NULL ) return; // A bus link
+	std::map<uint64_t, unsigned int>::const_iterator i = s_groups.find(TcpBus_connection_id(conn));
+	if( i != s_groups.end() ) TcpBus_connection_set_group(conn, i->second);
 }
 
-void received_error(const struct TcpBus_bus *bus,
+void received_batch(const struct TcpBus_bus *bus,
+                    const struct TcpBus_rx_entry *entries, size_t n) {
+	size_t bytes = 0;
+	for( size_t i = 0; i < n; i++ ) bytes += entries[i].len;
+
+	fprintf(stderr, "batch: %zu chunks, %zu bytes\n", n, bytes);
+}
+
+/* The key of a message is its first word
+ */
+const char *first_word(const char *data, size_t len, size_t *key_len) {
+	size_t n = 0;
+	while( n < len && data[n] != ' ' && data[n] != '\t' && data[n] != '\n' ) n++;
+	if( n == 0 ) return NULL;
+	*key_len = n;
+	return data;
+}
+
+void received_error(const struct TcpBus_bus *bus, struct TcpBus_connection *conn,
                     const struct sockaddr *addr, socklen_t addr_len, int err) {
-	std::auto_ptr<SockAddr::SockAddr> a(
-		SockAddr::create(reinterpret_cast<const struct sockaddr_storage*>(addr))
-	);
+	if( addr == NULL ) {
+		fprintf(stderr, "error: %s\n", strerror(err));
+		return;
+	}
+	char a[SockAddr::SockAddr::string_max];
+	SockAddr::create(addr).format(a, sizeof(a));
 
-	fprintf(stderr, "error in %s : %s\n", a->string().c_str(), strerror(err));
+	struct TcpBus_connection_stats st;
+	if( conn != NULL ) TcpBus_connection_get_stats(conn, &st);
+	if( conn == NULL || st.sampled == 0 ) {
+		fprintf(stderr, "error in %s : %s\n", a, strerror(err));
+		return;
+	}
+	fprintf(stderr, "error in %s : %s (rtt %.1f ms, cwnd %u, retransmits %u, "
+	                "unacked %u, queued %u+%zu bytes)\n",
+	        a, strerror(err), st.rtt / 1000., st.cwnd, st.retransmits,
+	        st.unacked, st.outq, st.backlog);
 }
 
-void received_disconnect(const struct TcpBus_bus *bus,
+void received_disconnect(const struct TcpBus_bus *bus, struct TcpBus_connection *conn,
                          const struct sockaddr *addr, socklen_t addr_len) {
-	std::auto_ptr<SockAddr::SockAddr> a(
-		SockAddr::create(reinterpret_cast<const struct sockaddr_storage*>(addr))
-	);
+	char a[SockAddr::SockAddr::string_max];
+	SockAddr::create(addr).format(a, sizeof(a));
+
+	fprintf(stderr, "disconnect: %s\n", a);
+}
+
+void received_handover(EV_P_ ev_io *w, int revents) {
+	struct TcpBus_bus *bus = static_cast<struct TcpBus_bus*>(w->data);
+	Socket s( Socket::accept(w->fd, NULL, NULL) );
+
+	if( TcpBus_handover(bus, s) == -1 ) {
+		fprintf(stderr, "Handover failed: %s\n", strerror(errno));
+		return;
+	}
+	fprintf(stderr, "Handed over to new process, exiting\n");
+	ev_break(EV_A_ EVUNLOOP_ALL);
+}
+
+
+/* Split a bind or connect string in host and port
+ * Exits the program when this is not possible
+ */
+void split_addr(std::string const &addr, std::string *host, std::string *port) {
+	/* Address format is
+	 *   - hostname:portname
+	 *   - [numeric ip]:portname
+	 *   - hostname:[portnumber]
+	 *   - [numeric ip]:[portnumber]
+	 */
+	size_t c = addr.rfind(":");
+	if( c == std::string::npos ) {
+		/* TRANSLATORS: %1$s contains the string passed as option
+		 */
+		fprintf(stderr, "Invalid address string \"%1$s\": could not find ':'\n", addr.c_str());
+		exit(EX_DATAERR);
+	}
+	*host = addr.substr(0, c);
+	*port = addr.substr(c+1);
+}
+
+/* Resolve a bind or connect string
+ * Exits the program when this is not possible
+ */
+std::vector<SockAddr::SockAddr> resolve(std::string const &addr) {
+	std::string host, port;
+	split_addr(addr, &host, &port);
+
+	std::vector<SockAddr::SockAddr> sa
+		= SockAddr::resolve( host, port, 0, SOCK_STREAM, 0);
+	if( sa.size() == 0 ) {
+		fprintf(stderr, "Can not use \"%1$s\": Could not resolve\n", addr.c_str());
+		exit(EX_DATAERR);
+	}
+	return sa;
+}
+
+/* A peer to link to, once its address is resolved
+ */
+struct peer {
+	struct TcpBus_bus *bus;
+	std::string addr;
+};
+
+void peer_resolved(std::vector<SockAddr::SockAddr> const &sa, int error, void *data) {
+	struct peer *p = static_cast<struct peer*>(data);
+
+	if( error != 0 || sa.size() == 0 ) {
+		fprintf(stderr, "Can not use \"%1$s\": Could not resolve: %2$s\n",
+		        p->addr.c_str(), error != 0 ? gai_strerror(error) : "no addresses");
+		exit(EX_DATAERR);
+	}
+	if( TcpBus_link_connect(p->bus, sa[0], sa[0].addr_len()) == -1 ) {
+		fprintf(stderr, "Can not link to \"%1$s\": %2$s\n", p->addr.c_str(), strerror(errno));
+		exit(EX_OSERR);
+	}
+	fprintf(stderr, "Linking to %s\n", sa[0].string().c_str());
+}
+
+/* Parse a socket profile: a preset, optionally followed by ,option=value
+ * overrides
+ * Exits the program when this is not possible
+ */
+void parse_profile(std::string const &arg, struct TcpBus_socket_profile *p) {
+	static const struct {
+		const char *name;
+		enum TcpBus_socket_preset preset;
+	} presets[] = {
+		{"default", TcpBus_PROFILE_DEFAULT},
+		{"latency", TcpBus_PROFILE_LATENCY},
+		{"throughput", TcpBus_PROFILE_THROUGHPUT},
+		{"lean", TcpBus_PROFILE_LEAN},
+	};
+	std::string name = arg.substr(0, arg.find(','));
+	size_t i;
+	for( i = 0; i < sizeof(presets)/sizeof(*presets); i++ ) {
+		if( name == presets[i].name ) break;
+	}
+	if( i == sizeof(presets)/sizeof(*presets) ) {
+		fprintf(stderr, "Unknown profile \"%1$s\"\n", name.c_str());
+		exit(EX_USAGE);
+	}
+	TcpBus_socket_profile_preset(p, presets[i].preset);
+
+	for( size_t pos = name.size(); pos < arg.size(); ) {
+		size_t end = arg.find(',', pos + 1);
+		std::string option = arg.substr(pos + 1, end == std::string::npos ? end : end - pos - 1);
+		pos = end == std::string::npos ? arg.size() : end;
+
+		size_t eq = option.find('=');
+		std::string key = option.substr(0, eq);
+		long value = eq == std::string::npos ? -2 : strtol(option.c_str() + eq + 1, NULL, 10);
+		if( value < -1 ) {
+			fprintf(stderr, "Invalid profile option \"%1$s\": expected option=value\n", option.c_str());
+			exit(EX_USAGE);
+		}
+		if( key == "nodelay" ) p->nodelay = value;
+		else if( key == "sndbuf" ) p->sndbuf = value;
+		else if( key == "rcvbuf" ) p->rcvbuf = value;
+		else if( key == "notsent-lowat" ) p->notsent_lowat = value;
+		else if( key == "rcvlowat" ) p->rcvlowat = value;
+		else if( key == "backlog" ) p->backlog = value;
+		else {
+			fprintf(stderr, "Unknown profile option \"%1$s\"\n", key.c_str());
+			exit(EX_USAGE);
+		}
+	}
+}
+
+socklen_t unix_addr(struct sockaddr_un *sa, std::string const &path) {
+	if( path.length() >= sizeof(sa->sun_path) ) {
+		fprintf(stderr, "Unix socket path \"%1$s\" is too long\n", path.c_str());
+		exit(EX_DATAERR);
+	}
+	memset(sa, 0, sizeof(*sa));
+	sa->sun_family = AF_UNIX;
+	strcpy(sa->sun_path, path.c_str());
+	return sizeof(*sa);
+}
+
+void listen_on(Socket &s, std::string const &bind_addr) {
+	std::vector<SockAddr::SockAddr> bind_sa = resolve(bind_addr);
+	if( bind_sa.size() > 1 ) {
+		// TODO: allow this
+		fprintf(stderr, "Can not bind to \"%1$s\": Resolves to multiple entries:\n", bind_addr.c_str());
+		for( typeof(bind_sa.begin()) i = bind_sa.begin(); i != bind_sa.end(); i++ ) {
+			std::cerr << "  " << i->string() << "\n";
+		}
+		exit(EX_DATAERR);
+	}
 
-	fprintf(stderr, "disconnect: %s\n", a->string().c_str());
+	s = Socket::socket( bind_sa[0].proto_family() , SOCK_STREAM, 0);
+	s.set_reuseaddr();
+	s.bind(bind_sa[0]);
+	s.listen(MAX_CONN_BACKLOG);
 }
 
 
@@ -60,16 +304,103 @@ int main(int argc, char* argv[]) {
 	// Default options
 	struct {
 		std::string bind_addr_listen;
+		std::string bind_addr_link;
+		std::vector<std::string> peers;
+		double idle_timeout;
+		double keepalive_interval;
+		std::string handover_path;
+		std::string takeover_path;
+		int workers;
+		int fanout;
+		size_t history;
+		std::string journal_dir;
+		bool compress;
+		size_t conflate;
+		double busy_poll;
+		int cpu;
+		size_t arena;
+		bool lock_arena;
+		bool kernel_forwarding;
+		double tcp_sampling;
+		size_t evict;
+		bool lag_monitor;
+		double shed[3];
+		std::string bind_addr_tap;
+		unsigned int tap_every;
+		size_t tap_rate;
+		size_t lanes;
+		bool batch;
+		std::string profile;
+		std::vector<std::pair<unsigned int, unsigned int> > unroutes;
 	} options = {
 		/* bind_addr_listen = */ "[127.0.0.1]:[0]",
+		/* bind_addr_link = */ "",
+		/* peers = */ std::vector<std::string>(),
+		/* idle_timeout = */ 0,
+		/* keepalive_interval = */ 0,
+		/* handover_path = */ "",
+		/* takeover_path = */ "",
+		/* workers = */ 0,
+		/* fanout = */ 0,
+		/* history = */ 0,
+		/* journal_dir = */ "",
+		/* compress = */ false,
+		/* conflate = */ 0,
+		/* busy_poll = */ 0,
+		/* cpu = */ -1,
+		/* arena = */ 0,
+		/* lock_arena = */ false,
+		/* kernel_forwarding = */ false,
+		/* tcp_sampling = */ 0,
+		/* evict = */ 0,
+		/* lag_monitor = */ false,
+		/* shed = */ {0, 0, 0},
+		/* bind_addr_tap = */ "",
+		/* tap_every = */ 1,
+		/* tap_rate = */ 0,
+		/* lanes = */ 0,
+		/* batch = */ false,
+		/* profile = */ "",
+		/* unroutes = */ std::vector<std::pair<unsigned int, unsigned int> >(),
 		};
 
 	{ // Parse options
-		char optstring[] = "hVfp:b:B:l:";
+		char optstring[] = "hVfp:b:B:l:t:k:H:T:w:F:r:j:zc:P:C:A:LKI:E:MS:a:s:R:Q:u:U:GY:g:x:";
 		struct option longopts[] = {
 			{"help",      no_argument,       NULL, 'h'},
 			{"version",   no_argument,       NULL, 'V'},
 			{"bind",      required_argument, NULL, 'b'},
+			{"link-bind", required_argument, NULL, 'l'},
+			{"peer",      required_argument, NULL, 'p'},
+			{"idle-timeout", required_argument, NULL, 't'},
+			{"keepalive", required_argument, NULL, 'k'},
+			{"handover",  required_argument, NULL, 'H'},
+			{"takeover",  required_argument, NULL, 'T'},
+			{"workers",   required_argument, NULL, 'w'},
+			{"fanout",    required_argument, NULL, 'F'},
+			{"history",   required_argument, NULL, 'r'},
+			{"journal",   required_argument, NULL, 'j'},
+			{"compress",  no_argument,       NULL, 'z'},
+			{"conflate",  required_argument, NULL, 'c'},
+			{"busy-poll", required_argument, NULL, 'P'},
+			{"cpu",       required_argument, NULL, 'C'},
+			{"arena",     required_argument, NULL, 'A'},
+			{"lock-arena", no_argument,      NULL, 'L'},
+			{"kernel-forwarding", no_argument, NULL, 'K'},
+			{"tcp-info",  required_argument, NULL, 'I'},
+			{"evict",     required_argument, NULL, 'E'},
+			{"lag-monitor", no_argument,     NULL, 'M'},
+			{"shed",      required_argument, NULL, 'S'},
+			{"tap",       required_argument, NULL, 'a'},
+			{"tap-every", required_argument, NULL, 's'},
+			{"tap-rate",  required_argument, NULL, 'R'},
+			{"lanes",     required_argument, NULL, 'Q'},
+			{"control",   required_argument, NULL, 'u'},
+			{"bulk",      required_argument, NULL, 'U'},
+			{"batch",     no_argument,       NULL, 'G'},
+			{"profile",   required_argument, NULL, 'Y'},
+			{"group",     required_argument, NULL, 'g'},
+			{"unroute",   required_argument, NULL, 'x'},
 			{NULL, 0, 0, 0}
 		};
 		int longindex;
@@ -87,6 +418,72 @@ int main(int argc, char* argv[]) {
 					"                                  connections.\n"
 					"                                  host and port resolving can be bypassed by\n"
 					"                                  placing [] around them\n"
+					"  --link-bind -l host:port        Accept links from other buses on the\n"
+					"                                  specified address.\n"
+					"  --peer -p host:port             Link to the bus accepting links on the\n"
+					"                                  specified address. May be repeated.\n"
+					"  --idle-timeout -t seconds       Disconnect clients that stay silent for\n"
+					"                                  this long.\n"
+					"  --keepalive -k seconds          Send a newline to clients that stay silent\n"
+					"                                  for this long.\n"
+					"  --handover -H path              Accept a new process on this Unix socket,\n"
+					"                                  hand all connections over to it and exit.\n"
+					"  --takeover -T path              Take over the listening sockets and\n"
+					"                                  connections of the process running with\n"
+					"                                  --handover on this Unix socket. --bind and\n"
+					"                                  --link-bind are ignored.\n"
+					"  --workers -w threads            Run the callbacks on this many worker\n"
+					"                                  threads.\n"
+					"  --fanout -F threads             Send to the clients from this many writer\n"
+					"                                  threads.\n"
+					"  --history -r bytes              Replay this much recent data to new\n"
+					"                                  clients.\n"
+					"  --journal -j directory          Record all traffic in a journal in this\n"
+					"                                  directory.\n"
+					"  --compress -z                   Send all clients a raw deflate stream.\n"
+					"  --conflate -c bytes             Once a client lags this much, only send it\n"
+					"                                  the latest message per first word.\n"
+					"  --busy-poll -P microseconds     Keep polling this long after activity,\n"
+					"                                  instead of sleeping right away.\n"
+					"  --cpu -C cpu                    Pin the bus to this CPU.\n"
+					"  --arena -A bytes                Queue data between threads in an arena of\n"
+					"                                  this size.\n"
+					"  --lock-arena -L                 Lock the arena in memory.\n"
+					"  --kernel-forwarding -K          Forward between two clients in the kernel,\n"
+					"                                  if possible.\n"
+					"  --tcp-info -I seconds           Sample the TCP state of every client this\n"
+					"                                  often, and report it on errors.\n"
+					"  --evict -E bytes                With --tcp-info, drop clients whose send\n"
+					"                                  queue keeps growing beyond this.\n"
+					"  --lag-monitor -M                Measure the lag of the loop; SIGUSR1 prints\n"
+					"                                  the measurements.\n"
+					"  --shed -S accept,read,evict     Shed load from these lags (in ms, 0 to\n"
+					"                                  skip): stop accepting clients, read less\n"
+					"                                  per client, drop the slowest client.\n"
+					"  --tap -a host:port              Accept taps on the specified address: they\n"
+					"                                  receive a sample of the traffic, in the\n"
+					"                                  format of the journal.\n"
+					"  --tap-every -s N                Send taps one in every N messages.\n"
+					"  --tap-rate -R bytes             Send each tap at most this many bytes per\n"
+					"                                  second.\n"
+					"  --lanes -Q bytes                Queue the backlog of clients per priority,\n"
+					"                                  with at most this much in order.\n"
+					"  --control -u id                 Send what client number id sends at\n"
+					"                                  control priority. May be repeated.\n"
+					"  --bulk -U id                    Send what client number id sends at bulk\n"
+					"                                  priority. May be repeated.\n"
+					"  --batch -G                      Report what is received per iteration of\n"
+					"                                  the loop.\n"
+					"  --profile -Y preset[,option=value...]\n"
+					"                                  Tune the sockets of clients with a preset:\n"
+					"                                  default, latency, throughput or lean. The\n"
+					"                                  options nodelay, sndbuf, rcvbuf,\n"
+					"                                  notsent-lowat, rcvlowat and backlog\n"
+					"                                  override it.\n"
+					"  --group -g id,group             Put client number id in this group.\n"
+					"                                  May be repeated.\n"
+					"  --unroute -x from,to            Don't send what group from sends to group\n"
+					"                                  to. May be repeated.\n"
 					;
 				if( opt == '?' ) exit(EX_USAGE);
 				exit(EX_OK);
@@ -110,50 +507,128 @@ int main(int argc, char* argv[]) {
 			case 'b':
 				options.bind_addr_listen = optarg;
 				break;
+			case 'l':
+				options.bind_addr_link = optarg;
+				break;
+			case 'p':
+				options.peers.push_back(optarg);
+				break;
+			case 't':
+				options.idle_timeout = strtod(optarg, NULL);
+				break;
+			case 'k':
+				options.keepalive_interval = strtod(optarg, NULL);
+				break;
+			case 'H':
+				options.handover_path = optarg;
+				break;
+			case 'T':
+				options.takeover_path = optarg;
+				break;
+			case 'w':
+				options.workers = atoi(optarg);
+				break;
+			case 'F':
+				options.fanout = atoi(optarg);
+				break;
+			case 'r':
+				options.history = strtoul(optarg, NULL, 10);
+				break;
+			case 'j':
+				options.journal_dir = optarg;
+				break;
+			case 'z':
+				options.compress = true;
+				break;
+			case 'c':
+				options.conflate = strtoul(optarg, NULL, 10);
+				break;
+			case 'P':
+				options.busy_poll = strtod(optarg, NULL) / 1e6;
+				break;
+			case 'C':
+				options.cpu = atoi(optarg);
+				break;
+			case 'A':
+				options.arena = strtoul(optarg, NULL, 10);
+				break;
+			case 'I':
+				options.tcp_sampling = atof(optarg);
+				break;
+			case 'E':
+				options.evict = strtoul(optarg, NULL, 10);
+				break;
+			case 'M':
+				options.lag_monitor = true;
+				break;
+			case 'S':
+				if( sscanf(optarg, "%lf,%lf,%lf", &options.shed[0], &options.shed[1], &options.shed[2]) != 3 ) {
+					fprintf(stderr, "Invalid --shed \"%1$s\": expected accept,read,evict\n", optarg);
+					exit(EX_USAGE);
+				}
+				options.lag_monitor = true;
+				break;
+			case 'a':
+				options.bind_addr_tap = optarg;
+				break;
+			case 's':
+				options.tap_every = strtoul(optarg, NULL, 10);
+				break;
+			case 'R':
+				options.tap_rate = strtoul(optarg, NULL, 10);
+				break;
+			case 'Q':
+				options.lanes = strtoul(optarg, NULL, 10);
+				break;
+			case 'u':
+				s_control_ids.push_back(strtoull(optarg, NULL, 10));
+				break;
+			case 'U':
+				s_bulk_ids.push_back(strtoull(optarg, NULL, 10));
+				break;
+			case 'Y':
+				options.profile = optarg;
+				break;
+			case 'G':
+				options.batch = true;
+				break;
+			case 'g': {
+				unsigned long long id;
+				unsigned int group;
+				if( sscanf(optarg, "%llu,%u", &id, &group) != 2 ) {
+					fprintf(stderr, "Invalid --group \"%1$s\": expected id,group\n", optarg);
+					exit(EX_USAGE);
+				}
+				s_groups[id] = group;
+				break;
+			}
+			case 'x': {
+				unsigned int from, to;
+				if( sscanf(optarg, "%u,%u", &from, &to) != 2 ) {
+					fprintf(stderr, "Invalid --unroute \"%1$s\": expected from,to\n", optarg);
+					exit(EX_USAGE);
+				}
+				options.unroutes.push_back(std::make_pair(from, to));
+				break;
+			}
+			case 'L':
+				options.lock_arena = true;
+				break;
+			case 'K':
+				options.kernel_forwarding = true;
+				break;
 			}
 		}
 	}
 
-	{ // Open listening socket
-		std::string host, port;
-
-		/* Address format is
-		 *   - hostname:portname
-		 *   - [numeric ip]:portname
-		 *   - hostname:[portnumber]
-		 *   - [numeric ip]:[portnumber]
-		 */
-		size_t c = options.bind_addr_listen.rfind(":");
-		if( c == std::string::npos ) {
-			/* TRANSLATORS: %1$s contains the string passed as option
-			 */
-			fprintf(stderr, "Invalid bind string \"%1$s\": could not find ':'\n", options.bind_addr_listen.c_str());
-			exit(EX_DATAERR);
-		}
-		host = options.bind_addr_listen.substr(0, c);
-		port = options.bind_addr_listen.substr(c+1);
-
-		std::auto_ptr< boost::ptr_vector< SockAddr::SockAddr> > bind_sa
-			= SockAddr::resolve( host, port, 0, SOCK_STREAM, 0);
-		if( bind_sa->size() == 0 ) {
-			fprintf(stderr, "Can not bind to \"%1$s\": Could not resolve\n", options.bind_addr_listen.c_str());
-			exit(EX_DATAERR);
-		} else if( bind_sa->size() > 1 ) {
-			// TODO: allow this
-			fprintf(stderr, "Can not bind to \"%1$s\": Resolves to multiple entries:\n", options.bind_addr_listen.c_str());
-			for( typeof(bind_sa->begin()) i = bind_sa->begin(); i != bind_sa->end(); i++ ) {
-				std::cerr << "  " << i->string() << "\n";
-			}
-			exit(EX_DATAERR);
+	if( options.takeover_path.empty() ) {
+		listen_on(s_listen, options.bind_addr_listen);
+		if( !options.bind_addr_link.empty() ) {
+			listen_on(s_link_listen, options.bind_addr_link);
 		}
-
-		s_listen = Socket::socket( (*bind_sa)[0].proto_family() , SOCK_STREAM, 0);
-		s_listen.set_reuseaddr();
-		s_listen.bind((*bind_sa)[0]);
-		s_listen.listen(MAX_CONN_BACKLOG);
-
-		std::auto_ptr<SockAddr::SockAddr> bound_addr( s_listen.getsockname() );
-		fprintf(stderr, "Listening on %s\n", bound_addr->string().c_str());
+	}
+	if( !options.bind_addr_tap.empty() ) {
+		listen_on(s_tap_listen, options.bind_addr_tap);
 	}
 
 	{
@@ -178,11 +653,164 @@ int main(int argc, char* argv[]) {
 		ev_signal_init( &ev_sigterm_watcher, received_sigterm, SIGTERM);
 		ev_signal_start( EV_DEFAULT_ &ev_sigterm_watcher);
 
-		bus = TcpBus_init(EV_DEFAULT_ s_listen);
+		if( options.takeover_path.empty() ) {
+			bus = TcpBus_init(EV_DEFAULT_ s_listen);
+			if( !options.bind_addr_link.empty() ) {
+				TcpBus_link_listen(bus, s_link_listen);
+			}
+		} else {
+			struct sockaddr_un sa;
+			socklen_t sa_len = unix_addr(&sa, options.takeover_path);
+			Socket s( Socket::socket(AF_UNIX, SOCK_STREAM, 0) );
+			s.connect(reinterpret_cast<struct sockaddr*>(&sa), sa_len);
+
+			int listen_fd, link_listen_fd;
+			bus = TcpBus_takeover(EV_DEFAULT_ s, &listen_fd, &link_listen_fd);
+			if( bus == NULL ) {
+				fprintf(stderr, "Could not take over from \"%1$s\": %2$s\n", options.takeover_path.c_str(), strerror(errno));
+				exit(EX_UNAVAILABLE);
+			}
+			s_listen.reset(listen_fd);
+			if( link_listen_fd != -1 ) s_link_listen.reset(link_listen_fd);
+			fprintf(stderr, "Took over from %s\n", options.takeover_path.c_str());
+		}
+		fprintf(stderr, "Listening on %s\n", s_listen.getsockname().string().c_str());
+		if( s_link_listen != -1 ) {
+			fprintf(stderr, "Accepting bus links on %s\n", s_link_listen.getsockname().string().c_str());
+		}
+
 		TcpBus_callback_newcon_add(bus, received_newcon);
+		if( options.compress ) TcpBus_callback_newcon_add(bus, compress_newcon);
+		if( !s_control_ids.empty() || !s_bulk_ids.empty() ) {
+			TcpBus_callback_newcon_add(bus, priority_newcon);
+		}
+		if( !s_groups.empty() ) TcpBus_callback_newcon_add(bus, group_newcon);
+		if( options.batch ) TcpBus_callback_rx_batch_add(bus, received_batch);
 		TcpBus_callback_error_add(bus, received_error);
 		TcpBus_callback_disconnect_add(bus, received_disconnect);
 
+		for( size_t i = 0; i < options.unroutes.size(); i++ ) {
+			if( TcpBus_route(bus, options.unroutes[i].first, options.unroutes[i].second, 0) == -1 ) {
+				fprintf(stderr, "Can not unroute %1$u,%2$u: %3$s\n", options.unroutes[i].first,
+				        options.unroutes[i].second, strerror(errno));
+				exit(EX_USAGE);
+			}
+		}
+
+		if( !options.profile.empty() ) {
+			struct TcpBus_socket_profile profile;
+			parse_profile(options.profile, &profile);
+			if( TcpBus_set_socket_profile(bus, &profile) == -1 ) {
+				fprintf(stderr, "Can not use profile \"%1$s\": %2$s\n",
+				        options.profile.c_str(), strerror(errno));
+				exit(EX_USAGE);
+			}
+		}
+		if( options.arena > 0
+		 && TcpBus_arena(bus, options.arena, options.lock_arena ? TcpBus_ARENA_MLOCK : 0) == -1 ) {
+			fprintf(stderr, "Can not set up the arena: %s\n", strerror(errno));
+			exit(EX_OSERR);
+		}
+		if( options.workers > 0
+		 && TcpBus_callback_workers(bus, options.workers, 1024, TcpBus_WORKER_BLOCK) == -1 ) {
+			fprintf(stderr, "Can not start workers: %s\n", strerror(errno));
+			exit(EX_OSERR);
+		}
+		if( ( options.busy_poll > 0 || options.cpu >= 0 )
+		 && TcpBus_set_busy_poll(bus, options.cpu, options.busy_poll) == -1 ) {
+			fprintf(stderr, "Can not busy poll: %s\n", strerror(errno));
+			exit(EX_USAGE);
+		}
+		if( options.kernel_forwarding ) {
+			if( TcpBus_kernel_forwarding(bus, 1) == -1 ) {
+				fprintf(stderr, "Kernel forwarding not available: %s\n", strerror(errno));
+			} else {
+				fprintf(stderr, "Kernel forwarding enabled\n");
+			}
+		}
+
+		if( options.tcp_sampling > 0
+		 && TcpBus_set_tcp_sampling(bus, options.tcp_sampling, options.evict) == -1 ) {
+			fprintf(stderr, "Can not sample TCP state: %s\n", strerror(errno));
+			exit(EX_USAGE);
+		}
+
+		if( s_tap_listen != -1 ) {
+			if( TcpBus_tap_listen(bus, s_tap_listen, options.tap_every, options.tap_rate) == -1 ) {
+				fprintf(stderr, "Can not accept taps: %s\n", strerror(errno));
+				exit(EX_USAGE);
+			}
+			fprintf(stderr, "Accepting taps on %s\n", s_tap_listen.getsockname().string().c_str());
+		}
+
+		ev_signal ev_sigusr1_watcher;
+		if( options.lag_monitor ) {
+			if( TcpBus_set_lag_shedding(bus, options.shed[0] / 1000, options.shed[1] / 1000,
+			                            options.shed[2] / 1000) == -1 ) {
+				fprintf(stderr, "Can not shed load: %s\n", strerror(errno));
+				exit(EX_USAGE);
+			}
+			ev_signal_init( &ev_sigusr1_watcher, received_sigusr1, SIGUSR1);
+			ev_sigusr1_watcher.data = bus;
+			ev_signal_start( EV_DEFAULT_ &ev_sigusr1_watcher);
+		}
+		if( options.lanes > 0 && TcpBus_priority_lanes(bus, options.lanes) == -1 ) {
+			fprintf(stderr, "Can not use priority lanes: %s\n", strerror(errno));
+			exit(EX_USAGE);
+		}
+		if( options.conflate > 0
+		 && TcpBus_set_conflation(bus, options.conflate, first_word) == -1 ) {
+			fprintf(stderr, "Can not conflate: %s\n", strerror(errno));
+			exit(EX_USAGE);
+		}
+		if( options.fanout > 0 && TcpBus_fanout_threads(bus, options.fanout) == -1 ) {
+			fprintf(stderr, "Can not start writers: %s\n", strerror(errno));
+			exit(EX_OSERR);
+		}
+
+		if( options.history > 0 && TcpBus_set_history(bus, options.history, 0) == -1 ) {
+			fprintf(stderr, "Can not keep history: %s\n", strerror(errno));
+			exit(EX_USAGE);
+		}
+
+		if( !options.journal_dir.empty()
+		 && TcpBus_journal(bus, options.journal_dir.c_str(), 16*1024*1024) == -1 ) {
+			fprintf(stderr, "Can not record a journal: %s\n", strerror(errno));
+			exit(EX_CANTCREAT);
+		}
+
+		if( options.idle_timeout > 0 ) {
+			TcpBus_set_idle_timeout(bus, options.idle_timeout);
+		}
+		if( options.keepalive_interval > 0 ) {
+			TcpBus_set_keepalive(bus, options.keepalive_interval, "\n", 1);
+		}
+
+		// Peers are resolved without blocking the loop
+		SockAddr::Resolver resolver(EV_DEFAULT);
+		std::vector<struct peer> peers(options.peers.size());
+		for( size_t i = 0; i < options.peers.size(); i++ ) {
+			std::string host, port;
+			split_addr(options.peers[i], &host, &port);
+			peers[i].bus = bus;
+			peers[i].addr = options.peers[i];
+			resolver.resolve(host, port, peer_resolved, &peers[i], 0, SOCK_STREAM);
+		}
+
+		ev_io ev_handover_watcher;
+		if( !options.handover_path.empty() ) {
+			struct sockaddr_un sa;
+			socklen_t sa_len = unix_addr(&sa, options.handover_path);
+			s_handover = Socket::socket(AF_UNIX, SOCK_STREAM, 0);
+			unlink(options.handover_path.c_str()); // Our predecessor may still be using it
+			s_handover.bind(reinterpret_cast<struct sockaddr*>(&sa), sa_len);
+			s_handover.listen(1);
+
+			ev_io_init( &ev_handover_watcher, received_handover, s_handover, EV_READ);
+			ev_handover_watcher.data = bus;
+			ev_io_start( EV_DEFAULT_ &ev_handover_watcher);
+		}
+
 		fprintf(stderr, "Setup done, starting event loop\n");
 
 		ev_run(EV_DEFAULT_ 0);
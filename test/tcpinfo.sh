@@ -0,0 +1,24 @@
+#!/bin/bash
+
+# Check that a client that does not read is dropped once its send queue keeps
+# growing beyond --evict, well before the bus would drop it for lagging, and
+# that its TCP state is reported.
+
+. $(dirname $0)/common.sh
+
+start_bus bus -I 0.1 -E 100000
+PORT=$(port bus)
+
+exec 3<>/dev/tcp/127.0.0.1/$PORT
+exec 4<>/dev/tcp/127.0.0.1/$PORT # Never reads
+sleep 0.2
+
+# 600 kB in total: less than the bus queues before dropping a client anyway
+for i in $(seq 30); do
+	printf '%*s\n' 20000 '' >&3
+	sleep 0.05
+done
+
+wait_for tcpinfo-bus.log "error in .*No buffer space available (rtt .* ms"
+[ $(grep -c "^error in" tcpinfo-bus.log) = 1 ] || fail "the sending client was dropped too"
+exit 0